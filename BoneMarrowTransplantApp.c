@@ -1,43 +1,798 @@
+// POSIX read-write locks, large-file offsets, and the BSD flock and madvise calls, in any C dialect
+#define _POSIX_C_SOURCE 200809L
+#define _DEFAULT_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <math.h> // `pow` in the data generator; link with -lm
+#include <time.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#endif
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifdef _WIN32
+#define fileTell _ftelli64
+#define fileSeek(file, offset) _fseeki64(file, offset, SEEK_SET)
+#else
+#define fileTell ftello
+#define fileSeek(file, offset) fseeko(file, (off_t)(offset), SEEK_SET)
+#endif
 
-#define MAX_PERSONS 1000
 #define MAX_UNITS 100
 
+// Locus schema of the typing panel: X(locus, bases) for every gene of a record, in record order.
+// Another panel is chosen at build time, for example with
+// -D'LOCUS_SCHEMA(X)=X(0, 21) X(1, 21) X(2, 21) X(3, 21) X(4, 21) X(5, 18)'. The record layout,
+// the text formats and the match kernels are all expanded from it, so the kernels of every schema
+// are unrolled over its loci at compile time.
+#ifndef LOCUS_SCHEMA
+#define LOCUS_SCHEMA(X) X(0, 21) X(1, 21) X(2, 21) X(3, 21) X(4, 21)
+#endif
+
+#define LOCUS_COUNT(locus, bases) + 1
+#define LOCUS_SIZE_MEMBER(locus, bases) char locus_##locus[bases];
+#define LOCUS_LENGTH_ENTRY(locus, bases) bases,
+#define LOCUS_SCAN_FORMAT(locus, bases) " %" #bases "s%n",
+
+// One member per locus, so its size is the length of the longest locus
+typedef union locusSizes {
+    LOCUS_SCHEMA(LOCUS_SIZE_MEMBER)
+} locusSizes;
+
+#define NUM_LOCI (0 LOCUS_SCHEMA(LOCUS_COUNT))   // Number of genes (loci) stored for every person
+#define LOCUS_LENGTH ((int)sizeof(locusSizes))    // Number of bases of the longest locus
+#define LOCUS_SEGMENTS 4        // Segments of a gene in the segment index (tolerates up to 3 mismatches)
+#define DONOR_BLOCK_SIZE 256    // Donors scored together by the batch search
+#define BLOCK_FILTER_BITS 1024  // Bits of the allele filter of every locus of a donor block
+#define RECORD_BLOCK_SIZE 65536 // Bytes read at a time when scanning a text database or unit
+#define DELTA_COMPACT_LIMIT 8   // Deltas of a database after which `update` compacts it
+#define DELTA_MANIFEST_EXTENSION ".deltas"
+#define DATABASE_LOCK_EXTENSION ".lock"      // Held while the parts or the manifest of a database change
+#define COMPACT_LOCK_EXTENSION ".compacting" // Held for the whole compaction of a database
+#define MATCH_PLAN_WARMUP 64    // Donors of a query compared on every locus before the loci are first ordered
+#define MATCH_PLAN_INTERVAL 128 // Afterwards one donor in this many is compared on every locus
+#define MATCH_PLAN_HISTORY 4096 // Sampled donors after which the locus statistics are halved
+
+
+// Bases of every locus, and the `fscanf` conversion that reads one gene of it (with a trailing %n)
+static const int locusLengths[NUM_LOCI] = { LOCUS_SCHEMA(LOCUS_LENGTH_ENTRY) };
+static const char* const locusScanFormats[NUM_LOCI] = { LOCUS_SCHEMA(LOCUS_SCAN_FORMAT) };
 
-int matchesArray[MAX_PERSONS]; // Global variable to store match counts for sorting
 // Define the person structure
 typedef struct person {
     char name[31];
     char id[10];
-    char genes[5][22];
+    char genes[NUM_LOCI][LOCUS_LENGTH + 1];
 } person;
 
+// Compact form of a person's genes: every base takes 2 bits, so one locus fits in a 64-bit word.
+// Bits 0..2 * LOCUS_LENGTH - 1 hold the bases (base i at bits 2i..2i+1), bits 56..61 hold the
+// sequence length.
+typedef struct packedGenes {
+    uint64_t loci[NUM_LOCI];
+} packedGenes;
+
+#define PACKED_LENGTH_SHIFT 56
+#define PACKED_BASES_MASK ((1ULL << (2 * LOCUS_LENGTH)) - 1)
+#define PACKED_LOW_BITS 0x5555555555555555ULL // The low bit of every 2-bit base
+#define PACKED_INVALID UINT64_MAX               // Never equal to a packed gene
+
+_Static_assert(LOCUS_LENGTH <= PACKED_LENGTH_SHIFT / 2, "the bases of a locus must fit below the packed length");
+_Static_assert(NUM_LOCI >= 1 && NUM_LOCI < 31, "a locus schema has 1 to 30 loci");
+
+#define BINARY_DB_MAGIC "BMDB"
+#define BINARY_DB_VERSION 1
+#define BINARY_DB_EXTENSION ".bmdb"
+#define DICTIONARY_DB_EXTENSION ".bmdd"
+#define BINARY_RAW_ID UINT32_MAX // Record keeps its ID and genes as strings in the names section
+#define BINARY_ENCODING_PACKED 0     // Records hold packed genes (binaryRecord)
+#define BINARY_ENCODING_DICTIONARY 1 // Records hold allele IDs into per-locus dictionaries (dictionaryRecord)
+#define DICTIONARY_NO_ALLELE UINT32_MAX // Allele ID of the loci of raw records, and of alleles missing from a dictionary
+
+// Output format of a unified database
+typedef enum databaseFormat {
+    DB_FORMAT_TEXT,       // Fixed-width text records
+    DB_FORMAT_BINARY,     // Header followed by fixed-size binary records
+    DB_FORMAT_DICTIONARY  // Binary records whose genes are allele IDs (see `dictionaryRecord`)
+} databaseFormat;
+
+// Header at the start of a binary database file
+typedef struct binaryDatabaseHeader {
+    char magic[4];           // BINARY_DB_MAGIC
+    uint32_t version;        // BINARY_DB_VERSION
+    uint32_t numLoci;        // Genes per record (NUM_LOCI)
+    uint32_t locusLength;    // Bases per gene (LOCUS_LENGTH)
+    uint32_t recordSize;     // sizeof(binaryRecord) or sizeof(dictionaryRecord)
+    uint32_t encoding;       // BINARY_ENCODING_PACKED or BINARY_ENCODING_DICTIONARY
+    uint64_t recordCount;    // Number of records
+    uint64_t recordsOffset;  // File offset of the first record
+    uint64_t namesOffset;    // File offset of the names section
+    uint64_t namesSize;      // Size of the names section in bytes
+} binaryDatabaseHeader;
+
+// One donor in a binary database
+typedef struct binaryRecord {
+    packedGenes genes;   // Packed genes
+    uint32_t id;         // Numeric ID, or BINARY_RAW_ID
+    uint32_t nameOffset; // Offset of the null-terminated name in the names section
+} binaryRecord;
+
+// Follows the header of a dictionary-encoded binary database
+typedef struct binaryDictionaryHeader {
+    uint64_t allelesOffset[NUM_LOCI]; // File offset of the packed alleles of every locus, in allele ID order
+    uint64_t alleleCount[NUM_LOCI];   // Number of distinct alleles of every locus
+    uint64_t rawCount;                // Number of records with id == BINARY_RAW_ID
+} binaryDictionaryHeader;
+
+// One donor in a dictionary-encoded binary database
+typedef struct dictionaryRecord {
+    uint32_t alleles[NUM_LOCI]; // Allele IDs, DICTIONARY_NO_ALLELE when id == BINARY_RAW_ID
+    uint32_t id;                // Numeric ID, or BINARY_RAW_ID
+    uint32_t nameOffset;        // Offset of the null-terminated name in the names section
+} dictionaryRecord;
+
+// Allele IDs of one locus assigned while a dictionary-encoded database is written
+typedef struct alleleDictionary {
+    uint64_t* alleles;   // Packed allele of every ID
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t* slots;     // Open-addressing table of ID + 1 (0 marks an empty slot)
+    size_t slotCount;    // A power of two
+} alleleDictionary;
+
+// State of a binary database being written by createDatabase
+typedef struct binaryDatabaseWriter {
+    FILE* file;
+    uint64_t recordCount;
+    char* names;            // Names section, written out at the end
+    size_t namesSize;
+    size_t namesCapacity;
+    uint32_t encoding;      // BINARY_ENCODING_PACKED or BINARY_ENCODING_DICTIONARY
+    alleleDictionary dictionaries[NUM_LOCI];
+    uint64_t rawCount;
+} binaryDatabaseWriter;
+
+// Buffered output of a text database being written by createDatabase (see `writeTextRecord`)
+typedef struct textWriter {
+    FILE* file;
+    char* buffer;
+    size_t used;
+    size_t capacity;
+    uint64_t offset;  // Offset in the file of the next byte written, buffered or not
+} textWriter;
+
+// Set of donor IDs, used to skip records that were already written
+typedef struct idSet {
+    uint32_t* slots;        // Open-addressing table of 9-digit IDs, each stored as value + 1 (0 = empty)
+    size_t capacity;        // Number of slots, a power of two
+    size_t count;           // Number of IDs in the set
+    char (*otherIDs)[10];   // IDs that are not 9 digits
+    size_t otherCount;
+    size_t otherCapacity;
+} idSet;
+
+#define INDEX_MAGIC "BMIX"
+#define INDEX_VERSION 2
+#define INDEX_EXTENSION ".idx"
+#define SEGMENT_INDEX_EXTENSION ".seg"
+#define INDEX_MAX_COLUMNS (NUM_LOCI * LOCUS_SEGMENTS)
+#define ALLELE_HASHED_KEY (1ULL << 63) // Set in the key of an allele that cannot be packed
+
+// Header at the start of an allele index file
+typedef struct alleleIndexHeader {
+    char magic[4];                     // INDEX_MAGIC
+    uint32_t version;                  // INDEX_VERSION
+    uint32_t numColumns;               // Key columns: NUM_LOCI, or NUM_LOCI * LOCUS_SEGMENTS in a segment index
+    uint32_t segments;                 // Segments per locus (LOCUS_SEGMENTS), 0 in an allele index
+    uint64_t recordCount;              // Number of donors in the database
+    uint64_t databaseSize;             // Size of the database file when the index was written
+    int64_t databaseMtime;             // Modification time of the database file when the index was written
+    uint64_t offsetsOffset;            // Offset of the record offsets of a text database, 0 for binary databases
+    uint64_t entriesOffset[INDEX_MAX_COLUMNS];  // Offset of the sorted key entries of each column
+    uint64_t entryCount[INDEX_MAX_COLUMNS];     // Number of distinct keys of each column
+    uint64_t postingsOffset[INDEX_MAX_COLUMNS]; // Offset of the postings (recordCount ordinals) of each column
+} alleleIndexHeader;
+
+// One distinct key of a column and the range of its donors in the postings
+typedef struct alleleIndexEntry {
+    uint64_t allele; // Allele key (see alleleKey) or segment key (see segmentKey)
+    uint32_t first;  // First postings entry of the allele
+    uint32_t count;  // Number of donors with the allele
+} alleleIndexEntry;
+
+// Keys and record offsets collected while createDatabase writes a database
+typedef struct alleleIndexBuilder {
+    uint64_t* keys;    // `columns` keys per donor
+    uint64_t* offsets; // Record offset per donor
+    size_t count;
+    size_t capacity;
+    int textOffsets;   // 1 if the record offsets are written to the index
+    int segments;      // LOCUS_SEGMENTS for a segment index, 0 for an allele index
+    int columns;       // Keys per donor
+} alleleIndexBuilder;
+
+#define ID_INDEX_MAGIC "BMII"
+#define ID_INDEX_VERSION 2
+#define ID_INDEX_EXTENSION ".ids"
+
+// Header at the start of an ID index file, followed by `entryCount` entries in ascending ID order
+typedef struct idIndexHeader {
+    char magic[4];          // ID_INDEX_MAGIC
+    uint32_t version;       // ID_INDEX_VERSION
+    uint64_t recordCount;   // Number of donors in the database
+    uint64_t entryCount;    // Number of donors with a 9-digit ID
+    uint64_t otherCount;    // Number of donors with any other ID; they are only found by a scan
+    uint64_t databaseSize;  // Size of the database file when the index was written
+    int64_t databaseMtime;  // Modification time of the database file when the index was written
+    uint64_t stamp;         // Version stamp of the database, newer on every rebuild (see `writeIdIndex`)
+} idIndexHeader;
+
+// Location of the donor of one ID
+typedef struct idIndexEntry {
+    uint32_t id;      // Numeric ID (see parseDonorId)
+    uint32_t ordinal; // Position of the donor in the database
+    uint64_t offset;  // File offset of the record in a text database, 0 in a binary one
+} idIndexEntry;
+
+// Entries collected while createDatabase writes a database
+typedef struct idIndexBuilder {
+    idIndexEntry* entries;
+    size_t count;
+    size_t capacity;
+    uint64_t records;       // Donors added, with or without a 9-digit ID
+} idIndexBuilder;
+
+// States of the read-ahead block of a record reader
+typedef enum prefetchState {
+    PREFETCH_IDLE,    // No block is read ahead
+    PREFETCH_READING, // The prefetch thread is reading the next block
+    PREFETCH_READY    // The next block is read
+} prefetchState;
+
+// Read-ahead of a record reader: a thread reads the next block while the current one is parsed
+typedef struct recordPrefetch {
+    FILE* file;
+    char* block;            // The block read ahead
+    size_t capacity;        // Size of the block
+    size_t length;          // Bytes read into the block
+    prefetchState state;
+    int stop;               // Set to end the thread
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // Signalled whenever `state` or `stop` changes
+    pthread_t thread;
+} recordPrefetch;
+
+// Buffered reader of text records (see `readRecord`)
+typedef struct recordReader {
+    FILE* file;
+    char* buffer;
+    size_t capacity;  // Size of the buffer
+    size_t position;  // Next unread byte of the buffer
+    size_t length;    // Bytes held in the buffer
+    uint64_t offset;  // File offset of the first buffered byte
+    recordPrefetch* prefetch; // NULL when every block is read when it is needed
+} recordReader;
+
+// Strings of the donors of blocks, stored one after the other (see `appendArenaString`)
+typedef struct nameArena {
+    char* data;
+    size_t size;
+    size_t capacity;
+} nameArena;
+
+// Donors of a database stored one field per column (see `fillDonorBlock`)
+typedef struct donorBlock {
+    uint64_t loci[NUM_LOCI][DONOR_BLOCK_SIZE];  // Allele keys (see alleleKey)
+    uint64_t masks[NUM_LOCI][DONOR_BLOCK_SIZE]; // packedBaseMask of every allele key
+    uint64_t present[NUM_LOCI][BLOCK_FILTER_BITS / 64]; // Bloom filter of the allele keys of every locus
+    uint32_t ids[DONOR_BLOCK_SIZE];             // Numeric IDs, BINARY_RAW_ID for donors kept as strings
+    uint32_t names[DONOR_BLOCK_SIZE];           // Offsets of the names in the arena of the block
+    unsigned char hashed[DONOR_BLOCK_SIZE];     // 1 for donors with an allele that cannot be packed
+    int size;
+} donorBlock;
+
+// Merge of the postings lists of one patient in an allele or segment index (see `nextIndexCandidate`)
+typedef struct indexCursor {
+    const uint32_t* lists[INDEX_MAX_COLUMNS];
+    uint32_t lengths[INDEX_MAX_COLUMNS];
+    uint32_t positions[INDEX_MAX_COLUMNS];
+    int remaining[NUM_LOCI]; // Lists of every locus that are not used up
+    int liveLoci;            // Loci that can still be candidates
+    int perLocus;            // Columns per locus
+    int need;                // Hits among its columns that make a locus a candidate
+    int min_match;
+} indexCursor;
+
+// Read-only view of a whole file
+typedef struct mappedFile {
+    const unsigned char* data;
+    size_t size;
+    int mapped; // 1 if data is a memory mapping, 0 if it is a heap copy
+} mappedFile;
+
+// Sequential reader of the donors of a text or binary database (see `readSourceDonor`)
+typedef struct donorSource {
+    mappedFile file;                    // Mapping of a binary database
+    const binaryDatabaseHeader* header; // NULL for a text database
+    FILE* dbFile;                       // Open text database
+    recordReader reader;
+    int ownsFile;                       // 0 if the text stream belongs to the caller (see `openDonorStream`)
+    int unitNames;                      // 1 to read the names of a text database as a unit has them (see `restoreUnitName`)
+    uint64_t next;                      // Next record
+} donorSource;
+
+// The part of a database that `writeDatabase` writes to one shard (see `donorInShard`)
+typedef struct databaseShard {
+    int count;       // Number of shards
+    int index;       // This shard, from 0
+    int byName;      // 1 for ranges of the name order, 0 for a hash of the ID
+    uint64_t total;  // Donors of the whole database; sets the name ranges
+    uint64_t seen;   // Distinct donors merged so far
+} databaseShard;
+
+// Order in which one query compares the loci of its donors (see `countPlannedMatches`)
+typedef struct matchPlan {
+    int minMatch;             // Matches a donor needs to qualify
+    int maxMismatches;        // Mismatched bases a locus tolerates (-1 for exact matching)
+    int order[NUM_LOCI];      // Loci in compare order, the ones that reject the most donors first
+    uint32_t hits[NUM_LOCI];  // Matches of every locus among the sampled donors
+    uint32_t samples;         // Donors sampled since the hits were last halved
+    uint32_t countdown;       // Donors until the next sample
+    uint64_t compared;        // Loci compared, added to the run statistics by `finishMatchPlan`
+} matchPlan;
+
+// A potential donor together with the number of genes it shares with the patient
+typedef struct donorMatch {
+    person donor;
+    int matches;
+} donorMatch;
+
+// Memory of one query at a time: results and scratch space, released all at once (see `arenaAlloc`)
+typedef struct queryArena {
+    unsigned char* block;  // Reused by every query
+    size_t capacity;       // Size of `block`
+    size_t used;           // Bytes of `block` handed out since the last reset
+    void** overflow;       // Allocations of the current query that did not fit in `block`
+    int overflowCount;
+    int overflowCapacity;
+    size_t overflowBytes;  // Bytes of the overflow allocations
+    size_t peak;           // Most bytes used by one query
+} queryArena;
+
+// A donor being ranked, with the prefix key of its cleaned name (see `rankDonors`)
+typedef struct rankedName {
+    uint64_t prefix;
+    const donorMatch* donor;
+} rankedName;
+
+// Growable list of potential donors
+typedef struct donorList {
+    donorMatch* items;
+    int size;
+    int capacity;
+    queryArena* arena; // Where `items` is allocated; NULL for the heap (freed with `free(items)`)
+} donorList;
+
+// Receives every qualifying donor of a search; returning non-zero stops the search
+typedef int (*donorVisitor)(const person* donor, int matches, void* context);
+
+// Visitor that forwards donors to another one and remembers whether it asked to stop
+typedef struct chainedVisitor {
+    donorVisitor visitor;
+    void* context;
+    int stopped;
+} chainedVisitor;
+
+// One shard of a parallel database scan
+typedef struct scanShard {
+    char* database;                       // Database file name
+    const binaryDatabaseHeader* header;   // Mapped binary database, or NULL for a text database
+    const person* patient;
+    int min_match;
+    uint64_t begin;                       // First byte (text) or record (binary) of the shard
+    uint64_t end;                         // One past the last byte or record of the shard
+    donorList results;                    // Qualifying donors of the shard, in database order
+} scanShard;
+
+// Name of the current record of a merged unit, prepared once for ordering (see `makeNameKey`)
+typedef struct nameKey {
+    uint64_t prefix;   // First 8 compared bytes, big-endian and zero padded (see `namePrefixKey`)
+    const char* name;  // The compared bytes, inside the record's name
+    size_t length;     // Number of compared bytes
+} nameKey;
+
+// A record of an unsorted unit, numbered so that records of the same name keep their order
+typedef struct unitRecord {
+    person donor;
+    size_t order;
+} unitRecord;
+
+// Sorted runs of one unit, as temporary files in the unit format
+typedef struct unitRuns {
+    FILE** files;
+    int count;
+} unitRuns;
+
+// Units sorted by one thread: every `step`-th unit from `first` (see `sortUnitRuns`)
+typedef struct unitSortJob {
+    FILE** units;
+    int numberOfUnits;
+    int first;
+    int step;
+    size_t capacity;  // Records sorted in memory at a time
+    unitRuns* runs;   // Runs of every unit, indexed by unit
+} unitSortJob;
+
+// Database held in memory by the server (see `loadDonorStore`)
+typedef struct donorStore {
+    donorBlock* blocks;                     // All donors, in database order
+    nameArena names;                        // Names (and strings of raw donors) of all the blocks
+    int blockCount;
+    long donorCount;
+    int baseBlocks;                         // Blocks of the base database; the blocks of its deltas follow
+    long baseCount;                         // Donors of the base database
+    uint64_t size[4];                       // Sizes of the database and its two index files, and the number of deltas
+    int64_t mtime[4];                       // Modification times of the same files and of the delta manifest
+    uint64_t version;                       // Version of the database and its deltas (see `databaseVersion`)
+    mappedFile indexFile;
+    const alleleIndexHeader* index;         // Allele index, NULL if missing or stale
+    mappedFile segmentFile;
+    const alleleIndexHeader* segmentIndex;  // Segment index, NULL if missing or stale
+} donorStore;
+
+#define RESULT_CACHE_ENTRIES 1024   // Patients whose results the server keeps
+#define RESULT_CACHE_DONORS 262144  // Donors kept by the server over all cached results
+#define RESULT_CACHE_MIN_MATCH 2    // Floor a query is computed down to once a lower minimal match arrives for its patient
+
+// Results of one patient in the result cache of the server
+typedef struct resultCacheEntry {
+    char genes[NUM_LOCI][LOCUS_LENGTH + 1]; // The patient's alleles
+    int floor;                 // Every donor with at least `floor` matches is in `donors`
+    uint64_t lastUse;          // Value of the cache clock at the last query of the patient
+    donorList donors;          // In database order, with their match counts
+} resultCacheEntry;
+
+// Recent query results of the server (see `lookupResultCache`)
+typedef struct resultCache {
+    resultCacheEntry* entries; // RESULT_CACHE_ENTRIES entries, `count` of them used
+    int count;
+    long donors;               // Donors held by all the entries
+    uint64_t clock;            // Counts the queries answered by or added to the cache
+    pthread_mutex_t lock;      // Queries run concurrently under the read lock of the server
+} resultCache;
+
+// State shared by the clients of the server
+typedef struct donorServer {
+    char* database;
+    donorStore store;
+    resultCache cache;
+    pthread_rwlock_t lock; // Held for reading by queries and for writing by a reload
+} donorServer;
+
+// One socket client of the server, handed to its thread
+typedef struct serverClient {
+    donorServer* server;
+    int socket;
+} serverClient;
+
+// Connection of the coordinator to one shard server
+typedef struct shardConnection {
+    const char* path; // Socket of the shard server
+    FILE* in;         // Responses of the server; NULL while not connected
+    FILE* out;        // Requests to the server
+} shardConnection;
+
+// Settings of the synthetic collections written by `gen` (see `generateUnits`)
+typedef struct generatorSettings {
+    uint64_t seed;
+    int duplicateRate; // Percent of the records that repeat an earlier donor
+    int sharingRate;   // Percent of the alleles drawn from the common pool of their locus
+    int sorted;        // 1 to sort every unit by name, as `createDatabase` expects
+} generatorSettings;
+
+// Settings of the search functions, changed by command line options
+typedef struct searchSettings {
+    int threads;       // Worker threads of a full database scan (1 scans on the calling thread)
+    int maxMismatches; // Mismatched bases a locus tolerates in near-match search (-1 for exact matching)
+    int verbose;       // 1 to report every donor found during a search, 0 for quiet scripted output
+    long sortMemory;   // Bytes of unit records sorted in memory at a time, 0 if the units are already sorted
+    int stats;         // 0 without run statistics, 1 for a summary, 2 for JSON (see `reportStats`)
+    int prefetch;      // 1 to read the next block of a sequential text scan ahead (see `startRecordPrefetch`)
+} searchSettings;
+
+searchSettings searchConfig = { 1, -1, 1, 0, 0, 1 };
+
+// Phases of a run measured by the run statistics
+typedef enum statsPhase {
+    STATS_READ,        // Blocks read from text files
+    STATS_PARSE,       // Text records parsed
+    STATS_CLEAN_NAME,  // Names cleaned
+    STATS_DEDUP,       // Probes of the set of written IDs
+    STATS_MERGE,       // Records selected by the merge of `writeDatabase`
+    STATS_MATCH,       // Donors compared with a patient
+    STATS_RANK,        // Rankings of search results
+    STATS_OUTPUT,      // Writes of database output
+    STATS_PHASES
+} statsPhase;
+
+// Counters of every phase, shared by all threads
+typedef struct runStats {
+    _Atomic uint64_t count[STATS_PHASES];
+    _Atomic uint64_t amount[STATS_PHASES];       // Second counter of the phase (see `statsAmountNames`)
+    _Atomic uint64_t nanoseconds[STATS_PHASES];
+    _Atomic uint64_t arenaPeak;                  // Most bytes of a query arena used by one query
+    _Atomic uint64_t lociCompared;               // Loci compared by the match plans (see `finishMatchPlan`)
+} runStats;
+
 // Function prototypes
 void createDatabase(FILE** units, int numberOfUnits, char* filename);
-person* getPotentialDonors(char* database, person patient, int min_match, int* size);
-void printPotentialDonorsList(person* potentialDonors, int size);
+long writeDatabase(donorSource* units, int numberOfUnits, char* filename, databaseFormat format, idSet* processedIDs,
+                   databaseShard* shard);
+long updateDatabase(char* database, FILE** units, int numberOfUnits);
+int compactDatabase(char* database);
+int mergeDatabaseDeltas(char* database);
+long shardDatabase(char* database, int shards, int byName);
+int lookupDonors(char* database, const char* const* ids, int count, person* donors, int* found);
+donorMatch* getPotentialDonors(char* database, person patient, int min_match, int* size);
+int visitPotentialDonors(char* database, const person* patient, int min_match, donorVisitor visitor, void* context);
+void printPotentialDonorsList(const donorMatch* potentialDonors, int size);
+void printTopPotentialDonors(const donorMatch* potentialDonors, int size, int topK);
+void printRankedDonors(const donorMatch* potentialDonors, int size, int topK, queryArena* scratch);
+int collectPotentialDonor(const person* donor, int matches, void* context);
+long getPotentialDonorsBatch(char* database, const person* patients, int numPatients, int min_match, donorList* results);
+int visitNearMatchDonors(char* database, const person* patient, int min_match, donorVisitor visitor, void* context);
 
 // Helper functions
 
 
 
 
+// ------------------------------------------------------------------------------------
+// Run statistics
+//
+// With --stats (a summary) or --stats-json (one JSON object), every phase of a run counts its
+// events, and the phases that take measurable time also add up their durations. The report is
+// written to standard error when the program exits. Without the options the counters cost one
+// branch per event. Timed phases can run inside each other (a merge parses and writes), so their
+// times overlap.
+
+
+const char* statsPhaseNames[STATS_PHASES] = {
+    "read", "parse", "clean_name", "dedup", "merge", "match", "rank", "output"
+};
+
+// Meaning of the second counter of every phase, NULL where it is not used
+const char* statsAmountNames[STATS_PHASES] = {
+    "bytes", NULL, NULL, "duplicates", "written", "matching_loci", "donors", "bytes"
+};
+
+// Phases whose durations are measured
+const int statsPhaseTimed[STATS_PHASES] = { 1, 1, 0, 0, 1, 0, 1, 1 };
+
+runStats statsCounters;
+double statsStartTime;
+
+
+
+
+/**
+ * @brief Returns a monotonic time in seconds, for measuring durations.
+ */
+double currentSeconds(void) {
+    struct timespec now;
+#ifdef _WIN32
+    timespec_get(&now, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+
+
+
+/**
+ * @brief Starts timing one event of a phase.
+ * 
+ * @return The current time in seconds, or 0 when the statistics are off.
+ */
+double statsStart(void) {
+    return searchConfig.stats ? currentSeconds() : 0;
+}
+
+
+
+
+/**
+ * @brief Records events of a phase.
+ * 
+ * @param phase The phase.
+ * @param count The number of events.
+ * @param amount The amount for the second counter of the phase (see `statsAmountNames`).
+ * @param start The value `statsStart` returned when the events began, or 0 for an untimed phase.
+ */
+void statsRecord(statsPhase phase, uint64_t count, uint64_t amount, double start) {
+    if (!searchConfig.stats) {
+        return;
+    }
+    atomic_fetch_add_explicit(&statsCounters.count[phase], count, memory_order_relaxed);
+    atomic_fetch_add_explicit(&statsCounters.amount[phase], amount, memory_order_relaxed);
+    if (start > 0) {
+        uint64_t nanoseconds = (uint64_t)((currentSeconds() - start) * 1e9);
+        atomic_fetch_add_explicit(&statsCounters.nanoseconds[phase], nanoseconds, memory_order_relaxed);
+    }
+}
+
+
+
+
+/**
+ * @brief Writes the statistics of the run to standard error; registered with `atexit`.
+ */
+void reportStats(void) {
+    double wall = currentSeconds() - statsStartTime;
+
+    if (searchConfig.stats == 2) {
+        fprintf(stderr, "{\"wall_seconds\":%.6f,\"phases\":{", wall);
+        for (int phase = 0; phase < STATS_PHASES; phase++) {
+            fprintf(stderr, "%s\"%s\":{\"count\":%llu", phase > 0 ? "," : "", statsPhaseNames[phase],
+                    (unsigned long long)atomic_load(&statsCounters.count[phase]));
+            if (statsAmountNames[phase]) {
+                fprintf(stderr, ",\"%s\":%llu", statsAmountNames[phase],
+                        (unsigned long long)atomic_load(&statsCounters.amount[phase]));
+            }
+            if (statsPhaseTimed[phase]) {
+                fprintf(stderr, ",\"seconds\":%.6f", atomic_load(&statsCounters.nanoseconds[phase]) / 1e9);
+            }
+            fprintf(stderr, "}");
+        }
+        fprintf(stderr, "},\"arena_peak_bytes\":%llu,\"loci_compared\":%llu}\n",
+                (unsigned long long)atomic_load(&statsCounters.arenaPeak),
+                (unsigned long long)atomic_load(&statsCounters.lociCompared));
+        return;
+    }
+
+    fprintf(stderr, "\nRun statistics (%.3f s)\n------------------------\n", wall);
+    for (int phase = 0; phase < STATS_PHASES; phase++) {
+        fprintf(stderr, "%-11s %12llu", statsPhaseNames[phase], (unsigned long long)atomic_load(&statsCounters.count[phase]));
+        if (statsPhaseTimed[phase]) {
+            fprintf(stderr, " %10.3f s", atomic_load(&statsCounters.nanoseconds[phase]) / 1e9);
+        } else {
+            fprintf(stderr, " %12s", "");
+        }
+        if (statsAmountNames[phase]) {
+            fprintf(stderr, "  %s %llu", statsAmountNames[phase], (unsigned long long)atomic_load(&statsCounters.amount[phase]));
+        }
+        fprintf(stderr, "\n");
+    }
+    fprintf(stderr, "%-11s %12llu bytes\n", "arena peak", (unsigned long long)atomic_load(&statsCounters.arenaPeak));
+    fprintf(stderr, "%-11s %12llu\n", "loci cmp", (unsigned long long)atomic_load(&statsCounters.lociCompared));
+}
+
+
+
+
+/**
+ * @brief Computes the prefix key of a name: its first 8 bytes as a big-endian integer, zero padded.
+ * 
+ * Two names whose prefix keys differ are ordered like their keys, so most name comparisons of the
+ * merge and of the ranking become a single integer comparison.
+ * 
+ * @param name The name.
+ * @param length The number of bytes of the name that are compared.
+ * 
+ * @return The prefix key.
+ */
+uint64_t namePrefixKey(const char* name, size_t length) {
+    uint64_t key = 0;
+    for (size_t i = 0; i < 8; i++) {
+        key = key << 8 | (i < length ? (unsigned char)name[i] : 0);
+    }
+    return key;
+}
+
+
+
+
 /**
- * @brief Compares two persons lexicographically by their names.
+ * @brief Prepares the sort key of a record's name, once for every record the merge reads.
  * 
- * This function uses `strcmp` to compare the names of two `person` structs.
- * It is primarily used to determine the order of persons during sorting or merging operations.
+ * The merge orders records by name as `strcmp` orders them. When the units are sorted before
+ * merging (`searchConfig.sortMemory`), the newline that separates a record from the previous one
+ * and the trailing spaces are not part of the compared name.
+ * 
+ * @param p Pointer to the record; the key points into its name.
+ * @param key Pointer to the key that receives the compared name and its prefix key.
+ */
+void makeNameKey(const person* p, nameKey* key) {
+    const char* name = p->name;
+    size_t length;
+    if (searchConfig.sortMemory > 0) {
+        name += name[0] == '\n';
+        length = strlen(name);
+        while (length > 0 && isspace((unsigned char)name[length - 1])) {
+            length--;
+        }
+    } else {
+        length = strlen(name);
+    }
+    key->name = name;
+    key->length = length;
+    key->prefix = namePrefixKey(name, length);
+}
+
+
+
+
+/**
+ * @brief Compares two records by the sort keys of their names (see `makeNameKey`).
  * 
- * @param a Pointer to the first person.
- * @param b Pointer to the second person.
+ * @param a Pointer to the key of the first record.
+ * @param b Pointer to the key of the second record.
  * 
  * @return An integer less than, equal to, or greater than zero if the name of `a`
  *         is found, respectively, to be less than, equal to, or greater than the name of `b`.
  */
-int comparePersons(const person* a, const person* b) {
-    return strcmp(a->name, b->name);
+int compareNameKeys(const nameKey* a, const nameKey* b) {
+    if (a->prefix != b->prefix) {
+        return a->prefix < b->prefix ? -1 : 1;
+    }
+    // Equal prefixes: only the bytes after the first 8 can still differ
+    size_t length = a->length < b->length ? a->length : b->length;
+    int order = length > 8 ? memcmp(a->name + 8, b->name + 8, length - 8) : 0;
+    return order != 0 ? order : (a->length > b->length) - (a->length < b->length);
+}
+
+
+
+
+/**
+ * @brief Restores the min-heap order of unit indices below a given heap position.
+ * 
+ * The heap orders units by the name keys of their current records (see `compareNameKeys`); units
+ * whose records compare equal are ordered by index, so the lowest-numbered unit wins ties.
+ * 
+ * @param heap Array of unit indices forming the heap.
+ * @param heapSize The number of units in the heap.
+ * @param position The heap position whose subtree may violate the heap order.
+ * @param currentKeys The name key of the current record of every unit, indexed by unit.
+ */
+void siftDownUnit(int* heap, int heapSize, int position, const nameKey* currentKeys) {
+    int unit = heap[position];
+    while (2 * position + 1 < heapSize) {
+        int child = 2 * position + 1;
+        // Pick the smaller of the two children
+        if (child + 1 < heapSize) {
+            int order = compareNameKeys(&currentKeys[heap[child + 1]], &currentKeys[heap[child]]);
+            if (order < 0 || (order == 0 && heap[child + 1] < heap[child])) {
+                child++;
+            }
+        }
+        int order = compareNameKeys(&currentKeys[heap[child]], &currentKeys[unit]);
+        if (order > 0 || (order == 0 && heap[child] > unit)) {
+            break;
+        }
+        heap[position] = heap[child];
+        position = child;
+    }
+    heap[position] = unit;
 }
 
 
@@ -58,13 +813,11 @@ int comparePersons(const person* a, const person* b) {
  * @note The genes are stored as strings, and a match is determined using `strcmp`.
  */
 int countGeneMatches(const person* donor, const person* patient) {
-    int matchCount = 0;
-    // Calculate how many genes match between the donor and the patient
-    for (int i = 0; i < 5; i++) {
-        if (strcmp(donor->genes[i], patient->genes[i]) == 0) {
-            matchCount++;
-        }
-    }
+    // Calculate how many genes match between the donor and the patient, one term per locus
+#define GENE_LOCUS_MATCH(locus, bases) + (strcmp(donor->genes[locus], patient->genes[locus]) == 0)
+    int matchCount = 0 LOCUS_SCHEMA(GENE_LOCUS_MATCH);
+#undef GENE_LOCUS_MATCH
+    statsRecord(STATS_MATCH, 1, (uint64_t)matchCount, 0);
     return matchCount;
 }
 
@@ -75,8 +828,8 @@ int countGeneMatches(const person* donor, const person* patient) {
  * @brief Counts the number of character mismatches between two gene strings.
  * 
  * This function compares two strings character by character to determine the
- * number of positions where the characters differ. It stops counting when the
- * end of either string is reached.
+ * number of positions where the characters differ. Every character of the longer
+ * string beyond the end of the shorter one counts as a mismatch.
  * 
  * @param donorGene Pointer to the donor's gene string.
  * @param patientGene Pointer to the patient's gene string.
@@ -87,378 +840,7019 @@ int countGeneMatches(const person* donor, const person* patient) {
  */
 int countMismatches(const char* donorGene, const char* patientGene) {
     int mismatches = 0;
+    int i = 0;
     // Calculate how many genes mismatch between the donor and the patient
-    for (int i = 0; donorGene[i] != '\0'; i++) {
+    for (; donorGene[i] != '\0' && patientGene[i] != '\0'; i++) {
         if (donorGene[i] != patientGene[i]) {
             mismatches++;
         }
     }
-    return mismatches;
+    // The rest of the longer gene has nothing to match
+    return mismatches + (int)strlen(donorGene + i) + (int)strlen(patientGene + i);
 }
 
 
 
 
+
 /**
- * @brief Cleans a person's name by trimming any part after the first digit.
+ * @brief Prepares the match plan of a query.
  * 
- * This function iterates through the provided name and trims off everything 
- * starting from the first digit encountered. It stops processing as soon as 
- * a digit is found and null-terminates the string just before that point.
+ * A plan compares the loci of every donor in the order that rejects donors soonest and stops as
+ * soon as the loci left cannot bring the donor to `min_match`. A qualifying donor is therefore
+ * always counted exactly. The order comes from sampled donors: the first
+ * MATCH_PLAN_WARMUP donors and then one in MATCH_PLAN_INTERVAL are compared on every locus, and
+ * the loci they match least often are compared first.
  * 
- * @param name Pointer to the person's name string to be cleaned.
+ * @param plan Pointer to the plan to prepare.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param maxMismatches Mismatched bases a locus tolerates, or -1 for exact matching.
+ */
+void initMatchPlan(matchPlan* plan, int min_match, int maxMismatches) {
+    memset(plan, 0, sizeof(*plan));
+    plan->minMatch = min_match;
+    plan->maxMismatches = maxMismatches;
+    for (int i = 0; i < NUM_LOCI; i++) {
+        plan->order[i] = i; // Schema order until the first samples are in
+    }
+}
+
+
+
+
+/**
+ * @brief Adds the loci compared by a plan to the run statistics.
  * 
- * @note This function assumes that the name string is null-terminated.
+ * @param plan Pointer to the plan; its count of compared loci is reset.
  */
-void cleanName(char* name) {
-    int i = 0;
-    int lastCharIndex = -1;
+void finishMatchPlan(matchPlan* plan) {
+    if (searchConfig.stats) {
+        atomic_fetch_add_explicit(&statsCounters.lociCompared, plan->compared, memory_order_relaxed);
+    }
+    plan->compared = 0;
+}
 
-    // Iterate through the string to find the first digit or meaningful part
-    while (name[i] != '\0') {
-        if (name[i] >= '0' && name[i] <= '9') {  // Check if the character is a digit
-            break;  // Stop at the first digit
+
+
+
+/**
+ * @brief Decides whether the next donor of a plan is sampled, i.e. compared on every locus.
+ * 
+ * @param plan Pointer to the plan.
+ * 
+ * @return 1 to sample the donor (see `recordMatchSample`), 0 to compare it in the plan's order.
+ */
+int sampleMatchPlan(matchPlan* plan) {
+    if (plan->countdown > 0) {
+        plan->countdown--;
+        return 0;
+    }
+    plan->countdown = plan->samples + 1 < MATCH_PLAN_WARMUP ? 0 : MATCH_PLAN_INTERVAL - 1;
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Adds a sampled donor to the statistics of a plan and orders the loci again.
+ * 
+ * Loci are ordered by their sampled matches, fewest first, and by their position in the schema
+ * when they match equally often. Halving the statistics every MATCH_PLAN_HISTORY samples lets the
+ * order follow a database whose donors change along the file.
+ * 
+ * @param plan Pointer to the plan.
+ * @param matched Bit `locus` is set for every locus at which the donor matches.
+ * 
+ * @return The number of matching loci of the donor.
+ */
+int recordMatchSample(matchPlan* plan, uint32_t matched) {
+    int matches = 0;
+    for (int locus = 0; locus < NUM_LOCI; locus++) {
+        int hit = (matched >> locus) & 1;
+        plan->hits[locus] += (uint32_t)hit;
+        matches += hit;
+    }
+    plan->compared += NUM_LOCI;
+    if (++plan->samples == MATCH_PLAN_HISTORY) {
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            plan->hits[locus] /= 2;
         }
-        if (name[i] != ' ' && name[i] != '\t' && name[i] != '\n') {  // Check for non-space characters
-            lastCharIndex = i;  // Track the last non-space character
+        plan->samples /= 2;
+    }
+    if (plan->samples >= MATCH_PLAN_WARMUP) {
+        // Insertion sort: the order rarely changes between two samples
+        for (int i = 1; i < NUM_LOCI; i++) {
+            int locus = plan->order[i];
+            int j = i;
+            while (j > 0 && (plan->hits[plan->order[j - 1]] > plan->hits[locus] ||
+                             (plan->hits[plan->order[j - 1]] == plan->hits[locus] && plan->order[j - 1] > locus))) {
+                plan->order[j] = plan->order[j - 1];
+                j--;
+            }
+            plan->order[j] = locus;
         }
-        i++;
     }
-
-    // Null-terminate the string after the last meaningful character
-    name[lastCharIndex + 1] = '\0';
+    return matches;
 }
 
 
 
 
-
 /**
- * @brief Checks if a given ID is a duplicate in a list of processed IDs.
+ * @brief Checks whether a donor can no longer qualify after some of its loci were compared.
  * 
- * This function compares the provided ID against a list of previously processed
- * IDs. If a match is found, it indicates that the ID is a duplicate and returns
- * 1. If no match is found, it returns 0, indicating that the ID is unique.
+ * @param plan Pointer to the plan.
+ * @param matches The matches found so far.
+ * @param compared The number of loci compared so far.
  * 
- * @param id The ID to be checked for duplication.
- * @param processedIDs A 2D array containing the list of already processed IDs.
- * @param numProcessed The number of processed IDs in the array.
+ * @return 1 if the loci left cannot bring the donor to the plan's minimal match, 0 otherwise.
+ */
+int matchPlanRejects(const matchPlan* plan, int matches, int compared) {
+    return matches + (NUM_LOCI - compared) < plan->minMatch;
+}
+
+
+
+
+/**
+ * @brief Checks whether a donor's gene is compatible with the patient's at one locus.
  * 
- * @return 1 if the ID is a duplicate, 0 if the ID is unique.
+ * @param donorGene The donor's gene.
+ * @param patientGene The patient's gene.
+ * @param maxMismatches Mismatched bases the locus tolerates, or -1 for exact matching.
  * 
- * @note This function assumes that the provided `processedIDs` array is valid
- *       and the strings are null-terminated.
+ * @return 1 if the genes are equal (or differ in at most `maxMismatches` bases), 0 otherwise.
  */
-// Function to check if the ID is already in the list of processed IDs
-int isDuplicate(char* id, char processedIDs[][10], int numProcessed) {
-    for (int i = 0; i < numProcessed; i++) {
-        if (strcmp(id, processedIDs[i]) == 0) {
-            return 1; // Duplicate found
-        }
+int geneLocusMatches(const char* donorGene, const char* patientGene, int maxMismatches) {
+    if (maxMismatches < 0) {
+        return strcmp(donorGene, patientGene) == 0;
     }
-    return 0; // No duplicate
+    return countMismatches(donorGene, patientGene) <= maxMismatches;
 }
 
-// Function to remove the leading newline character if it exists
-void removeLeadingNewline(char* str) {
-    // Check if the first character is a newline
-    if (str[0] == '\n') {
-        // Shift the string one position to the left, removing the leading newline
-        for (int i = 0; i < strlen(str); i++) {
-            str[i] = str[i + 1];
+
+
+
+/**
+ * @brief Counts the gene matches between a donor and a patient, in the order of a match plan.
+ * 
+ * Equivalent to `countGeneMatches` (or `countNearMatches` for a near-match plan) for every donor
+ * that qualifies, but a donor that cannot qualify is usually rejected after one or two compares.
+ * 
+ * @param donor Pointer to the donor `person`.
+ * @param patient Pointer to the patient `person`.
+ * @param plan Pointer to the plan of the query (see `initMatchPlan`).
+ * 
+ * @return The number of matching genes if the donor qualifies, some smaller number otherwise.
+ */
+int countPlannedMatches(const person* donor, const person* patient, matchPlan* plan) {
+    int matches = 0;
+    if (sampleMatchPlan(plan)) {
+        uint32_t matched = 0;
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            matched |= (uint32_t)geneLocusMatches(donor->genes[locus], patient->genes[locus], plan->maxMismatches) << locus;
         }
+        matches = recordMatchSample(plan, matched);
+    } else {
+        int compared = 0;
+        while (compared < NUM_LOCI && !matchPlanRejects(plan, matches, compared)) {
+            int locus = plan->order[compared++];
+            matches += geneLocusMatches(donor->genes[locus], patient->genes[locus], plan->maxMismatches);
+        }
+        plan->compared += (uint64_t)compared;
     }
+    statsRecord(STATS_MATCH, 1, (uint64_t)matches, 0);
+    return matches;
 }
 
 
+
+
+
 /**
- * @brief Sorts an array of potential bone marrow donors based on their match counts.
- * 
- * This function sorts the given array of donor structures in descending order of their match counts. 
- * If two donors have the same number of matches, the function sorts them alphabetically by their name 
- * in ascending order.
- * 
- * The function uses the Bubble Sort algorithm to perform the sorting, which compares adjacent donors 
- * and swaps them based on the comparison results.
+ * @brief Packs a single gene sequence into a 64-bit word using 2 bits per base.
  * 
- * @param donors A pointer to an array of person structures representing the potential bone marrow donors.
- * @param matchesArray A pointer to an array of integers representing the match count for each donor.
- * @param donorCount The number of donors in the array.
+ * The bases are encoded as A=0, C=1, G=2, T=3 and the sequence length is stored in the
+ * upper bits, so two packed values are equal exactly when the original strings are equal.
  * 
- * Example:
- * If the match count for the donors is {5, 7, 7, 3} and the donors' names are {"John", "Jane", "Alice", "Bob"},
- * the array will be sorted first by match count in descending order, and then alphabetically by name for those
- * with equal match counts.
+ * @param gene Pointer to the null-terminated gene string.
+ * @param packed Pointer to the word that receives the packed sequence.
  * 
- * The resulting sorted array will be:
- * - 1. Jane Smith    7 matches
- * - 2. Alice Brown   7 matches
- * - 3. John Doe      5 matches
- * - 4. Bob White     3 matches
+ * @return 1 if the gene was packed, 0 if it is too long or contains a character other than A, C, G or T.
  */
-
-void sortDonors(person* donors, int* matchesArray, int donorCount) {
-    for (int i = 0; i < donorCount - 1; i++) {
-        for (int j = 0; j < donorCount - i - 1; j++) {
-            // Compare matches in descending order
-            if (matchesArray[j] < matchesArray[j + 1]) {
-                // Swap donors
-                person tempPerson = donors[j];
-                donors[j] = donors[j + 1];
-                donors[j + 1] = tempPerson;
-
-                // Swap match counts
-                int tempMatches = matchesArray[j];
-                matchesArray[j] = matchesArray[j + 1];
-                matchesArray[j + 1] = tempMatches;
-            }
-            // If matches are equal, compare another criterion (e.g., name in ascending order)
-            else if (matchesArray[j] == matchesArray[j + 1]) {
-                if (strcmp(donors[j].name, donors[j + 1].name) > 0) { // Change `name` to the actual member for sorting
-                    // Swap donors
-                    person tempPerson = donors[j];
-                    donors[j] = donors[j + 1];
-                    donors[j + 1] = tempPerson;
-
-                    // Swap match counts (though they are equal, it's still part of the swap logic)
-                    int tempMatches = matchesArray[j];
-                    matchesArray[j] = matchesArray[j + 1];
-                    matchesArray[j + 1] = tempMatches;
-                }
-            }
+int packLocus(const char* gene, uint64_t* packed) {
+    uint64_t value = 0;
+    int i;
+    // Encode each base into its 2-bit slot
+    for (i = 0; gene[i] != '\0'; i++) {
+        uint64_t code;
+        switch (gene[i]) {
+            case 'A': code = 0; break;
+            case 'C': code = 1; break;
+            case 'G': code = 2; break;
+            case 'T': code = 3; break;
+            default: return 0; // Not a nucleotide, cannot be packed
+        }
+        if (i >= LOCUS_LENGTH) {
+            return 0; // Longer than a locus
         }
+        value |= code << (2 * i);
     }
+    *packed = value | ((uint64_t)i << PACKED_LENGTH_SHIFT);
+    return 1;
 }
 
 
 
-// ------------------------------------------------------------------------------------
+
+/**
+ * @brief Restores a gene string from its packed 64-bit form.
+ * 
+ * @param packed The packed locus produced by `packLocus`.
+ * @param gene Buffer of at least `LOCUS_LENGTH + 1` characters that receives the string.
+ */
+void unpackLocus(uint64_t packed, char* gene) {
+    static const char bases[4] = { 'A', 'C', 'G', 'T' };
+    int length = (int)(packed >> PACKED_LENGTH_SHIFT);
+    for (int i = 0; i < length; i++) {
+        gene[i] = bases[(packed >> (2 * i)) & 3];
+    }
+    gene[length] = '\0';
+}
+
+
+
+
+/**
+ * @brief Packs all the genes of a person.
+ * 
+ * @param p Pointer to the person whose genes are packed.
+ * @param packed Pointer to the structure that receives the packed genes.
+ * 
+ * @return 1 if every locus could be packed, 0 otherwise (the contents of `packed` are then undefined).
+ */
+int packGenes(const person* p, packedGenes* packed) {
+    for (int i = 0; i < NUM_LOCI; i++) {
+        if (!packLocus(p->genes[i], &packed->loci[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Restores the gene strings of a person from their packed form.
+ * 
+ * @param packed Pointer to the packed genes.
+ * @param p Pointer to the person whose `genes` are overwritten.
+ */
+void unpackGenes(const packedGenes* packed, person* p) {
+    for (int i = 0; i < NUM_LOCI; i++) {
+        unpackLocus(packed->loci[i], p->genes[i]);
+    }
+}
+
+
+
+
+/**
+ * @brief Counts the gene matches between two packed gene sets, in the order of a match plan.
+ * 
+ * Equivalent to `countPlannedMatches` for an exact plan, but every locus is compared with a single
+ * integer compare.
+ * 
+ * @param donor Pointer to the donor's packed genes.
+ * @param patient Pointer to the patient's packed genes.
+ * @param plan Pointer to the plan of the query (see `initMatchPlan`).
+ * 
+ * @return The number of matching genes if the donor qualifies, some smaller number otherwise.
+ */
+int countPackedMatches(const packedGenes* donor, const packedGenes* patient, matchPlan* plan) {
+    int matches = 0;
+    if (sampleMatchPlan(plan)) {
+#define PACKED_LOCUS_MATCH(locus, bases) | ((uint32_t)(donor->loci[locus] == patient->loci[locus]) << locus)
+        matches = recordMatchSample(plan, 0 LOCUS_SCHEMA(PACKED_LOCUS_MATCH));
+#undef PACKED_LOCUS_MATCH
+    } else {
+        int compared = 0;
+        while (compared < NUM_LOCI && !matchPlanRejects(plan, matches, compared)) {
+            int locus = plan->order[compared++];
+            matches += donor->loci[locus] == patient->loci[locus];
+        }
+        plan->compared += (uint64_t)compared;
+    }
+    statsRecord(STATS_MATCH, 1, (uint64_t)matches, 0);
+    return matches;
+}
+
+
+
+
+/**
+ * @brief Counts the number of base mismatches between two packed gene sequences.
+ * 
+ * Equivalent to `countMismatches`: the two sequences are XORed, the two bits of every base are
+ * folded into one, and the differing bases are counted with a population count. Positions of the
+ * longer gene beyond the end of the shorter one count as mismatches.
+ * 
+ * @param donorLocus The donor's packed gene.
+ * @param patientLocus The patient's packed gene.
+ * 
+ * @return The total number of base mismatches between the two genes.
+ */
+int countPackedMismatches(uint64_t donorLocus, uint64_t patientLocus) {
+    int donorLength = (int)(donorLocus >> PACKED_LENGTH_SHIFT);
+    int patientLength = (int)(patientLocus >> PACKED_LENGTH_SHIFT);
+    int common = donorLength < patientLength ? donorLength : patientLength;
+    uint64_t diff = (donorLocus ^ patientLocus) & PACKED_BASES_MASK;
+    // A base differs when either of its two bits differs
+    diff = (diff | (diff >> 1)) & PACKED_LOW_BITS & ((1ULL << (2 * common)) - 1);
+    return __builtin_popcountll(diff) + (donorLength > patientLength ? donorLength - patientLength
+                                                                     : patientLength - donorLength);
+}
+
+
+
+
+/**
+ * @brief Cleans a person's name by trimming any part after the first digit.
+ * 
+ * This function iterates through the provided name and trims off everything 
+ * starting from the first digit encountered. It stops processing as soon as 
+ * a digit is found and null-terminates the string just before that point.
+ * 
+ * @param name Pointer to the person's name string to be cleaned.
+ * 
+ * @note This function assumes that the name string is null-terminated.
+ */
+void cleanName(char* name) {
+    int i = 0;
+    int lastCharIndex = -1;
+    statsRecord(STATS_CLEAN_NAME, 1, 0, 0);
+
+    // Iterate through the string to find the first digit or meaningful part
+    while (name[i] != '\0') {
+        if (name[i] >= '0' && name[i] <= '9') {  // Check if the character is a digit
+            break;  // Stop at the first digit
+        }
+        if (name[i] != ' ' && name[i] != '\t' && name[i] != '\n') {  // Check for non-space characters
+            lastCharIndex = i;  // Track the last non-space character
+        }
+        i++;
+    }
+
+    // Null-terminate the string after the last meaningful character
+    name[lastCharIndex + 1] = '\0';
+}
+
+
+
+
+
+/**
+ * @brief Converts a 9-digit ID string into its numeric value.
+ * 
+ * @param id The null-terminated ID string.
+ * @param value Pointer to the integer that receives the ID.
+ * 
+ * @return 1 if the ID consists of exactly 9 digits, 0 otherwise.
+ */
+int parseDonorId(const char* id, uint32_t* value) {
+    uint32_t result = 0;
+    int i;
+    for (i = 0; id[i] != '\0'; i++) {
+        if (i >= 9 || id[i] < '0' || id[i] > '9') {
+            return 0;
+        }
+        result = result * 10 + (uint32_t)(id[i] - '0');
+    }
+    if (i != 9) {
+        return 0;
+    }
+    *value = result;
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Initialises an empty set of IDs.
+ * 
+ * The set is an open-addressing hash table over the numeric value of 9-digit IDs, which grows
+ * as IDs are added. IDs that are not 9 digits are rare and kept in a separate list.
+ * 
+ * @param set Pointer to the set to initialise.
+ */
+void initIdSet(idSet* set) {
+    memset(set, 0, sizeof(*set));
+}
+
+
+
+
+/**
+ * @brief Releases the memory held by a set of IDs.
+ * 
+ * @param set Pointer to the set. It is left empty and can be reused.
+ */
+void freeIdSet(idSet* set) {
+    free(set->slots);
+    free(set->otherIDs);
+    initIdSet(set);
+}
+
+
+
+
+/**
+ * @brief Finds the slot of a numeric ID in the hash table of a set.
+ * 
+ * @param slots The table, of `capacity` slots (a power of two).
+ * @param capacity The number of slots.
+ * @param key The numeric ID.
+ * 
+ * @return The index of the slot holding the ID, or of the empty slot where it would be stored.
+ */
+size_t findIdSlot(const uint32_t* slots, size_t capacity, uint32_t key) {
+    size_t mask = capacity - 1;
+    size_t index = (size_t)(((uint64_t)key * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    // Slots store key + 1, so 0 marks an empty slot
+    while (slots[index] != 0 && slots[index] != key + 1) {
+        index = (index + 1) & mask;
+    }
+    return index;
+}
+
+
+
+
+/**
+ * @brief Doubles the hash table of a set and rehashes its IDs.
+ * 
+ * @param set Pointer to the set.
+ */
+void growIdSet(idSet* set) {
+    size_t capacity = set->capacity ? set->capacity * 2 : 1024;
+    uint32_t* slots = calloc(capacity, sizeof(uint32_t));
+    if (!slots) {
+        perror("Error allocating ID set");
+        exit(1);
+    }
+    for (size_t i = 0; i < set->capacity; i++) {
+        if (set->slots[i] != 0) {
+            slots[findIdSlot(slots, capacity, set->slots[i] - 1)] = set->slots[i];
+        }
+    }
+    free(set->slots);
+    set->slots = slots;
+    set->capacity = capacity;
+}
+
+
+
+
+/**
+ * @brief Checks if a given ID is already in a set of IDs.
+ * 
+ * @param set Pointer to the set.
+ * @param id The ID to look for.
+ * 
+ * @return 1 if the ID is a duplicate, 0 if the ID is unique.
+ */
+int idSetContains(const idSet* set, const char* id) {
+    uint32_t key;
+    int found = 0;
+    if (parseDonorId(id, &key)) {
+        found = set->capacity > 0 && set->slots[findIdSlot(set->slots, set->capacity, key)] != 0;
+    } else {
+        for (size_t i = 0; i < set->otherCount && !found; i++) {
+            found = strcmp(id, set->otherIDs[i]) == 0; // Duplicate found
+        }
+    }
+    statsRecord(STATS_DEDUP, 1, (uint64_t)found, 0);
+    return found;
+}
+
+
+
+
+/**
+ * @brief Adds the numeric value of a 9-digit ID to a set of IDs.
+ * 
+ * @param set Pointer to the set.
+ * @param key The numeric ID (see `parseDonorId`).
+ * 
+ * @return 1 if the ID was added, 0 if it was already in the set.
+ */
+int idSetInsertKey(idSet* set, uint32_t key) {
+    // Keep the table at most 3/4 full so probe sequences stay short
+    if ((set->count + 1) * 4 > set->capacity * 3) {
+        growIdSet(set);
+    }
+    size_t slot = findIdSlot(set->slots, set->capacity, key);
+    if (set->slots[slot] != 0) {
+        return 0;
+    }
+    set->slots[slot] = key + 1;
+    set->count++;
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Adds an ID to a set of IDs.
+ * 
+ * @param set Pointer to the set.
+ * @param id The ID to add.
+ * 
+ * @return 1 if the ID was added, 0 if it was already in the set.
+ */
+int idSetInsert(idSet* set, const char* id) {
+    uint32_t key;
+    if (idSetContains(set, id)) {
+        return 0;
+    }
+    if (parseDonorId(id, &key)) {
+        return idSetInsertKey(set, key);
+    }
+    if (set->otherCount == set->otherCapacity) {
+        size_t capacity = set->otherCapacity ? set->otherCapacity * 2 : 16;
+        char (*otherIDs)[10] = realloc(set->otherIDs, capacity * sizeof(*otherIDs));
+        if (!otherIDs) {
+            perror("Error allocating ID set");
+            exit(1);
+        }
+        set->otherIDs = otherIDs;
+        set->otherCapacity = capacity;
+    }
+    snprintf(set->otherIDs[set->otherCount++], sizeof(set->otherIDs[0]), "%s", id);
+    set->count++;
+    return 1;
+}
+
+// Function to remove the leading newline character if it exists
+void removeLeadingNewline(char* str) {
+    // Check if the first character is a newline
+    if (str[0] == '\n') {
+        // Shift the string one position to the left, removing the leading newline
+        memmove(str, str + 1, strlen(str));
+    }
+}
+
+
+/**
+ * @brief Initialises an empty query arena.
+ * 
+ * A query takes its memory from the arena with `arenaAlloc` and gives all of it back at once with
+ * `resetQueryArena`. The arena keeps its block between queries and grows it to the largest query
+ * seen, so repeated queries allocate nothing once the arena is warm.
+ * 
+ * @param arena Pointer to the arena to initialise.
+ */
+void initQueryArena(queryArena* arena) {
+    memset(arena, 0, sizeof(*arena));
+}
+
+
+
+
+/**
+ * @brief Allocates memory for the current query from an arena.
+ * 
+ * @param arena Pointer to the arena.
+ * @param size The number of bytes.
+ * 
+ * @return Memory aligned for any type, valid until the next `resetQueryArena`.
+ */
+void* arenaAlloc(queryArena* arena, size_t size) {
+    size = size > 0 ? (size + 15) & ~(size_t)15 : 16;
+    if (arena->block && arena->capacity - arena->used >= size) {
+        void* memory = arena->block + arena->used;
+        arena->used += size;
+        return memory;
+    }
+    // The block is full: allocate on the heap until the reset makes the block large enough
+    if (arena->overflowCount == arena->overflowCapacity) {
+        int capacity = arena->overflowCapacity ? arena->overflowCapacity * 2 : 16;
+        void** overflow = realloc(arena->overflow, (size_t)capacity * sizeof(void*));
+        if (!overflow) {
+            perror("Error allocating query memory");
+            exit(1);
+        }
+        arena->overflow = overflow;
+        arena->overflowCapacity = capacity;
+    }
+    void* memory = malloc(size);
+    if (!memory) {
+        perror("Error allocating query memory");
+        exit(1);
+    }
+    arena->overflow[arena->overflowCount++] = memory;
+    arena->overflowBytes += size;
+    return memory;
+}
+
+
+
+
+/**
+ * @brief Releases the memory of the current query, keeping the arena's block for the next one.
+ * 
+ * @param arena Pointer to the arena.
+ */
+void resetQueryArena(queryArena* arena) {
+    size_t used = arena->used + arena->overflowBytes;
+    if (used > arena->peak) {
+        arena->peak = used;
+        uint64_t peak = atomic_load(&statsCounters.arenaPeak);
+        while (used > peak && !atomic_compare_exchange_weak(&statsCounters.arenaPeak, &peak, used)) {
+        }
+    }
+    for (int i = 0; i < arena->overflowCount; i++) {
+        free(arena->overflow[i]);
+    }
+    if (arena->overflowBytes > 0) {
+        // Grow the block so a query of this size fits in it next time
+        size_t capacity = arena->capacity ? arena->capacity : 65536;
+        while (capacity < used) {
+            capacity *= 2;
+        }
+        free(arena->block);
+        arena->block = malloc(capacity);
+        if (!arena->block) {
+            perror("Error allocating query memory");
+            exit(1);
+        }
+        arena->capacity = capacity;
+    }
+    arena->overflowCount = 0;
+    arena->overflowBytes = 0;
+    arena->used = 0;
+}
+
+
+
+
+/**
+ * @brief Releases all the memory of an arena.
+ * 
+ * @param arena Pointer to the arena. It is left empty and can be reused.
+ */
+void freeQueryArena(queryArena* arena) {
+    resetQueryArena(arena);
+    free(arena->block);
+    free(arena->overflow);
+    initQueryArena(arena);
+}
+
+
+
+
+/**
+ * @brief Compares two ranked donors by name; used with `qsort` on arrays of `rankedName`.
+ * 
+ * The prefix keys settle most comparisons; `strcmp` only orders names that share their first 8
+ * bytes. Donors of equal names keep their order in the donors array.
+ * 
+ * @param a Pointer to the first `rankedName`.
+ * @param b Pointer to the second `rankedName`.
+ * 
+ * @return The `strcmp` order of the two donors' names, then their order in the donors array.
+ */
+int compareRankedNames(const void* a, const void* b) {
+    const rankedName* first = a;
+    const rankedName* second = b;
+    if (first->prefix != second->prefix) {
+        return first->prefix < second->prefix ? -1 : 1;
+    }
+    int order = strcmp(first->donor->donor.name, second->donor->donor.name);
+    if (order != 0) {
+        return order;
+    }
+    return first->donor < second->donor ? -1 : first->donor > second->donor;
+}
+
+
+
+
+/**
+ * @brief Keeps the `keep` alphabetically smallest donors of a bucket, in sorted order.
+ * 
+ * A max-heap of `keep` entries is maintained over the bucket, so only the donors that make it
+ * into the result are ever fully sorted.
+ * 
+ * @param bucket Array of ranked names; its first `keep` entries receive the result.
+ * @param count The number of donors in the bucket.
+ * @param keep The number of donors to keep, less than `count`.
+ */
+void selectFirstNames(rankedName* bucket, int count, int keep) {
+    // Build a max-heap by name over the first `keep` entries
+    for (int start = keep / 2 - 1; start >= 0; start--) {
+        for (int parent = start; 2 * parent + 1 < keep;) {
+            int child = 2 * parent + 1;
+            if (child + 1 < keep && compareRankedNames(&bucket[child + 1], &bucket[child]) > 0) child++;
+            if (compareRankedNames(&bucket[child], &bucket[parent]) <= 0) break;
+            rankedName temp = bucket[parent]; bucket[parent] = bucket[child]; bucket[child] = temp;
+            parent = child;
+        }
+    }
+    // Replace the largest kept name whenever a smaller one appears
+    for (int i = keep; i < count; i++) {
+        if (compareRankedNames(&bucket[i], &bucket[0]) >= 0) {
+            continue;
+        }
+        bucket[0] = bucket[i];
+        for (int parent = 0; 2 * parent + 1 < keep;) {
+            int child = 2 * parent + 1;
+            if (child + 1 < keep && compareRankedNames(&bucket[child + 1], &bucket[child]) > 0) child++;
+            if (compareRankedNames(&bucket[child], &bucket[parent]) <= 0) break;
+            rankedName temp = bucket[parent]; bucket[parent] = bucket[child]; bucket[child] = temp;
+            parent = child;
+        }
+    }
+    qsort(bucket, (size_t)keep, sizeof(*bucket), compareRankedNames);
+}
+
+
+
+
+/**
+ * @brief Ranks potential donors by match count (descending), then name (ascending).
+ * 
+ * Match counts only range from 0 to NUM_LOCI, so donors are first distributed into one bucket per
+ * match count (a counting sort), and names are only compared inside a bucket. The donors of a
+ * bucket are sorted as pointers next to the prefix keys of their names (see `namePrefixKey`), so
+ * the donors themselves are only read to settle equal prefixes. With a `topK` limit, buckets past
+ * the limit are never sorted, and only the first donors of the bucket crossing it are. Donors of
+ * equal match counts and names keep their order in the array.
+ * 
+ * @param donors Array of potential donors. Names are compared as stored, so they should already be cleaned.
+ * @param size The number of donors in the array.
+ * @param topK The number of best donors wanted; 0 (or any value of at least `size`) ranks all of them.
+ * @param scratch The arena that receives the keys of the sorted buckets.
+ * @param ranked Array of at least `size` pointers. Its first entries receive the ranked donors.
+ * 
+ * @return The number of ranked donors written to `ranked`.
+ */
+int rankDonors(const donorMatch* donors, int size, int topK, queryArena* scratch, const donorMatch** ranked) {
+    int bucketStart[NUM_LOCI + 2] = { 0 };
+    double start = statsStart();
+    if (topK <= 0 || topK > size) {
+        topK = size;
+    }
+
+    // Count the donors of each match count; bucket 0 holds the best (NUM_LOCI matches)
+    for (int i = 0; i < size; i++) {
+        int matches = donors[i].matches < 0 ? 0 : donors[i].matches > NUM_LOCI ? NUM_LOCI : donors[i].matches;
+        bucketStart[NUM_LOCI - matches + 1]++;
+    }
+    for (int b = 1; b <= NUM_LOCI + 1; b++) {
+        bucketStart[b] += bucketStart[b - 1];
+    }
+    int next[NUM_LOCI + 1];
+    memcpy(next, bucketStart, sizeof(next));
+    for (int i = 0; i < size; i++) {
+        int matches = donors[i].matches < 0 ? 0 : donors[i].matches > NUM_LOCI ? NUM_LOCI : donors[i].matches;
+        ranked[next[NUM_LOCI - matches]++] = &donors[i];
+    }
+
+    // Sort names inside the buckets that reach into the first topK ranks
+    rankedName* names = arenaAlloc(scratch, (size_t)size * sizeof(rankedName));
+    for (int b = 0; b <= NUM_LOCI && bucketStart[b] < topK; b++) {
+        int count = bucketStart[b + 1] - bucketStart[b];
+        int keep = topK - bucketStart[b];
+        const donorMatch** bucket = ranked + bucketStart[b];
+        for (int i = 0; i < count; i++) {
+            names[i].prefix = namePrefixKey(bucket[i]->donor.name, strlen(bucket[i]->donor.name));
+            names[i].donor = bucket[i];
+        }
+        if (keep >= count) {
+            keep = count;
+            qsort(names, (size_t)count, sizeof(*names), compareRankedNames);
+        } else {
+            selectFirstNames(names, count, keep);
+        }
+        for (int i = 0; i < keep; i++) {
+            bucket[i] = names[i].donor;
+        }
+    }
+    statsRecord(STATS_RANK, 1, (uint64_t)size, start);
+    return topK;
+}
+
+
+
+
+/**
+ * @brief Sorts an array of potential bone marrow donors based on their match counts.
+ * 
+ * This function sorts the given array of donor structures in descending order of their match counts. 
+ * If two donors have the same number of matches, the function sorts them alphabetically by their name 
+ * in ascending order.
+ * 
+ * The order is computed by `rankDonors` on pointers, after which every donor is moved once
+ * into its final position.
+ * 
+ * @param donors A pointer to an array of potential bone marrow donors with their match counts.
+ * @param donorCount The number of donors in the array.
+ * 
+ * Example:
+ * If the match count for the donors is {5, 7, 7, 3} and the donors' names are {"John", "Jane", "Alice", "Bob"},
+ * the array will be sorted first by match count in descending order, and then alphabetically by name for those
+ * with equal match counts.
+ * 
+ * The resulting sorted array will be:
+ * - 1. Jane Smith    7 matches
+ * - 2. Alice Brown   7 matches
+ * - 3. John Doe      5 matches
+ * - 4. Bob White     3 matches
+ */
+
+void sortDonors(donorMatch* donors, int donorCount) {
+    queryArena scratch;
+    const donorMatch** ranked = malloc((size_t)donorCount * sizeof(*ranked));
+    donorMatch* sorted = malloc((size_t)donorCount * sizeof(*sorted));
+    if (donorCount > 0 && (!ranked || !sorted)) {
+        perror("Error allocating donor ranking");
+        exit(1);
+    }
+
+    initQueryArena(&scratch);
+    rankDonors(donors, donorCount, 0, &scratch, ranked);
+    freeQueryArena(&scratch);
+    // Move every donor once, into its ranked position
+    for (int i = 0; i < donorCount; i++) {
+        sorted[i] = *ranked[i];
+    }
+    memcpy(donors, sorted, (size_t)donorCount * sizeof(*sorted));
+
+    free(sorted);
+    free(ranked);
+}
+
+
+
+
+/**
+ * @brief Ranks potential donors by match count and cleaned name, leaving the donors unchanged.
+ * 
+ * The names are cleaned (see `cleanName`) in copies of the donors, so the caller's donors and any
+ * cache they come from keep their names as read.
+ * 
+ * @param donors Array of potential donors.
+ * @param size The number of donors in the array.
+ * @param topK The number of best donors wanted; 0 ranks all of them (see `rankDonors`).
+ * @param scratch The arena that receives the copies and the ranking.
+ * @param ranked Receives the ranked copies, valid until `scratch` is reset.
+ * 
+ * @return The number of ranked donors.
+ */
+int rankCleanedDonors(const donorMatch* donors, int size, int topK, queryArena* scratch, const donorMatch*** ranked) {
+    donorMatch* cleaned = arenaAlloc(scratch, (size_t)size * sizeof(donorMatch));
+    *ranked = arenaAlloc(scratch, (size_t)size * sizeof(**ranked));
+    if (size > 0) {
+        memcpy(cleaned, donors, (size_t)size * sizeof(donorMatch));
+    }
+    for (int i = 0; i < size; i++) {
+        cleanName(cleaned[i].donor.name);
+        removeLeadingNewline(cleaned[i].donor.name);
+    }
+    return rankDonors(cleaned, size, topK, scratch, *ranked);
+}
+
+
+
+
+/**
+ * @brief Initialises an empty list of potential donors.
+ * 
+ * @param list Pointer to the list to initialise.
+ */
+void initDonorList(donorList* list) {
+    list->items = NULL;
+    list->size = 0;
+    list->capacity = 0;
+    list->arena = NULL;
+}
+
+
+
+
+/**
+ * @brief Initialises an empty list of potential donors whose items are taken from a query arena.
+ * 
+ * @param list Pointer to the list to initialise.
+ * @param arena Pointer to the arena; the list is valid until the arena is reset.
+ */
+void initArenaDonorList(donorList* list, queryArena* arena) {
+    initDonorList(list);
+    list->arena = arena;
+}
+
+
+
+
+/**
+ * @brief Appends a donor and its match count to a list, growing the list as needed.
+ * 
+ * @param list Pointer to the list.
+ * @param donor Pointer to the donor to copy into the list.
+ * @param matches The donor's number of matching genes.
+ */
+void appendDonor(donorList* list, const person* donor, int matches) {
+    if (list->size == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        donorMatch* items;
+        if (list->arena) {
+            // The old items stay in the arena until its reset
+            items = arenaAlloc(list->arena, (size_t)capacity * sizeof(donorMatch));
+            if (list->size > 0) {
+                memcpy(items, list->items, (size_t)list->size * sizeof(donorMatch));
+            }
+        } else {
+            items = realloc(list->items, (size_t)capacity * sizeof(donorMatch));
+        }
+        if (!items) {
+            perror("Error allocating potential donors");
+            exit(1);
+        }
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->size].donor = *donor;
+    list->items[list->size].matches = matches;
+    list->size++;
+}
+
+
+
+
+/**
+ * @brief Visitor that appends every donor it receives to a `donorList`.
+ * 
+ * @param donor Pointer to the qualifying donor.
+ * @param matches The donor's number of matching genes.
+ * @param context Pointer to the `donorList` being filled.
+ * 
+ * @return Always 0, to continue the search.
+ */
+int appendVisitedDonor(const person* donor, int matches, void* context) {
+    appendDonor((donorList*)context, donor, matches);
+    return 0;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Record reader
+//
+// Text records are read through a block buffer instead of `fscanf`. A record is cut into fields
+// exactly as the format "%30[^0-9] %9s %21s %21s %21s %21s %21s" would cut it (for the default locus
+// schema): the name is every byte up to the first digit (at most 30), every other field is a
+// whitespace-separated word (at most 9 bytes for the ID, the length of its locus for a gene). The bytes of every field are copied once, straight from
+// the buffer into the person.
+//
+// A sequential reader (with a RECORD_BLOCK_SIZE buffer) double-buffers: its prefetch thread reads
+// the next block while the current one is parsed, so on slow storage the wait for a block overlaps
+// the work on the previous one. Every unit of a merge has its own reader, so all of them read ahead
+// at once. `--no-prefetch` reads every block on the calling thread instead.
+
+
+/**
+ * @brief Thread entry point: reads the blocks a record reader asks for ahead of time.
+ * 
+ * @param argument Pointer to the `recordPrefetch` of the reader.
+ * 
+ * @return NULL.
+ */
+void* prefetchRecordBlocks(void* argument) {
+    recordPrefetch* prefetch = argument;
+    pthread_mutex_lock(&prefetch->lock);
+    for (;;) {
+        while (!prefetch->stop && prefetch->state != PREFETCH_READING) {
+            pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+        }
+        if (prefetch->stop) {
+            break;
+        }
+        // The reader does not touch the file or the block until the state changes
+        pthread_mutex_unlock(&prefetch->lock);
+        double start = statsStart();
+        size_t length = fread(prefetch->block, 1, prefetch->capacity, prefetch->file);
+        statsRecord(STATS_READ, 1, length, start);
+        pthread_mutex_lock(&prefetch->lock);
+        prefetch->length = length;
+        prefetch->state = PREFETCH_READY;
+        pthread_cond_broadcast(&prefetch->changed);
+    }
+    pthread_mutex_unlock(&prefetch->lock);
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief Starts the read-ahead of a reader, unless it is disabled or its thread cannot be started.
+ * 
+ * @param reader Pointer to the reader.
+ */
+void startRecordPrefetch(recordReader* reader) {
+    recordPrefetch* prefetch = calloc(1, sizeof(recordPrefetch));
+    char* block = malloc(reader->capacity);
+    if (!prefetch || !block) {
+        perror("Error allocating record buffer");
+        exit(1);
+    }
+    prefetch->file = reader->file;
+    prefetch->block = block;
+    prefetch->capacity = reader->capacity;
+    prefetch->state = PREFETCH_IDLE;
+    pthread_mutex_init(&prefetch->lock, NULL);
+    pthread_cond_init(&prefetch->changed, NULL);
+    if (pthread_create(&prefetch->thread, NULL, prefetchRecordBlocks, prefetch) != 0) {
+        // Too many threads: this reader reads every block when it is needed
+        pthread_cond_destroy(&prefetch->changed);
+        pthread_mutex_destroy(&prefetch->lock);
+        free(block);
+        free(prefetch);
+        return;
+    }
+    reader->prefetch = prefetch;
+}
+
+
+
+
+/**
+ * @brief Waits until the prefetch thread of a reader has finished the block it reads.
+ * 
+ * @param prefetch Pointer to the read-ahead of the reader; its lock must be held.
+ */
+void waitRecordPrefetch(recordPrefetch* prefetch) {
+    while (prefetch->state == PREFETCH_READING) {
+        pthread_cond_wait(&prefetch->changed, &prefetch->lock);
+    }
+}
+
+
+
+
+/**
+ * @brief Prepares a reader for the records of a file, starting at the file's current position.
+ * 
+ * @param reader Pointer to the reader to initialise.
+ * @param file The open text file; the reader does all further reading from it.
+ * @param capacity The size of the block buffer (RECORD_BLOCK_SIZE for sequential reading, which
+ *                 also reads the next block ahead unless `searchConfig.prefetch` is 0).
+ */
+void initRecordReader(recordReader* reader, FILE* file, size_t capacity) {
+    int64_t offset = fileTell(file);
+    reader->file = file;
+    reader->buffer = malloc(capacity);
+    reader->capacity = capacity;
+    reader->position = 0;
+    reader->length = 0;
+    reader->offset = offset > 0 ? (uint64_t)offset : 0;
+    reader->prefetch = NULL;
+    if (!reader->buffer) {
+        perror("Error allocating record buffer");
+        exit(1);
+    }
+    if (searchConfig.prefetch && capacity >= RECORD_BLOCK_SIZE) {
+        startRecordPrefetch(reader);
+    }
+}
+
+
+
+
+/**
+ * @brief Releases the buffer of a reader and stops its prefetch thread. The file stays open.
+ * 
+ * @param reader Pointer to the reader.
+ * 
+ * @note The file position is past the bytes the reader has read ahead.
+ */
+void freeRecordReader(recordReader* reader) {
+    recordPrefetch* prefetch = reader->prefetch;
+    if (prefetch) {
+        pthread_mutex_lock(&prefetch->lock);
+        prefetch->stop = 1;
+        pthread_cond_broadcast(&prefetch->changed);
+        pthread_mutex_unlock(&prefetch->lock);
+        pthread_join(prefetch->thread, NULL);
+        pthread_cond_destroy(&prefetch->changed);
+        pthread_mutex_destroy(&prefetch->lock);
+        free(prefetch->block);
+        free(prefetch);
+        reader->prefetch = NULL;
+    }
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+
+
+
+/**
+ * @brief Returns the file offset of the next byte the reader will consume.
+ * 
+ * @param reader Pointer to the reader.
+ * 
+ * @return The offset.
+ */
+uint64_t recordReaderTell(const recordReader* reader) {
+    return reader->offset + reader->position;
+}
+
+
+
+
+/**
+ * @brief Moves a reader to a file offset, keeping the buffered block when the offset falls inside it.
+ * 
+ * @param reader Pointer to the reader.
+ * @param offset The new offset.
+ * 
+ * @return 1 on success, 0 if the file could not be positioned.
+ */
+int seekRecordReader(recordReader* reader, uint64_t offset) {
+    if (offset >= reader->offset && offset <= reader->offset + reader->length) {
+        reader->position = (size_t)(offset - reader->offset);
+        return 1;
+    }
+    if (reader->prefetch) {
+        // The block read ahead follows the buffered one, so it is dropped
+        pthread_mutex_lock(&reader->prefetch->lock);
+        waitRecordPrefetch(reader->prefetch);
+        reader->prefetch->state = PREFETCH_IDLE;
+        pthread_mutex_unlock(&reader->prefetch->lock);
+    }
+    if (fileSeek(reader->file, (int64_t)offset) != 0) {
+        return 0;
+    }
+    reader->offset = offset;
+    reader->position = 0;
+    reader->length = 0;
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Loads the next block of the file once the buffered one is used up.
+ * 
+ * @param reader Pointer to the reader.
+ * 
+ * @return 1 if unread bytes are buffered, 0 at the end of the file.
+ */
+int fillRecordReader(recordReader* reader) {
+    if (reader->position < reader->length) {
+        return 1;
+    }
+    reader->offset += reader->length;
+    reader->position = 0;
+    recordPrefetch* prefetch = reader->prefetch;
+    if (!prefetch) {
+        double start = statsStart();
+        reader->length = fread(reader->buffer, 1, reader->capacity, reader->file);
+        statsRecord(STATS_READ, 1, reader->length, start);
+        return reader->length > 0;
+    }
+
+    pthread_mutex_lock(&prefetch->lock);
+    waitRecordPrefetch(prefetch);
+    if (prefetch->state == PREFETCH_READY) {
+        // Swap in the block read ahead
+        char* block = reader->buffer;
+        reader->buffer = prefetch->block;
+        reader->length = prefetch->length;
+        prefetch->block = block;
+    } else {
+        // First block, or first after a seek
+        double start = statsStart();
+        reader->length = fread(reader->buffer, 1, reader->capacity, reader->file);
+        statsRecord(STATS_READ, 1, reader->length, start);
+    }
+    // Read the following block while this one is parsed
+    prefetch->state = reader->length > 0 ? PREFETCH_READING : PREFETCH_IDLE;
+    pthread_cond_broadcast(&prefetch->changed);
+    pthread_mutex_unlock(&prefetch->lock);
+    return reader->length > 0;
+}
+
+
+
+
+/**
+ * @brief Copies one field of a record from the buffer.
+ * 
+ * @param reader Pointer to the reader.
+ * @param field Receives the null-terminated field; must hold `width + 1` bytes.
+ * @param width The maximum length of the field.
+ * @param isName Non-zero for the name, which ends at a digit; any other field ends at whitespace.
+ * 
+ * @return 1 if the field is not empty, 0 otherwise.
+ */
+int readRecordField(recordReader* reader, char* field, size_t width, int isName) {
+    size_t length = 0;
+    while (length < width && fillRecordReader(reader)) {
+        const char* data = reader->buffer + reader->position;
+        size_t available = reader->length - reader->position;
+        size_t limit = available < width - length ? available : width - length;
+        size_t n = 0;
+        if (isName) {
+            while (n < limit && (data[n] < '0' || data[n] > '9')) {
+                n++;
+            }
+        } else {
+            while (n < limit && !isspace((unsigned char)data[n])) {
+                n++;
+            }
+        }
+        memcpy(field + length, data, n);
+        length += n;
+        reader->position += n;
+        if (n < limit) {
+            break; // The field ends inside the buffered block
+        }
+    }
+    field[length] = '\0';
+    return length > 0;
+}
+
+
+
+
+/**
+ * @brief Skips the whitespace in front of the next field.
+ * 
+ * @param reader Pointer to the reader.
+ */
+void skipRecordSpace(recordReader* reader) {
+    while (fillRecordReader(reader)) {
+        while (reader->position < reader->length && isspace((unsigned char)reader->buffer[reader->position])) {
+            reader->position++;
+        }
+        if (reader->position < reader->length) {
+            return;
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief Reads the fields of the next record into a person; the body of `readRecord`.
+ * 
+ * @param reader Pointer to the reader.
+ * @param p Pointer to the person that receives the record.
+ * 
+ * @return 1 if a full record was read, 0 otherwise.
+ */
+int readRecordFields(recordReader* reader, person* p) {
+    if (!readRecordField(reader, p->name, sizeof(p->name) - 1, 1)) {
+        return 0;
+    }
+    skipRecordSpace(reader);
+    if (!readRecordField(reader, p->id, sizeof(p->id) - 1, 0)) {
+        return 0;
+    }
+    for (int locus = 0; locus < NUM_LOCI; locus++) {
+        skipRecordSpace(reader);
+        if (!readRecordField(reader, p->genes[locus], (size_t)locusLengths[locus], 0)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Reads the next record into a person.
+ * 
+ * The fields are the ones `fscanf` with "%30[^0-9] %9s" and the `locusScanFormats` would produce,
+ * including the newline in front of the name of every record but the first one of a file.
+ * 
+ * @param reader Pointer to the reader.
+ * @param p Pointer to the person that receives the record.
+ * 
+ * @return 1 if a full record was read, 0 otherwise.
+ */
+int readRecord(recordReader* reader, person* p) {
+    double start = statsStart();
+    int complete = readRecordFields(reader, p);
+    statsRecord(STATS_PARSE, complete, 0, start);
+    return complete;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Text database writer
+//
+// The records of a text database are laid out directly in a large output buffer, field by field,
+// with the same bytes "%-30s %-9s" and every gene padded to the length of its locus would produce
+// ("%-21s" for each gene of the default schema), and the buffer is
+// written out in blocks of RECORD_BLOCK_SIZE or more.
+
+
+/**
+ * @brief Prepares a writer for a text database.
+ * 
+ * @param writer Pointer to the writer to initialise.
+ * @param file The open output file, written from its current position.
+ * @param capacity The size of the output buffer in bytes.
+ */
+void initTextWriter(textWriter* writer, FILE* file, size_t capacity) {
+    writer->file = file;
+    writer->capacity = capacity;
+    writer->used = 0;
+    writer->offset = (uint64_t)fileTell(file);
+    writer->buffer = malloc(capacity);
+    if (!writer->buffer) {
+        perror("Error allocating output buffer");
+        exit(1);
+    }
+}
+
+
+
+
+/**
+ * @brief Writes the buffered bytes of a writer to its file.
+ * 
+ * @param writer Pointer to the writer.
+ * 
+ * @note If the file cannot be written, the function prints an error message and exits the program.
+ */
+void flushTextWriter(textWriter* writer) {
+    double start = statsStart();
+    if (writer->used > 0 && fwrite(writer->buffer, 1, writer->used, writer->file) != writer->used) {
+        perror("Error writing database file");
+        exit(1);
+    }
+    statsRecord(STATS_OUTPUT, 1, writer->used, start);
+    writer->used = 0;
+}
+
+
+
+
+/**
+ * @brief Appends a field to the buffer of a writer, left-aligned and padded with spaces as `%-*s` does.
+ * 
+ * @param writer Pointer to the writer; its buffer must have room for the field.
+ * @param text The field.
+ * @param width The minimal width of the field.
+ */
+void appendTextField(textWriter* writer, const char* text, size_t width) {
+    size_t length = strlen(text);
+    memcpy(writer->buffer + writer->used, text, length);
+    writer->used += length;
+    if (length < width) {
+        memset(writer->buffer + writer->used, ' ', width - length);
+        writer->used += width - length;
+    }
+}
+
+
+
+
+/**
+ * @brief Writes one record of a text database.
+ * 
+ * @param writer Pointer to the writer.
+ * @param prefix Bytes written before the record ("" or "\n").
+ * @param p Pointer to the record.
+ * @param nameSeparator 1 to separate the name from the ID with a space, 0 to write the ID right
+ *                      after the padded name.
+ */
+void writeTextRecord(textWriter* writer, const char* prefix, const person* p, int nameSeparator) {
+    // Room for the longest record: every field at its maximal length and its separator
+    size_t longest = strlen(prefix) + sizeof(p->name) + sizeof(p->id) + NUM_LOCI * sizeof(p->genes[0]);
+    if (writer->capacity - writer->used < longest) {
+        flushTextWriter(writer);
+    }
+    size_t start = writer->used;
+
+    appendTextField(writer, prefix, 0);
+    appendTextField(writer, p->name, 30);
+    appendTextField(writer, nameSeparator ? " " : "", 0);
+    appendTextField(writer, p->id, 9);
+    for (int locus = 0; locus < NUM_LOCI; locus++) {
+        writer->buffer[writer->used++] = ' ';
+        appendTextField(writer, p->genes[locus], locusLengths[locus]);
+    }
+    writer->offset += writer->used - start;
+}
+
+
+
+
+/**
+ * @brief Writes the remaining bytes of a writer and releases its buffer. The file stays open.
+ * 
+ * @param writer Pointer to the writer.
+ */
+void finishTextWriter(textWriter* writer) {
+    flushTextWriter(writer);
+    free(writer->buffer);
+    writer->buffer = NULL;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Binary database format
+//
+// A database whose file name ends with BINARY_DB_EXTENSION is written by `createDatabase`
+// as a header, followed by fixed-size records (packed genes, numeric ID, name offset),
+// followed by the names section. `getPotentialDonors` maps such a file and scans it in
+// place without parsing. Multi-byte fields use the byte order of the machine that wrote it.
+//
+// A name ending with DICTIONARY_DB_EXTENSION selects the dictionary encoding of the same layout:
+// every distinct allele of a locus is stored once, in a per-locus dictionary after the names, and
+// records hold 32-bit allele IDs instead of packed genes. A scan resolves the patient's alleles to
+// IDs once, so each donor costs NUM_LOCI integer compares, and alleles missing from the
+// dictionaries are known not to match before any record is read.
+
+
+/**
+ * @brief Memory maps a whole file for reading.
+ * 
+ * On systems without `mmap` the file is read into a heap buffer instead, so callers
+ * can always treat `data` as a read-only view of the file.
+ * 
+ * @param path The name of the file to map.
+ * @param file Pointer to the structure that receives the mapping.
+ * 
+ * @return 1 on success, 0 if the file could not be opened or mapped.
+ */
+int mapFile(const char* path, mappedFile* file) {
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+#ifdef _WIN32
+    FILE* in = fopen(path, "rb");
+    if (!in) {
+        return 0;
+    }
+    fseek(in, 0, SEEK_END);
+    long length = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    unsigned char* buffer = malloc(length > 0 ? (size_t)length : 1);
+    if (!buffer || fread(buffer, 1, (size_t)length, in) != (size_t)length) {
+        free(buffer);
+        fclose(in);
+        return 0;
+    }
+    fclose(in);
+    file->data = buffer;
+    file->size = (size_t)length;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return 0;
+    }
+    file->size = (size_t)info.st_size;
+    if (file->size > 0) {
+        void* data = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            close(fd);
+            return 0;
+        }
+        madvise(data, file->size, MADV_SEQUENTIAL);
+        file->data = data;
+        file->mapped = 1;
+    }
+    close(fd); // The mapping stays valid after the descriptor is closed
+#endif
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Releases a file view created by `mapFile`.
+ * 
+ * @param file Pointer to the mapping to release.
+ */
+void unmapFile(mappedFile* file) {
+#ifndef _WIN32
+    if (file->mapped) {
+        munmap((void*)file->data, file->size);
+    } else
+#endif
+    free((void*)file->data);
+    file->data = NULL;
+    file->size = 0;
+    file->mapped = 0;
+}
+
+
+
+
+/**
+ * @brief Asks the system to start reading a range of a mapped file, so a scan of it does not wait
+ *        for every page on first touch.
+ * 
+ * @param start The first byte of the range; it need not be page aligned.
+ * @param length The length of the range.
+ */
+void prefetchMappedRange(const void* start, size_t length) {
+#ifndef _WIN32
+    if (!searchConfig.prefetch || length == 0) {
+        return;
+    }
+    uintptr_t page = (uintptr_t)sysconf(_SC_PAGESIZE);
+    uintptr_t begin = (uintptr_t)start & ~(page - 1);
+    madvise((void*)begin, (uintptr_t)start + length - begin, MADV_WILLNEED);
+#endif
+}
+
+
+
+
+/**
+ * @brief Selects the output format of a database from its file name.
+ * 
+ * @param filename The database file name.
+ * 
+ * @return DB_FORMAT_BINARY if the name ends with BINARY_DB_EXTENSION, DB_FORMAT_DICTIONARY if it
+ *         ends with DICTIONARY_DB_EXTENSION, DB_FORMAT_TEXT otherwise.
+ */
+databaseFormat databaseFormatForName(const char* filename) {
+    size_t length = strlen(filename);
+    size_t extension = strlen(BINARY_DB_EXTENSION);
+    if (length >= extension && strcmp(filename + length - extension, BINARY_DB_EXTENSION) == 0) {
+        return DB_FORMAT_BINARY;
+    }
+    extension = strlen(DICTIONARY_DB_EXTENSION);
+    if (length >= extension && strcmp(filename + length - extension, DICTIONARY_DB_EXTENSION) == 0) {
+        return DB_FORMAT_DICTIONARY;
+    }
+    return DB_FORMAT_TEXT;
+}
+
+
+
+
+/**
+ * @brief Checks whether a database file was written in the binary format.
+ * 
+ * @param database The database file name.
+ * 
+ * @return 1 if the file starts with the binary database magic, 0 otherwise.
+ */
+int isBinaryDatabase(const char* database) {
+    char magic[4];
+    FILE* in = fopen(database, "rb");
+    if (!in) {
+        return 0;
+    }
+    int found = fread(magic, 1, sizeof(magic), in) == sizeof(magic) &&
+                memcmp(magic, BINARY_DB_MAGIC, sizeof(magic)) == 0;
+    fclose(in);
+    return found;
+}
+
+
+
+
+/**
+ * @brief Finds the format an existing database file was written in.
+ * 
+ * @param database The database file name.
+ * 
+ * @return The format read from the header of a binary database, DB_FORMAT_TEXT for any other file.
+ */
+databaseFormat databaseFormatOf(const char* database) {
+    binaryDatabaseHeader header;
+    FILE* in = fopen(database, "rb");
+    if (!in) {
+        return DB_FORMAT_TEXT;
+    }
+    int binary = fread(&header, sizeof(header), 1, in) == 1 && memcmp(header.magic, BINARY_DB_MAGIC, sizeof(header.magic)) == 0;
+    fclose(in);
+    if (!binary) {
+        return DB_FORMAT_TEXT;
+    }
+    return header.encoding == BINARY_ENCODING_DICTIONARY ? DB_FORMAT_DICTIONARY : DB_FORMAT_BINARY;
+}
+
+
+
+
+/**
+ * @brief Appends bytes to the names section being built by a binary database writer.
+ * 
+ * @param writer Pointer to the writer.
+ * @param text The null-terminated string to append (its terminator is appended too).
+ */
+void appendBinaryName(binaryDatabaseWriter* writer, const char* text) {
+    size_t length = strlen(text) + 1;
+    if (writer->namesSize + length > writer->namesCapacity) {
+        size_t capacity = writer->namesCapacity ? writer->namesCapacity * 2 : 4096;
+        while (capacity < writer->namesSize + length) {
+            capacity *= 2;
+        }
+        char* names = realloc(writer->names, capacity);
+        if (!names) {
+            perror("Error allocating database names");
+            exit(1);
+        }
+        writer->names = names;
+        writer->namesCapacity = capacity;
+    }
+    memcpy(writer->names + writer->namesSize, text, length);
+    writer->namesSize += length;
+}
+
+
+
+
+/**
+ * @brief Returns the ID of an allele in a dictionary, adding the allele if it is new.
+ * 
+ * @param dictionary Pointer to the dictionary of the locus.
+ * @param allele The packed allele.
+ * 
+ * @return The allele ID: the number of distinct alleles added before it.
+ */
+uint32_t dictionaryAlleleId(alleleDictionary* dictionary, uint64_t allele) {
+    // Keep the table at most half full; IDs are only added, so it is rebuilt from `alleles`
+    if ((size_t)(dictionary->count + 1) * 2 > dictionary->slotCount) {
+        size_t slotCount = dictionary->slotCount ? dictionary->slotCount * 2 : 1024;
+        uint32_t* slots = calloc(slotCount, sizeof(uint32_t));
+        if (!slots) {
+            perror("Error allocating allele dictionary");
+            exit(1);
+        }
+        for (uint32_t id = 0; id < dictionary->count; id++) {
+            size_t slot = (size_t)((dictionary->alleles[id] * 0x9E3779B97F4A7C15ULL) >> 32) & (slotCount - 1);
+            while (slots[slot] != 0) {
+                slot = (slot + 1) & (slotCount - 1);
+            }
+            slots[slot] = id + 1;
+        }
+        free(dictionary->slots);
+        dictionary->slots = slots;
+        dictionary->slotCount = slotCount;
+    }
+
+    size_t mask = dictionary->slotCount - 1;
+    size_t slot = (size_t)((allele * 0x9E3779B97F4A7C15ULL) >> 32) & mask;
+    while (dictionary->slots[slot] != 0) {
+        uint32_t id = dictionary->slots[slot] - 1;
+        if (dictionary->alleles[id] == allele) {
+            return id;
+        }
+        slot = (slot + 1) & mask;
+    }
+    if (dictionary->count == dictionary->capacity) {
+        uint32_t capacity = dictionary->capacity ? dictionary->capacity * 2 : 1024;
+        uint64_t* alleles = realloc(dictionary->alleles, (size_t)capacity * sizeof(uint64_t));
+        if (!alleles) {
+            perror("Error allocating allele dictionary");
+            exit(1);
+        }
+        dictionary->alleles = alleles;
+        dictionary->capacity = capacity;
+    }
+    dictionary->alleles[dictionary->count] = allele;
+    dictionary->slots[slot] = dictionary->count + 1;
+    return dictionary->count++;
+}
+
+
+
+
+/**
+ * @brief Starts a binary database by writing a placeholder header.
+ * 
+ * @param writer Pointer to the writer to initialise.
+ * @param file The output file, opened in binary mode.
+ * @param format DB_FORMAT_BINARY or DB_FORMAT_DICTIONARY.
+ */
+void beginBinaryDatabase(binaryDatabaseWriter* writer, FILE* file, databaseFormat format) {
+    binaryDatabaseHeader header;
+    binaryDictionaryHeader dictionaryHeader;
+    memset(writer, 0, sizeof(*writer));
+    writer->file = file;
+    writer->encoding = format == DB_FORMAT_DICTIONARY ? BINARY_ENCODING_DICTIONARY : BINARY_ENCODING_PACKED;
+    memset(&header, 0, sizeof(header));
+    fwrite(&header, sizeof(header), 1, file); // Rewritten with the real counts by finishBinaryDatabase
+    if (writer->encoding == BINARY_ENCODING_DICTIONARY) {
+        memset(&dictionaryHeader, 0, sizeof(dictionaryHeader));
+        fwrite(&dictionaryHeader, sizeof(dictionaryHeader), 1, file);
+    }
+}
+
+
+
+
+/**
+ * @brief Writes one person as a fixed-size binary record.
+ * 
+ * The name is stored cleaned (see `cleanName` and `removeLeadingNewline`). A person whose ID is
+ * not 9 digits or whose genes cannot be packed is stored with `id == BINARY_RAW_ID`; its ID and
+ * genes then follow the name in the names section as null-terminated strings.
+ * 
+ * @param writer Pointer to the writer.
+ * @param p Pointer to the person to write.
+ */
+void writeBinaryRecord(binaryDatabaseWriter* writer, const person* p) {
+    binaryRecord record;
+    char name[31];
+
+    memset(&record, 0, sizeof(record));
+    strcpy(name, p->name);
+    cleanName(name);
+    removeLeadingNewline(name);
+
+    record.nameOffset = (uint32_t)writer->namesSize;
+    appendBinaryName(writer, name);
+    if (!parseDonorId(p->id, &record.id) || !packGenes(p, &record.genes)) {
+        // Keep the original strings for records that do not fit the packed layout
+        memset(&record.genes, 0, sizeof(record.genes));
+        record.id = BINARY_RAW_ID;
+        appendBinaryName(writer, p->id);
+        for (int i = 0; i < NUM_LOCI; i++) {
+            appendBinaryName(writer, p->genes[i]);
+        }
+        writer->rawCount++;
+    }
+    double start = statsStart();
+    if (writer->encoding == BINARY_ENCODING_DICTIONARY) {
+        dictionaryRecord encoded;
+        for (int i = 0; i < NUM_LOCI; i++) {
+            encoded.alleles[i] = record.id == BINARY_RAW_ID ? DICTIONARY_NO_ALLELE
+                               : dictionaryAlleleId(&writer->dictionaries[i], record.genes.loci[i]);
+        }
+        encoded.id = record.id;
+        encoded.nameOffset = record.nameOffset;
+        fwrite(&encoded, sizeof(encoded), 1, writer->file);
+        statsRecord(STATS_OUTPUT, 1, sizeof(encoded), start);
+    } else {
+        fwrite(&record, sizeof(record), 1, writer->file);
+        statsRecord(STATS_OUTPUT, 1, sizeof(record), start);
+    }
+    writer->recordCount++;
+}
+
+
+
+
+/**
+ * @brief Completes a binary database: writes the names section, the allele dictionaries of a
+ *        dictionary-encoded database and the final header.
+ * 
+ * @param writer Pointer to the writer. Its names buffer and dictionaries are released.
+ */
+void finishBinaryDatabase(binaryDatabaseWriter* writer) {
+    binaryDatabaseHeader header;
+    binaryDictionaryHeader dictionaryHeader;
+    int dictionary = writer->encoding == BINARY_ENCODING_DICTIONARY;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINARY_DB_MAGIC, sizeof(header.magic));
+    header.version = BINARY_DB_VERSION;
+    header.numLoci = NUM_LOCI;
+    header.locusLength = LOCUS_LENGTH;
+    header.recordSize = dictionary ? sizeof(dictionaryRecord) : sizeof(binaryRecord);
+    header.encoding = writer->encoding;
+    header.recordCount = writer->recordCount;
+    header.recordsOffset = sizeof(binaryDatabaseHeader) + (dictionary ? sizeof(binaryDictionaryHeader) : 0);
+    header.namesOffset = header.recordsOffset + writer->recordCount * header.recordSize;
+    header.namesSize = writer->namesSize;
+
+    double start = statsStart();
+    if (writer->namesSize > 0) {
+        fwrite(writer->names, 1, writer->namesSize, writer->file);
+    }
+    uint64_t written = writer->namesSize + sizeof(header);
+    if (dictionary) {
+        // The dictionaries follow the names, 8-byte aligned so they can be read in place
+        uint64_t position = header.namesOffset + header.namesSize;
+        static const char padding[8] = { 0 };
+        fwrite(padding, 1, (8 - position % 8) % 8, writer->file);
+        position += (8 - position % 8) % 8;
+        memset(&dictionaryHeader, 0, sizeof(dictionaryHeader));
+        dictionaryHeader.rawCount = writer->rawCount;
+        for (int i = 0; i < NUM_LOCI; i++) {
+            alleleDictionary* locus = &writer->dictionaries[i];
+            dictionaryHeader.allelesOffset[i] = position;
+            dictionaryHeader.alleleCount[i] = locus->count;
+            if (locus->count > 0) {
+                fwrite(locus->alleles, sizeof(uint64_t), locus->count, writer->file);
+            }
+            position += (uint64_t)locus->count * sizeof(uint64_t);
+            written += (uint64_t)locus->count * sizeof(uint64_t);
+            free(locus->alleles);
+            free(locus->slots);
+            memset(locus, 0, sizeof(*locus));
+        }
+    }
+    fseek(writer->file, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, writer->file);
+    if (dictionary) {
+        fwrite(&dictionaryHeader, sizeof(dictionaryHeader), 1, writer->file);
+    }
+    statsRecord(STATS_OUTPUT, 1, written, start);
+
+    free(writer->names);
+    writer->names = NULL;
+}
+
+
+
+
+/**
+ * @brief Validates a mapped binary database and returns its header.
+ * 
+ * @param file Pointer to the mapped database file.
+ * 
+ * @return Pointer to the header inside the mapping, or NULL if the file is not a valid database
+ *         for this program's locus layout.
+ */
+const binaryDatabaseHeader* binaryDatabaseHeaderOf(const mappedFile* file) {
+    const binaryDatabaseHeader* header = (const binaryDatabaseHeader*)file->data;
+    if (file->size < sizeof(binaryDatabaseHeader) ||
+        memcmp(header->magic, BINARY_DB_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != BINARY_DB_VERSION || header->numLoci != NUM_LOCI ||
+        header->locusLength != LOCUS_LENGTH) {
+        return NULL;
+    }
+    if (header->encoding == BINARY_ENCODING_DICTIONARY) {
+        const binaryDictionaryHeader* dictionary = (const binaryDictionaryHeader*)(header + 1);
+        if (header->recordSize != sizeof(dictionaryRecord) ||
+            file->size < sizeof(binaryDatabaseHeader) + sizeof(binaryDictionaryHeader)) {
+            return NULL;
+        }
+        for (int i = 0; i < NUM_LOCI; i++) {
+            if (dictionary->allelesOffset[i] % 8 != 0 ||
+                dictionary->allelesOffset[i] + dictionary->alleleCount[i] * sizeof(uint64_t) > file->size) {
+                return NULL;
+            }
+        }
+    } else if (header->encoding != BINARY_ENCODING_PACKED || header->recordSize != sizeof(binaryRecord)) {
+        return NULL;
+    }
+    if (header->recordsOffset + header->recordCount * header->recordSize > file->size ||
+        header->namesOffset + header->namesSize > file->size) {
+        return NULL;
+    }
+    return header;
+}
+
+
+
+
+/**
+ * @brief Returns the packed alleles of one locus of a dictionary-encoded database.
+ * 
+ * @param header Pointer to the database header (with BINARY_ENCODING_DICTIONARY).
+ * @param locus The locus.
+ * @param count Pointer that receives the number of alleles.
+ * 
+ * @return The alleles, indexed by allele ID.
+ */
+const uint64_t* dictionaryAlleles(const binaryDatabaseHeader* header, int locus, uint64_t* count) {
+    const binaryDictionaryHeader* dictionary = (const binaryDictionaryHeader*)(header + 1);
+    *count = dictionary->alleleCount[locus];
+    return (const uint64_t*)((const unsigned char*)header + dictionary->allelesOffset[locus]);
+}
+
+
+
+
+/**
+ * @brief Copies one string of the names section of a binary database and steps past it.
+ * 
+ * The copy never reads outside the section: a string that starts past its end is read as empty,
+ * and one that runs into its end is cut there.
+ * 
+ * @param header Pointer to the database header.
+ * @param offset Pointer to the offset of the string in the names section; advanced past its
+ *               terminator.
+ * @param destination The buffer that receives the string.
+ * @param size The size of the buffer.
+ */
+void readBinaryName(const binaryDatabaseHeader* header, uint64_t* offset, char* destination, size_t size) {
+    const char* text = "";
+    size_t length = 0;
+
+    if (*offset < header->namesSize) {
+        text = (const char*)header + header->namesOffset + *offset;
+        const char* end = memchr(text, '\0', header->namesSize - *offset);
+        length = end ? (size_t)(end - text) : header->namesSize - *offset;
+    }
+    snprintf(destination, size, "%.*s", (int)(length < size ? length : size - 1), text);
+    *offset += length + 1;
+}
+
+
+
+
+/**
+ * @brief Rebuilds a full `person` from a record of a binary database.
+ * 
+ * @param header Pointer to the database header.
+ * @param ordinal The position of the record in the database.
+ * @param p Pointer to the person that receives the record's fields.
+ */
+void binaryRecordToPerson(const binaryDatabaseHeader* header, uint64_t ordinal, person* p) {
+    const unsigned char* record = (const unsigned char*)header + header->recordsOffset + ordinal * header->recordSize;
+    const binaryRecord* packed = (const binaryRecord*)record;
+    const dictionaryRecord* encoded = (const dictionaryRecord*)record;
+    int dictionary = header->encoding == BINARY_ENCODING_DICTIONARY;
+    uint32_t id = dictionary ? encoded->id : packed->id;
+    uint64_t offset = dictionary ? encoded->nameOffset : packed->nameOffset;
+
+    readBinaryName(header, &offset, p->name, sizeof(p->name));
+    if (id == BINARY_RAW_ID) {
+        // ID and genes follow the name as strings
+        readBinaryName(header, &offset, p->id, sizeof(p->id));
+        for (int i = 0; i < NUM_LOCI; i++) {
+            readBinaryName(header, &offset, p->genes[i], sizeof(p->genes[i]));
+        }
+        return;
+    }
+    snprintf(p->id, sizeof(p->id), "%09u", (unsigned)(id % 1000000000u)); // IDs have 9 digits
+    if (!dictionary) {
+        unpackGenes(&packed->genes, p);
+        return;
+    }
+    for (int i = 0; i < NUM_LOCI; i++) {
+        uint64_t count;
+        const uint64_t* alleles = dictionaryAlleles(header, i, &count);
+        if (encoded->alleles[i] < count) {
+            unpackLocus(alleles[encoded->alleles[i]], p->genes[i]);
+        } else {
+            p->genes[i][0] = '\0';
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief Packs a patient's genes for comparison against packed donors.
+ * 
+ * A locus that cannot be packed is set to PACKED_INVALID, which never equals a packed gene.
+ * 
+ * @param patient Pointer to the patient.
+ * @param packed Pointer to the structure that receives the packed genes.
+ */
+void packPatientGenes(const person* patient, packedGenes* packed) {
+    for (int i = 0; i < NUM_LOCI; i++) {
+        if (!packLocus(patient->genes[i], &packed->loci[i])) {
+            packed->loci[i] = PACKED_INVALID;
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief Counts the number of matching genes between a dictionary-encoded donor and a patient, in
+ *        the order of a match plan (see `countPackedMatches`).
+ * 
+ * @param donor Pointer to the donor's record.
+ * @param patientAlleles The patient's allele IDs (see `resolveDictionaryAlleles`).
+ * @param plan Pointer to the plan of the query (see `initMatchPlan`).
+ * 
+ * @return The number of loci whose allele IDs are equal if the donor qualifies, some smaller
+ *         number otherwise.
+ */
+int countDictionaryMatches(const dictionaryRecord* donor, const uint32_t* patientAlleles, matchPlan* plan) {
+    int matches = 0;
+    if (sampleMatchPlan(plan)) {
+#define DICTIONARY_LOCUS_MATCH(locus, bases) | ((uint32_t)(donor->alleles[locus] == patientAlleles[locus]) << locus)
+        matches = recordMatchSample(plan, 0 LOCUS_SCHEMA(DICTIONARY_LOCUS_MATCH));
+#undef DICTIONARY_LOCUS_MATCH
+    } else {
+        int compared = 0;
+        while (compared < NUM_LOCI && !matchPlanRejects(plan, matches, compared)) {
+            int locus = plan->order[compared++];
+            matches += donor->alleles[locus] == patientAlleles[locus];
+        }
+        plan->compared += (uint64_t)compared;
+    }
+    statsRecord(STATS_MATCH, 1, (uint64_t)matches, 0);
+    return matches;
+}
+
+
+
+
+/**
+ * @brief Looks up the patient's alleles in the dictionaries of a dictionary-encoded database.
+ * 
+ * @param header Pointer to the database header (with BINARY_ENCODING_DICTIONARY).
+ * @param patient Pointer to the patient.
+ * @param patientAlleles Receives the allele ID of every locus; DICTIONARY_NO_ALLELE (which no
+ *                       packed record holds) for an allele that no donor of the database has.
+ * 
+ * @return The number of loci whose allele is in the dictionary.
+ */
+int resolveDictionaryAlleles(const binaryDatabaseHeader* header, const person* patient, uint32_t* patientAlleles) {
+    int present = 0;
+    for (int i = 0; i < NUM_LOCI; i++) {
+        uint64_t count, allele;
+        const uint64_t* alleles = dictionaryAlleles(header, i, &count);
+        patientAlleles[i] = DICTIONARY_NO_ALLELE;
+        if (!packLocus(patient->genes[i], &allele)) {
+            continue;
+        }
+        for (uint64_t id = 0; id < count; id++) {
+            if (alleles[id] == allele) {
+                patientAlleles[i] = (uint32_t)id;
+                present++;
+                break;
+            }
+        }
+    }
+    return present;
+}
+
+
+
+
+/**
+ * @brief Matches a range of the records of a mapped dictionary-encoded database (see `scanBinaryRecords`).
+ * 
+ * @return The number of donors passed to `visitor`; 0 without reading any record when too few of
+ *         the patient's alleles are in the dictionaries and every record is encoded.
+ */
+int scanDictionaryRecords(const binaryDatabaseHeader* header, uint64_t first, uint64_t last, const person* patient,
+                          int min_match, donorVisitor visitor, void* context) {
+    int visited = 0;
+    uint32_t patientAlleles[NUM_LOCI];
+    const binaryDictionaryHeader* dictionary = (const binaryDictionaryHeader*)(header + 1);
+    if (resolveDictionaryAlleles(header, patient, patientAlleles) < min_match && dictionary->rawCount == 0) {
+        return 0; // No donor can reach min_match
+    }
+    // Read the records in the background while the first ones are matched
+    prefetchMappedRange((const unsigned char*)header + header->recordsOffset + first * header->recordSize,
+                        (size_t)((last - first) * header->recordSize));
+
+    matchPlan plan;
+    initMatchPlan(&plan, min_match, -1);
+    const dictionaryRecord* records = (const dictionaryRecord*)((const unsigned char*)header + header->recordsOffset);
+    for (uint64_t r = first; r < last; r++) {
+        int matches;
+        person current;
+        if (records[r].id == BINARY_RAW_ID) {
+            binaryRecordToPerson(header, r, &current);
+            matches = countPlannedMatches(&current, patient, &plan);
+        } else {
+            matches = countDictionaryMatches(&records[r], patientAlleles, &plan);
+        }
+
+        if (matches >= min_match) {
+            binaryRecordToPerson(header, r, &current);
+            visited++;
+            if (visitor(&current, matches, context)) {
+                break;
+            }
+        }
+    }
+    finishMatchPlan(&plan);
+    return visited;
+}
+
+
+
+
+/**
+ * @brief Matches a range of the records of a mapped binary database.
+ * 
+ * @param header Pointer to the header of the mapped database.
+ * @param first The first record to scan.
+ * @param last One past the last record to scan.
+ * @param patient Pointer to the patient.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param visitor Function called for every qualifying donor.
+ * @param context Passed unchanged to `visitor`.
+ * 
+ * @return The number of donors passed to `visitor`.
+ */
+int scanBinaryRecords(const binaryDatabaseHeader* header, uint64_t first, uint64_t last, const person* patient,
+                      int min_match, donorVisitor visitor, void* context) {
+    if (header->encoding == BINARY_ENCODING_DICTIONARY) {
+        return scanDictionaryRecords(header, first, last, patient, min_match, visitor, context);
+    }
+    // Read the records in the background while the first ones are matched
+    prefetchMappedRange((const unsigned char*)header + header->recordsOffset + first * header->recordSize,
+                        (size_t)((last - first) * header->recordSize));
+    int visited = 0;
+    packedGenes patientGenes;
+    packPatientGenes(patient, &patientGenes);
+
+    matchPlan plan;
+    initMatchPlan(&plan, min_match, -1);
+    const binaryRecord* records = (const binaryRecord*)((const unsigned char*)header + header->recordsOffset);
+    for (uint64_t r = first; r < last; r++) {
+        int matches;
+        person current;
+        if (records[r].id == BINARY_RAW_ID) {
+            binaryRecordToPerson(header, r, &current);
+            matches = countPlannedMatches(&current, patient, &plan);
+        } else {
+            matches = countPackedMatches(&records[r].genes, &patientGenes, &plan);
+        }
+
+        if (matches >= min_match) {
+            binaryRecordToPerson(header, r, &current);
+            visited++;
+            if (visitor(&current, matches, context)) {
+                break;
+            }
+        }
+    }
+    finishMatchPlan(&plan);
+    return visited;
+}
+
+
+
+
+/**
+ * @brief Streams the potential donors of a binary database by scanning the mapped records in place.
+ * 
+ * This is the binary counterpart of the text scan in `visitPotentialDonors`, which calls it for
+ * databases written in the binary format. Matching uses the packed genes directly.
+ * 
+ * @param database The binary database file name.
+ * @param patient Pointer to the patient.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param visitor Function called for every qualifying donor.
+ * @param context Passed unchanged to `visitor`.
+ * 
+ * @return The number of donors passed to `visitor`.
+ */
+int visitBinaryDatabase(char* database, const person* patient, int min_match, donorVisitor visitor, void* context) {
+    mappedFile file;
+    if (!mapFile(database, &file)) {
+        perror("Error opening database file");
+        exit(1);
+    }
+    const binaryDatabaseHeader* header = binaryDatabaseHeaderOf(&file);
+    if (!header) {
+        fprintf(stderr, "Error: %s is not a valid binary database\n", database);
+        exit(1);
+    }
+
+    int visited = scanBinaryRecords(header, 0, header->recordCount, patient, min_match, visitor, context);
+
+    unmapFile(&file);
+    return visited;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Near-match search
+//
+// With `searchConfig.maxMismatches` set, a locus counts as matching when the donor's and the
+// patient's genes differ in at most that many bases (see `countMismatches`). The packed genes of a
+// block of donors are compared by `countBlockMismatches`, which handles several donors per
+// instruction with the vector unit of the target (AVX2, SSE2 or NEON) and all 21 bases of a gene
+// within each 64-bit lane.
+
+
+/**
+ * @brief Returns the low bit of every base that a packed gene holds.
+ * 
+ * @param key The allele key of the gene (see `alleleKey`).
+ * 
+ * @return The mask, or 0 for a hashed key.
+ */
+uint64_t packedBaseMask(uint64_t key) {
+    if (key & ALLELE_HASHED_KEY) {
+        return 0;
+    }
+    int length = (int)((key >> PACKED_LENGTH_SHIFT) & 0x3F);
+    return PACKED_LOW_BITS & ((1ULL << (2 * length)) - 1);
+}
+
+
+
+
+/**
+ * @brief Counts the base mismatches between a column of packed donor genes and one patient gene.
+ * 
+ * For every donor the differing bases of the common length are folded into one bit each, and the
+ * bases that only one of the genes has are added, so the result equals `countPackedMismatches`.
+ * 
+ * @param donors Packed genes of the donors (allele keys that are not hashed).
+ * @param donorMasks `packedBaseMask` of every donor gene.
+ * @param count The number of donors.
+ * @param patient The patient's packed gene.
+ * @param patientMask `packedBaseMask` of the patient's gene.
+ * @param mismatches Receives the mismatch count of every donor.
+ */
+void countBlockMismatches(const uint64_t* donors, const uint64_t* donorMasks, int count,
+                          uint64_t patient, uint64_t patientMask, unsigned char* mismatches) {
+    int d = 0;
+    // Only the low bit of a base can be set, so the population count starts from 2-bit fields
+#if defined(__AVX2__)
+    const __m256i p = _mm256_set1_epi64x((long long)patient);
+    const __m256i pm = _mm256_set1_epi64x((long long)patientMask);
+    const __m256i m2 = _mm256_set1_epi64x(0x3333333333333333LL);
+    const __m256i m4 = _mm256_set1_epi64x(0x0F0F0F0F0F0F0F0FLL);
+    for (; d + 4 <= count; d += 4) {
+        __m256i dm = _mm256_loadu_si256((const __m256i*)(donorMasks + d));
+        __m256i diff = _mm256_xor_si256(_mm256_loadu_si256((const __m256i*)(donors + d)), p);
+        diff = _mm256_and_si256(_mm256_or_si256(diff, _mm256_srli_epi64(diff, 1)), _mm256_and_si256(dm, pm));
+        __m256i x = _mm256_or_si256(diff, _mm256_xor_si256(dm, pm));
+        x = _mm256_add_epi64(_mm256_and_si256(x, m2), _mm256_and_si256(_mm256_srli_epi64(x, 2), m2));
+        x = _mm256_and_si256(_mm256_add_epi64(x, _mm256_srli_epi64(x, 4)), m4);
+        x = _mm256_sad_epu8(x, _mm256_setzero_si256());
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i*)lanes, x);
+        for (int lane = 0; lane < 4; lane++) {
+            mismatches[d + lane] = (unsigned char)lanes[lane];
+        }
+    }
+#elif defined(__SSE2__)
+    const __m128i p = _mm_set1_epi64x((long long)patient);
+    const __m128i pm = _mm_set1_epi64x((long long)patientMask);
+    const __m128i m2 = _mm_set1_epi64x(0x3333333333333333LL);
+    const __m128i m4 = _mm_set1_epi64x(0x0F0F0F0F0F0F0F0FLL);
+    for (; d + 2 <= count; d += 2) {
+        __m128i dm = _mm_loadu_si128((const __m128i*)(donorMasks + d));
+        __m128i diff = _mm_xor_si128(_mm_loadu_si128((const __m128i*)(donors + d)), p);
+        diff = _mm_and_si128(_mm_or_si128(diff, _mm_srli_epi64(diff, 1)), _mm_and_si128(dm, pm));
+        __m128i x = _mm_or_si128(diff, _mm_xor_si128(dm, pm));
+        x = _mm_add_epi64(_mm_and_si128(x, m2), _mm_and_si128(_mm_srli_epi64(x, 2), m2));
+        x = _mm_and_si128(_mm_add_epi64(x, _mm_srli_epi64(x, 4)), m4);
+        x = _mm_sad_epu8(x, _mm_setzero_si128());
+        mismatches[d] = (unsigned char)_mm_cvtsi128_si32(x);
+        mismatches[d + 1] = (unsigned char)_mm_cvtsi128_si32(_mm_srli_si128(x, 8));
+    }
+#elif defined(__ARM_NEON)
+    const uint64x2_t p = vdupq_n_u64(patient);
+    const uint64x2_t pm = vdupq_n_u64(patientMask);
+    for (; d + 2 <= count; d += 2) {
+        uint64x2_t dm = vld1q_u64(donorMasks + d);
+        uint64x2_t diff = veorq_u64(vld1q_u64(donors + d), p);
+        diff = vandq_u64(vorrq_u64(diff, vshrq_n_u64(diff, 1)), vandq_u64(dm, pm));
+        uint64x2_t x = vorrq_u64(diff, veorq_u64(dm, pm));
+        uint64x2_t sums = vpaddlq_u32(vpaddlq_u16(vpaddlq_u8(vcntq_u8(vreinterpretq_u8_u64(x)))));
+        mismatches[d] = (unsigned char)vgetq_lane_u64(sums, 0);
+        mismatches[d + 1] = (unsigned char)vgetq_lane_u64(sums, 1);
+    }
+#endif
+    for (; d < count; d++) {
+        uint64_t diff = donors[d] ^ patient;
+        diff = (diff | (diff >> 1)) & donorMasks[d] & patientMask;
+        mismatches[d] = (unsigned char)__builtin_popcountll(diff | (donorMasks[d] ^ patientMask));
+    }
+}
+
+
+
+
+/**
+ * @brief Counts the loci at which a donor's gene differs from the patient's in few enough bases.
+ * 
+ * @param donor Pointer to the donor.
+ * @param patient Pointer to the patient.
+ * @param maxMismatches The number of mismatched bases a locus tolerates.
+ * 
+ * @return The number of compatible loci.
+ */
+int countNearMatches(const person* donor, const person* patient, int maxMismatches) {
+#define NEAR_LOCUS_MATCH(locus, bases) + (countMismatches(donor->genes[locus], patient->genes[locus]) <= maxMismatches)
+    int matches = 0 LOCUS_SCHEMA(NEAR_LOCUS_MATCH);
+#undef NEAR_LOCUS_MATCH
+    statsRecord(STATS_MATCH, 1, (uint64_t)matches, 0);
+    return matches;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Allele index
+//
+// `createDatabase` writes an index next to every database (its name plus INDEX_EXTENSION).
+// For each locus the index maps every allele found in the database to the sorted list of the
+// ordinals of the donors that carry it (a postings list). A search looks up the patient's alleles,
+// merges their postings lists to count the hits of every donor, and only reads the donors
+// whose count reaches `min_match`.
+//
+// A segment index (SEGMENT_INDEX_EXTENSION) serves near-match searches the same way. It cuts every
+// gene into LOCUS_SEGMENTS fixed ranges of bases and has one column of postings per segment. A
+// mismatched base spoils at most one segment, so a locus with at most d mismatches shares at least
+// LOCUS_SEGMENTS - d segments exactly with the patient; only donors with enough such loci are read.
+
+
+/**
+ * @brief Computes the index key of an allele.
+ * 
+ * Alleles that can be packed use their packed value, which is exact. Other strings use a 64-bit
+ * FNV-1a hash with the top bit set, so they never collide with a packed allele; a collision
+ * between two such hashes only adds a candidate, which is then rejected by the exact comparison.
+ * 
+ * @param gene The null-terminated gene string.
+ * 
+ * @return The key of the allele.
+ */
+uint64_t alleleKey(const char* gene) {
+    uint64_t key;
+    if (packLocus(gene, &key)) {
+        return key;
+    }
+    key = 0xCBF29CE484222325ULL;
+    for (int i = 0; gene[i] != '\0'; i++) {
+        key = (key ^ (unsigned char)gene[i]) * 0x100000001B3ULL;
+    }
+    return key | ALLELE_HASHED_KEY;
+}
+
+
+
+
+/**
+ * @brief Computes the segment index key of one segment of a gene.
+ * 
+ * The key is a 64-bit FNV-1a hash of the segment number and the bases of the segment that the gene
+ * has, so a gene that ends inside or before the segment gets a different key from a longer one.
+ * 
+ * @param gene The null-terminated gene string.
+ * @param segment The segment (0 to LOCUS_SEGMENTS - 1).
+ * 
+ * @return The key of the segment.
+ */
+uint64_t segmentKey(const char* gene, int segment) {
+    size_t length = strlen(gene);
+    size_t start = (size_t)segment * LOCUS_LENGTH / LOCUS_SEGMENTS;
+    size_t end = (size_t)(segment + 1) * LOCUS_LENGTH / LOCUS_SEGMENTS;
+    uint64_t key = (0xCBF29CE484222325ULL ^ (uint64_t)(segment + 1)) * 0x100000001B3ULL;
+    size_t i = start;
+    for (; i < end && i < length; i++) {
+        key = (key ^ (unsigned char)gene[i]) * 0x100000001B3ULL;
+    }
+    // Mark the number of bases present, so "AC" and "AC" followed by nothing differ from "ACG"
+    return (key ^ (0x100 | (i - start))) * 0x100000001B3ULL;
+}
+
+
+
+
+/**
+ * @brief Builds the file name of the index of a database.
+ * 
+ * @param database The database file name.
+ * @param segments 0 for the allele index, LOCUS_SEGMENTS for the segment index.
+ * @param indexName Buffer that receives the index file name.
+ * @param size The size of `indexName`.
+ */
+void indexFileName(const char* database, int segments, char* indexName, size_t size) {
+    snprintf(indexName, size, "%s%s", database, segments ? SEGMENT_INDEX_EXTENSION : INDEX_EXTENSION);
+}
+
+
+
+
+/**
+ * @brief Initialises an empty index builder.
+ * 
+ * @param builder Pointer to the builder.
+ * @param textOffsets 1 if the database is a text file whose record offsets must be stored.
+ * @param segments 0 to build the allele index, LOCUS_SEGMENTS to build the segment index.
+ */
+void initIndexBuilder(alleleIndexBuilder* builder, int textOffsets, int segments) {
+    memset(builder, 0, sizeof(*builder));
+    builder->textOffsets = textOffsets;
+    builder->segments = segments;
+    builder->columns = segments ? NUM_LOCI * segments : NUM_LOCI;
+}
+
+
+
+
+/**
+ * @brief Releases the memory held by an index builder.
+ * 
+ * @param builder Pointer to the builder.
+ */
+void freeIndexBuilder(alleleIndexBuilder* builder) {
+    free(builder->keys);
+    free(builder->offsets);
+    memset(builder, 0, sizeof(*builder));
+}
+
+
+
+
+/**
+ * @brief Records the alleles (or segments) of the next donor written to the database.
+ * 
+ * @param builder Pointer to the builder.
+ * @param p Pointer to the donor; its ordinal is the number of donors added before it.
+ * @param offset File offset of the donor's record (only used for text databases).
+ */
+void addIndexRecord(alleleIndexBuilder* builder, const person* p, uint64_t offset) {
+    if (builder->count == builder->capacity) {
+        size_t capacity = builder->capacity ? builder->capacity * 2 : 1024;
+        uint64_t* keys = realloc(builder->keys, capacity * builder->columns * sizeof(uint64_t));
+        uint64_t* offsets = realloc(builder->offsets, capacity * sizeof(uint64_t));
+        if (!keys || !offsets) {
+            perror("Error allocating database index");
+            exit(1);
+        }
+        builder->keys = keys;
+        builder->offsets = offsets;
+        builder->capacity = capacity;
+    }
+    uint64_t* keys = builder->keys + builder->count * builder->columns;
+    for (int i = 0; i < NUM_LOCI; i++) {
+        if (!builder->segments) {
+            keys[i] = alleleKey(p->genes[i]);
+            continue;
+        }
+        for (int segment = 0; segment < builder->segments; segment++) {
+            keys[i * builder->segments + segment] = segmentKey(p->genes[i], segment);
+        }
+    }
+    builder->offsets[builder->count] = offset;
+    builder->count++;
+}
+
+
+
+
+/**
+ * @brief Orders (allele, ordinal) pairs by allele then ordinal; used with `qsort`.
+ */
+int compareIndexPairs(const void* a, const void* b) {
+    const uint64_t* first = a;
+    const uint64_t* second = b;
+    if (first[0] != second[0]) {
+        return first[0] < second[0] ? -1 : 1;
+    }
+    return (first[1] > second[1]) - (first[1] < second[1]);
+}
+
+
+
+
+/**
+ * @brief Reads the size and modification time of a file.
+ * 
+ * @param path The file name.
+ * @param size Pointer that receives the size in bytes.
+ * @param mtime Pointer that receives the modification time.
+ * 
+ * @return 1 on success, 0 if the file does not exist.
+ */
+int fileSignature(const char* path, uint64_t* size, int64_t* mtime) {
+    struct stat info;
+    if (stat(path, &info) != 0) {
+        return 0;
+    }
+    *size = (uint64_t)info.st_size;
+    *mtime = (int64_t)info.st_mtime;
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Writes the index collected by a builder next to its (already closed) database.
+ * 
+ * @param builder Pointer to the builder.
+ * @param database The database file name.
+ */
+void writeAlleleIndex(const alleleIndexBuilder* builder, const char* database) {
+    char indexName[FILENAME_MAX];
+    alleleIndexHeader header;
+    size_t count = builder->count;
+
+    indexFileName(database, builder->segments, indexName, sizeof(indexName));
+    FILE* out = fopen(indexName, "wb");
+    if (!out) {
+        perror("Error creating database index");
+        return; // The database is still usable without its index
+    }
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, INDEX_MAGIC, sizeof(header.magic));
+    header.version = INDEX_VERSION;
+    header.numColumns = (uint32_t)builder->columns;
+    header.segments = (uint32_t)builder->segments;
+    header.recordCount = count;
+    fileSignature(database, &header.databaseSize, &header.databaseMtime);
+    fwrite(&header, sizeof(header), 1, out); // Rewritten with the section offsets at the end
+
+    uint64_t position = sizeof(header);
+    if (builder->textOffsets) {
+        header.offsetsOffset = position;
+        if (count > 0) {
+            fwrite(builder->offsets, sizeof(uint64_t), count, out);
+        }
+        position += count * sizeof(uint64_t);
+    }
+
+    uint64_t* pairs = malloc((count ? count : 1) * 2 * sizeof(uint64_t));
+    uint32_t* postings = malloc((count ? count : 1) * sizeof(uint32_t));
+    alleleIndexEntry* entries = malloc((count ? count : 1) * sizeof(alleleIndexEntry));
+    if (!pairs || !postings || !entries) {
+        perror("Error allocating database index");
+        exit(1);
+    }
+    for (int column = 0; column < builder->columns; column++) {
+        // Group the donors of this column by key
+        for (size_t r = 0; r < count; r++) {
+            pairs[2 * r] = builder->keys[r * builder->columns + column];
+            pairs[2 * r + 1] = r;
+        }
+        qsort(pairs, count, 2 * sizeof(uint64_t), compareIndexPairs);
+
+        size_t keys = 0;
+        for (size_t r = 0; r < count; r++) {
+            if (keys == 0 || entries[keys - 1].allele != pairs[2 * r]) {
+                entries[keys].allele = pairs[2 * r];
+                entries[keys].first = (uint32_t)r;
+                entries[keys].count = 0;
+                keys++;
+            }
+            entries[keys - 1].count++;
+            postings[r] = (uint32_t)pairs[2 * r + 1];
+        }
+
+        header.entriesOffset[column] = position;
+        header.entryCount[column] = keys;
+        fwrite(entries, sizeof(alleleIndexEntry), keys, out);
+        position += keys * sizeof(alleleIndexEntry);
+        header.postingsOffset[column] = position;
+        fwrite(postings, sizeof(uint32_t), count, out);
+        position += count * sizeof(uint32_t);
+        // Keep the next section 8-byte aligned
+        if (position % 8 != 0) {
+            static const char padding[8] = { 0 };
+            fwrite(padding, 1, 8 - position % 8, out);
+            position += 8 - position % 8;
+        }
+    }
+    free(entries);
+    free(postings);
+    free(pairs);
+
+    fseek(out, 0, SEEK_SET);
+    fwrite(&header, sizeof(header), 1, out);
+    fclose(out);
+}
+
+
+
+
+/**
+ * @brief Maps the index of a database if it exists and still describes the database.
+ * 
+ * @param database The database file name.
+ * @param segments 0 for the allele index, LOCUS_SEGMENTS for the segment index.
+ * @param file Pointer to the mapping that receives the index; release it with `unmapFile`.
+ * 
+ * @return Pointer to the index header inside the mapping, or NULL if there is no usable index.
+ */
+const alleleIndexHeader* openAlleleIndex(const char* database, int segments, mappedFile* file) {
+    char indexName[FILENAME_MAX];
+    uint64_t size;
+    int64_t mtime;
+    uint32_t columns = (uint32_t)(segments ? NUM_LOCI * segments : NUM_LOCI);
+
+    indexFileName(database, segments, indexName, sizeof(indexName));
+    if (!fileSignature(database, &size, &mtime) || !mapFile(indexName, file)) {
+        return NULL;
+    }
+    const alleleIndexHeader* header = (const alleleIndexHeader*)file->data;
+    if (file->size < sizeof(alleleIndexHeader) ||
+        memcmp(header->magic, INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != INDEX_VERSION || header->numColumns != columns ||
+        header->segments != (uint32_t)segments || header->databaseSize != size || header->databaseMtime != mtime) {
+        unmapFile(file); // Missing, foreign or stale: the database changed after the index was written
+        return NULL;
+    }
+    for (uint32_t column = 0; column < columns; column++) {
+        if (header->entriesOffset[column] + header->entryCount[column] * sizeof(alleleIndexEntry) > file->size ||
+            header->postingsOffset[column] + header->recordCount * sizeof(uint32_t) > file->size) {
+            unmapFile(file);
+            return NULL;
+        }
+    }
+    return header;
+}
+
+
+
+
+/**
+ * @brief Looks up the postings list of a key in one column of an index.
+ * 
+ * @param header Pointer to the mapped index header.
+ * @param locus The column: the locus in an allele index, locus * LOCUS_SEGMENTS + segment in a segment index.
+ * @param allele The key (see `alleleKey` and `segmentKey`).
+ * @param count Pointer that receives the length of the list.
+ * 
+ * @return Pointer to the ascending ordinals of the donors with this key, or NULL if none has it.
+ */
+const uint32_t* findAllelePostings(const alleleIndexHeader* header, int locus, uint64_t allele, uint32_t* count) {
+    const unsigned char* base = (const unsigned char*)header;
+    const alleleIndexEntry* entries = (const alleleIndexEntry*)(base + header->entriesOffset[locus]);
+    size_t low = 0, high = header->entryCount[locus];
+
+    // Binary search over the sorted alleles of the locus
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (entries[middle].allele < allele) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == header->entryCount[locus] || entries[low].allele != allele) {
+        *count = 0;
+        return NULL;
+    }
+    *count = entries[low].count;
+    return (const uint32_t*)(base + header->postingsOffset[locus]) + entries[low].first;
+}
+
+
+
+
+/**
+ * @brief Counts the patient's alleles that occur anywhere in a database.
+ * 
+ * A donor matches the patient at most at these loci, so a patient with fewer of them than the
+ * minimal match has no potential donor in the database.
+ * 
+ * @param header Pointer to the mapped allele index header (not a segment index).
+ * @param patient Pointer to the patient.
+ * 
+ * @return The number of loci whose allele some donor of the database has.
+ */
+int countIndexedAlleles(const alleleIndexHeader* header, const person* patient) {
+    int present = 0;
+    for (int locus = 0; locus < NUM_LOCI; locus++) {
+        uint32_t count;
+        present += findAllelePostings(header, locus, alleleKey(patient->genes[locus]), &count) != NULL;
+    }
+    return present;
+}
+
+
+
+
+/**
+ * @brief Starts merging the postings lists of a patient's alleles (or segments).
+ * 
+ * @param cursor Pointer to the cursor to initialise.
+ * @param index Pointer to the mapped index header; its `segments` selects allele or segment keys.
+ * @param patient Pointer to the patient.
+ * @param min_match The minimum number of candidate loci of a donor.
+ * @param maxMismatches The mismatches a locus tolerates in a segment index (ignored otherwise).
+ */
+void openIndexCursor(indexCursor* cursor, const alleleIndexHeader* index, const person* patient,
+                     int min_match, int maxMismatches) {
+    int segments = (int)index->segments;
+    cursor->perLocus = segments ? segments : 1;
+    cursor->need = segments ? segments - maxMismatches : 1;
+    cursor->min_match = min_match;
+    cursor->liveLoci = 0;
+    for (int locus = 0; locus < NUM_LOCI; locus++) {
+        cursor->remaining[locus] = 0;
+        for (int segment = 0; segment < cursor->perLocus; segment++) {
+            int column = locus * cursor->perLocus + segment;
+            uint64_t key = segments ? segmentKey(patient->genes[locus], segment) : alleleKey(patient->genes[locus]);
+            cursor->lists[column] = findAllelePostings(index, column, key, &cursor->lengths[column]);
+            cursor->positions[column] = 0;
+            cursor->remaining[locus] += cursor->lengths[column] > 0;
+        }
+        cursor->liveLoci += cursor->remaining[locus] >= cursor->need;
+    }
+}
+
+
+
+
+/**
+ * @brief Finds the next donor, in database order, that is a candidate at `min_match` loci or more.
+ * 
+ * @param cursor Pointer to the cursor.
+ * @param ordinal Pointer that receives the ordinal of the donor.
+ * 
+ * @return 1 if a candidate was found, 0 once no donor can qualify any more.
+ */
+int nextIndexCandidate(indexCursor* cursor, uint32_t* ordinal) {
+    int columns = NUM_LOCI * cursor->perLocus;
+    while (cursor->liveLoci >= cursor->min_match) {
+        // The smallest ordinal at the head of any list, and the loci where it has enough hits
+        uint32_t smallest = UINT32_MAX;
+        for (int column = 0; column < columns; column++) {
+            if (cursor->positions[column] < cursor->lengths[column] &&
+                cursor->lists[column][cursor->positions[column]] < smallest) {
+                smallest = cursor->lists[column][cursor->positions[column]];
+            }
+        }
+        int candidateLoci = 0;
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            int hits = 0;
+            for (int column = locus * cursor->perLocus; column < (locus + 1) * cursor->perLocus; column++) {
+                if (cursor->positions[column] < cursor->lengths[column] &&
+                    cursor->lists[column][cursor->positions[column]] == smallest) {
+                    hits++;
+                    if (++cursor->positions[column] == cursor->lengths[column] &&
+                        cursor->remaining[locus]-- == cursor->need) {
+                        cursor->liveLoci--;
+                    }
+                }
+            }
+            candidateLoci += hits >= cursor->need;
+        }
+        if (candidateLoci >= cursor->min_match) {
+            *ordinal = smallest;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+
+
+/**
+ * @brief Reads one record of a text database at a known file offset.
+ * 
+ * @param reader The reader of the open database file.
+ * @param offset The offset of the record, as stored in the index.
+ * @param p Pointer to the person that receives the record.
+ * 
+ * @return 1 if a full record was read, 0 otherwise.
+ * 
+ * @note Postings are in database order, so nearby records are usually served from the buffered block.
+ */
+int readTextRecordAt(recordReader* reader, uint64_t offset, person* p) {
+    return seekRecordReader(reader, offset) && readRecord(reader, p);
+}
+
+
+
+
+/**
+ * @brief Streams the potential donors of a database using its allele index.
+ * 
+ * The postings lists of the patient's alleles are merged in ordinal order; every donor found in at
+ * least `min_match` of them is read from the database and checked with the exact gene comparison.
+ * Donors are therefore visited in database order, exactly as a full scan would visit them.
+ * 
+ * A near-match search (`searchConfig.maxMismatches` below LOCUS_SEGMENTS) uses the segment index
+ * instead: a locus is a candidate when the donor shares at least LOCUS_SEGMENTS - maxMismatches
+ * segments with the patient, and the donors read are checked with `countNearMatches`.
+ * 
+ * @param database The database file name.
+ * @param patient Pointer to the patient.
+ * @param min_match The minimum number of matching genes (at least 1).
+ * @param visitor Function called for every qualifying donor.
+ * @param context Passed unchanged to `visitor`.
+ * 
+ * @return The number of donors passed to `visitor`, or -1 if the database has no usable index.
+ */
+int visitIndexedDonors(char* database, const person* patient, int min_match, donorVisitor visitor, void* context) {
+    mappedFile indexFile, dbMapping;
+    const alleleIndexHeader* index;
+    const binaryDatabaseHeader* binaryHeader = NULL;
+    FILE* dbFile = NULL;
+    recordReader reader;
+
+    int maxMismatches = searchConfig.maxMismatches;
+    int segments = maxMismatches < 0 ? 0 : LOCUS_SEGMENTS;
+
+    if (min_match < 1 || maxMismatches >= LOCUS_SEGMENTS ||
+        !(index = openAlleleIndex(database, segments, &indexFile))) {
+        return -1;
+    }
+    if (index->offsetsOffset == 0) {
+        // No record offsets: the index belongs to a binary database
+        if (!mapFile(database, &dbMapping) || !(binaryHeader = binaryDatabaseHeaderOf(&dbMapping)) ||
+            binaryHeader->recordCount != index->recordCount) {
+            unmapFile(&indexFile);
+            return -1;
+        }
+    } else if (!(dbFile = fopen(database, "r"))) {
+        perror("Error opening database file");
+        exit(1);
+    } else {
+        initRecordReader(&reader, dbFile, BUFSIZ);
+    }
+
+    indexCursor cursor;
+    openIndexCursor(&cursor, index, patient, min_match, maxMismatches);
+
+    int visited = 0;
+    uint32_t ordinal;
+    matchPlan plan;
+    initMatchPlan(&plan, min_match, segments ? maxMismatches : -1);
+    const uint64_t* offsets = (const uint64_t*)(indexFile.data + index->offsetsOffset);
+    while (nextIndexCandidate(&cursor, &ordinal)) {
+        person current;
+        if (binaryHeader) {
+            binaryRecordToPerson(binaryHeader, ordinal, &current);
+        } else if (!readTextRecordAt(&reader, offsets[ordinal], &current)) {
+            continue;
+        }
+        int matches = countPlannedMatches(&current, patient, &plan);
+        if (matches >= min_match) {
+            visited++;
+            if (visitor(&current, matches, context)) {
+                break;
+            }
+        }
+    }
+    finishMatchPlan(&plan);
+
+    if (binaryHeader) {
+        unmapFile(&dbMapping);
+    } else {
+        freeRecordReader(&reader);
+        fclose(dbFile);
+    }
+    unmapFile(&indexFile);
+    return visited;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// ID index
+//
+// `createDatabase` also writes an ID index next to every database (its name plus ID_INDEX_EXTENSION):
+// the 9-digit IDs of its donors in ascending order, each with the ordinal and the text offset of
+// its record, so one donor is found by a binary search instead of a scan (see `lookupDonors`).
+// `updateDatabase` reads the IDs of the existing parts of a database from these indexes. The index
+// also carries the version stamp of the database file, which the server uses to notice rebuilds.
+
+
+/**
+ * @brief Builds the file name of the ID index of a database.
+ * 
+ * @param database The database file name.
+ * @param indexName Buffer that receives the index file name.
+ * @param size The size of `indexName`.
+ */
+void idIndexFileName(const char* database, char* indexName, size_t size) {
+    snprintf(indexName, size, "%s%s", database, ID_INDEX_EXTENSION);
+}
+
+
+
+
+/**
+ * @brief Records the ID of the next donor written to the database.
+ * 
+ * @param builder Pointer to the builder, initially zeroed.
+ * @param p Pointer to the donor; its ordinal is the number of donors added before it.
+ * @param offset File offset of the donor's record (only used for text databases).
+ */
+void addIdIndexRecord(idIndexBuilder* builder, const person* p, uint64_t offset) {
+    uint32_t id;
+    if (parseDonorId(p->id, &id)) {
+        if (builder->count == builder->capacity) {
+            size_t capacity = builder->capacity ? builder->capacity * 2 : 1024;
+            idIndexEntry* entries = realloc(builder->entries, capacity * sizeof(idIndexEntry));
+            if (!entries) {
+                perror("Error allocating ID index");
+                exit(1);
+            }
+            builder->entries = entries;
+            builder->capacity = capacity;
+        }
+        builder->entries[builder->count].id = id;
+        builder->entries[builder->count].ordinal = (uint32_t)builder->records;
+        builder->entries[builder->count].offset = offset;
+        builder->count++;
+    }
+    builder->records++;
+}
+
+
+
+
+/**
+ * @brief Orders ID index entries by ID; used with `qsort`.
+ */
+int compareIdIndexEntries(const void* a, const void* b) {
+    const idIndexEntry* first = a;
+    const idIndexEntry* second = b;
+    return (first->id > second->id) - (first->id < second->id);
+}
+
+
+
+
+/**
+ * @brief Reads the version stamp of a database from its ID index.
+ * 
+ * The stamp is read even if the index is stale, so a rebuild can still derive a newer one from it.
+ * 
+ * @param database The database file name.
+ * 
+ * @return The stamp, or 0 if the database has no ID index.
+ */
+uint64_t readDatabaseStamp(const char* database) {
+    char indexName[FILENAME_MAX];
+    idIndexHeader header;
+
+    idIndexFileName(database, indexName, sizeof(indexName));
+    FILE* in = fopen(indexName, "rb");
+    if (!in) {
+        return 0;
+    }
+    int valid = fread(&header, sizeof(header), 1, in) == 1 &&
+                memcmp(header.magic, ID_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+                header.version == ID_INDEX_VERSION;
+    fclose(in);
+    return valid ? header.stamp : 0;
+}
+
+
+
+
+/**
+ * @brief Writes the ID index collected by a builder next to its (already closed) database and
+ *        releases the builder's entries.
+ * 
+ * The version stamp of the database is the current time in nanoseconds, or one more than the
+ * stamp of the index it replaces if that is later, so every rebuild gets a larger stamp.
+ * 
+ * @param builder Pointer to the builder.
+ * @param database The database file name.
+ */
+void writeIdIndex(idIndexBuilder* builder, const char* database) {
+    char indexName[FILENAME_MAX];
+    idIndexHeader header;
+
+    if (builder->count > 0) {
+        qsort(builder->entries, builder->count, sizeof(idIndexEntry), compareIdIndexEntries);
+    }
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, ID_INDEX_MAGIC, sizeof(header.magic));
+    header.version = ID_INDEX_VERSION;
+    header.recordCount = builder->records;
+    header.entryCount = builder->count;
+    header.otherCount = builder->records - builder->count;
+    fileSignature(database, &header.databaseSize, &header.databaseMtime);
+    struct timespec now;
+    timespec_get(&now, TIME_UTC);
+    uint64_t previous = readDatabaseStamp(database);
+    header.stamp = (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+    if (header.stamp <= previous) {
+        header.stamp = previous + 1;
+    }
+
+    idIndexFileName(database, indexName, sizeof(indexName));
+    FILE* out = fopen(indexName, "wb");
+    if (!out) {
+        perror("Error creating ID index");
+    } else {
+        fwrite(&header, sizeof(header), 1, out);
+        if (builder->count > 0) {
+            fwrite(builder->entries, sizeof(idIndexEntry), builder->count, out);
+        }
+        fclose(out);
+    }
+    free(builder->entries);
+    memset(builder, 0, sizeof(*builder));
+}
+
+
+
+
+/**
+ * @brief Maps the ID index of a database if it exists and still describes the database.
+ * 
+ * @param database The database file name.
+ * @param file Pointer to the mapping that receives the index; release it with `unmapFile`.
+ * 
+ * @return Pointer to the index header inside the mapping, or NULL if there is no usable index.
+ */
+const idIndexHeader* openIdIndex(const char* database, mappedFile* file) {
+    char indexName[FILENAME_MAX];
+    uint64_t size;
+    int64_t mtime;
+
+    idIndexFileName(database, indexName, sizeof(indexName));
+    if (!fileSignature(database, &size, &mtime) || !mapFile(indexName, file)) {
+        return NULL;
+    }
+    const idIndexHeader* header = (const idIndexHeader*)file->data;
+    if (file->size < sizeof(idIndexHeader) ||
+        memcmp(header->magic, ID_INDEX_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != ID_INDEX_VERSION || header->databaseSize != size || header->databaseMtime != mtime ||
+        sizeof(idIndexHeader) + header->entryCount * sizeof(idIndexEntry) > file->size) {
+        unmapFile(file); // Missing, foreign or stale: the database changed after the index was written
+        return NULL;
+    }
+    return header;
+}
+
+
+
+
+/**
+ * @brief Looks up an ID in an ID index.
+ * 
+ * @param header Pointer to the mapped index header.
+ * @param id The numeric ID (see `parseDonorId`).
+ * 
+ * @return Pointer to the entry of the ID, or NULL if no donor of the database has it.
+ */
+const idIndexEntry* findIdIndexEntry(const idIndexHeader* header, uint32_t id) {
+    const idIndexEntry* entries = (const idIndexEntry*)(header + 1);
+    size_t low = 0, high = header->entryCount;
+
+    // Binary search over the ascending IDs
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (entries[middle].id < id) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low < header->entryCount && entries[low].id == id ? &entries[low] : NULL;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Parallel scan
+//
+// With `searchConfig.threads` above 1, a full scan splits the database into one shard per thread:
+// byte ranges that start on record boundaries for text databases, record ranges for binary ones.
+// Every worker matches its shard into its own donor list, and the lists are then passed to the
+// visitor in shard order, so donors arrive in database order as with a sequential scan.
+
+
+/**
+ * @brief Scans text database records from the current file position.
+ * 
+ * @param dbFile The open database file; records are read through a `recordReader`.
+ * @param end Stop before a record that starts at or after this offset (UINT64_MAX for the end of the file).
+ * @param patient Pointer to the patient.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param visitor Function called for every qualifying donor.
+ * @param context Passed unchanged to `visitor`.
+ * 
+ * @return The number of donors passed to `visitor`.
+ */
+int scanTextRecords(FILE* dbFile, uint64_t end, const person* patient, int min_match, donorVisitor visitor, void* context) {
+    int visited = 0;
+    person current;
+    recordReader reader;
+    matchPlan plan;
+    initRecordReader(&reader, dbFile, RECORD_BLOCK_SIZE);
+    initMatchPlan(&plan, min_match, -1);
+
+    // Read each donor from the database
+    while (recordReaderTell(&reader) < end && readRecord(&reader, &current)) {
+
+        // Count the number of gene matches between donor and patient, stopping once it cannot qualify
+        int matches = countPlannedMatches(&current, patient, &plan);
+
+         // Include the donor only if the match count is above the threshold
+        if (matches >= min_match) {
+            visited++;
+            if (visitor(&current, matches, context)) {
+                break;
+            }
+        }
+    }
+    finishMatchPlan(&plan);
+    freeRecordReader(&reader);
+    return visited;
+}
+
+
+
+
+/**
+ * @brief Finds the first record boundary of a text database at or after an offset.
+ * 
+ * Every record but the first starts with the newline that ends the previous one. A boundary is a
+ * newline between two non-blank characters, so a blank line inside a record is never taken for one.
+ * 
+ * @param dbFile The open database file.
+ * @param offset The offset to search from.
+ * @param size The size of the file.
+ * 
+ * @return The offset of the boundary newline, or `size` if there is none.
+ */
+uint64_t findRecordBoundary(FILE* dbFile, uint64_t offset, uint64_t size) {
+    if (offset == 0 || offset >= size || fileSeek(dbFile, (int64_t)offset - 1) != 0) {
+        return offset == 0 ? 0 : size;
+    }
+    int previous = fgetc(dbFile);
+    int c = fgetc(dbFile);
+    for (uint64_t position = offset; c != EOF; position++) {
+        int next = fgetc(dbFile);
+        if (c == '\n' && previous != EOF && !isspace(previous) && next != EOF && !isspace(next)) {
+            return position;
+        }
+        previous = c;
+        c = next;
+    }
+    return size;
+}
+
+
+
+
+/**
+ * @brief Thread entry point: matches one shard of a database into the shard's donor list.
+ * 
+ * @param argument Pointer to the `scanShard` to process.
+ * 
+ * @return NULL.
+ */
+void* scanShardWorker(void* argument) {
+    scanShard* shard = argument;
+    if (shard->header) {
+        scanBinaryRecords(shard->header, shard->begin, shard->end, shard->patient, shard->min_match,
+                          appendVisitedDonor, &shard->results);
+        return NULL;
+    }
+
+    // Every worker reads through its own stream
+    FILE* dbFile = fopen(shard->database, "r");
+    if (!dbFile || fileSeek(dbFile, (int64_t)shard->begin) != 0) {
+        perror("Error opening database file");
+        exit(1);
+    }
+    scanTextRecords(dbFile, shard->end, shard->patient, shard->min_match, appendVisitedDonor, &shard->results);
+    fclose(dbFile);
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief Streams the potential donors of a database found by several threads scanning it in shards.
+ * 
+ * @param database The database file name (text or binary).
+ * @param patient Pointer to the patient.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param threads The number of shards and worker threads.
+ * @param visitor Function called for every qualifying donor, in database order, once all the
+ *                shards have been scanned.
+ * @param context Passed unchanged to `visitor`.
+ * 
+ * @return The number of donors passed to `visitor`.
+ */
+int visitShardedScan(char* database, const person* patient, int min_match, int threads,
+                     donorVisitor visitor, void* context) {
+    mappedFile file;
+    const binaryDatabaseHeader* header = NULL;
+    uint64_t total;
+
+    if (isBinaryDatabase(database)) {
+        if (!mapFile(database, &file) || !(header = binaryDatabaseHeaderOf(&file))) {
+            fprintf(stderr, "Error: %s is not a valid binary database\n", database);
+            exit(1);
+        }
+        total = header->recordCount;
+    } else {
+        int64_t mtime;
+        if (!fileSignature(database, &total, &mtime)) {
+            perror("Error opening database file");
+            exit(1);
+        }
+    }
+
+    scanShard* shards = calloc((size_t)threads, sizeof(scanShard));
+    pthread_t* workers = malloc((size_t)threads * sizeof(pthread_t));
+    if (!shards || !workers) {
+        perror("Error allocating search threads");
+        exit(1);
+    }
+
+    // Split the database into shards of about the same size
+    FILE* dbFile = header ? NULL : fopen(database, "r");
+    for (int i = 0; i < threads; i++) {
+        uint64_t begin = total / (uint64_t)threads * (uint64_t)i;
+        shards[i].begin = dbFile ? findRecordBoundary(dbFile, begin, total) : begin;
+        if (i > 0) {
+            shards[i - 1].end = shards[i].begin;
+        }
+        shards[i].database = database;
+        shards[i].patient = patient;
+        shards[i].min_match = min_match;
+        shards[i].header = header;
+        initDonorList(&shards[i].results);
+    }
+    shards[threads - 1].end = total;
+    if (dbFile) {
+        fclose(dbFile);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        if (pthread_create(&workers[i], NULL, scanShardWorker, &shards[i]) != 0) {
+            perror("Error starting search thread");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Merge the shard results in database order
+    int visited = 0, stopped = 0;
+    for (int i = 0; i < threads; i++) {
+        for (int d = 0; d < shards[i].results.size && !stopped; d++) {
+            visited++;
+            stopped = visitor(&shards[i].results.items[d].donor, shards[i].results.items[d].matches, context);
+        }
+        free(shards[i].results.items);
+    }
+
+    free(workers);
+    free(shards);
+    if (header) {
+        unmapFile(&file);
+    }
+    return visited;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Database deltas
+//
+// `update` adds the new donors of a collection to an existing database without rewriting it: they
+// are written as a separate delta database <database>.d1, <database>.d2, ... in the format of the
+// base, with their own indexes. The manifest <database>.deltas holds the number of deltas, and
+// every search reads the base followed by its deltas. `compact` merges them back into the base.
+// An update and the renaming at the end of a compaction hold the database lock, so they never see
+// each other's half-written parts, and a second compaction of a database gives up while one runs.
+
+
+/**
+ * @brief Builds the file name of the delta manifest of a database.
+ * 
+ * @param database The database file name.
+ * @param manifestName Buffer that receives the manifest file name.
+ * @param size The size of `manifestName`.
+ */
+void deltaManifestName(const char* database, char* manifestName, size_t size) {
+    snprintf(manifestName, size, "%s%s", database, DELTA_MANIFEST_EXTENSION);
+}
+
+
+
+
+/**
+ * @brief Reads the number of deltas of a database from its manifest.
+ * 
+ * @param database The database file name.
+ * 
+ * @return The number of deltas; 0 if the database has no manifest.
+ */
+int readDeltaCount(const char* database) {
+    char manifestName[FILENAME_MAX];
+    int count = 0;
+    deltaManifestName(database, manifestName, sizeof(manifestName));
+    FILE* manifest = fopen(manifestName, "r");
+    if (!manifest) {
+        return 0;
+    }
+    if (fscanf(manifest, "%d", &count) != 1 || count < 0) {
+        count = 0;
+    }
+    fclose(manifest);
+    return count;
+}
+
+
+
+
+/**
+ * @brief Replaces the manifest of a database.
+ * 
+ * The new manifest is written next to the old one and renamed over it, so a concurrent search sees
+ * either the old or the new number of deltas.
+ * 
+ * @param database The database file name.
+ * @param count The number of deltas; 0 removes the manifest.
+ * 
+ * @note If the manifest cannot be written, the function prints an error message and exits the program.
+ */
+void writeDeltaCount(const char* database, int count) {
+    char manifestName[FILENAME_MAX], tempName[FILENAME_MAX];
+    deltaManifestName(database, manifestName, sizeof(manifestName));
+    if (count == 0) {
+        remove(manifestName);
+        return;
+    }
+    snprintf(tempName, sizeof(tempName), "%s%s.tmp", database, DELTA_MANIFEST_EXTENSION);
+    FILE* manifest = fopen(tempName, "w");
+    if (!manifest) {
+        perror("Error writing delta manifest");
+        exit(1);
+    }
+    fprintf(manifest, "%d\n", count);
+    fclose(manifest);
+#ifdef _WIN32
+    remove(manifestName); // rename does not replace an existing file on Windows
+#endif
+    if (rename(tempName, manifestName) != 0) {
+        perror("Error writing delta manifest");
+        exit(1);
+    }
+}
+
+
+
+
+/**
+ * @brief Takes an exclusive lock of a database, held until `unlockDatabase`.
+ * 
+ * The lock is a `flock` on a file next to the database. It belongs to the open file, so a child
+ * forked while it is held keeps holding it after the parent releases its own descriptor.
+ * 
+ * @param database The database file name.
+ * @param extension DATABASE_LOCK_EXTENSION or COMPACT_LOCK_EXTENSION.
+ * @param wait 1 to wait while another process holds the lock, 0 to give up at once.
+ * 
+ * @return The descriptor that holds the lock, or -1 if `wait` is 0 and the lock is held elsewhere.
+ *         Where `flock` is not available no lock is taken and 0 is returned.
+ * 
+ * @note If the lock file cannot be opened, the function prints an error message and exits the program.
+ */
+int lockDatabase(const char* database, const char* extension, int wait) {
+#ifndef _WIN32
+    char lockName[FILENAME_MAX];
+    snprintf(lockName, sizeof(lockName), "%s%s", database, extension);
+    int lock = open(lockName, O_RDWR | O_CREAT, 0644);
+    if (lock < 0) {
+        perror("Error opening database lock");
+        exit(1);
+    }
+    while (flock(lock, LOCK_EX | (wait ? 0 : LOCK_NB)) != 0) {
+        if (errno == EINTR) {
+            continue;
+        }
+        int busy = errno == EWOULDBLOCK;
+        close(lock);
+        if (busy && !wait) {
+            return -1;
+        }
+        perror("Error locking database");
+        exit(1);
+    }
+    return lock;
+#else
+    return 0;
+#endif
+}
+
+
+
+
+/**
+ * @brief Releases a lock taken by `lockDatabase`.
+ * 
+ * @param lock The descriptor returned by `lockDatabase`.
+ */
+void unlockDatabase(int lock) {
+#ifndef _WIN32
+    if (lock >= 0) {
+        close(lock);
+    }
+#endif
+}
+
+
+
+
+/**
+ * @brief Builds the file name of one part of a database: the base or one of its deltas.
+ * 
+ * @param database The database file name.
+ * @param part 0 for the base, k for the k-th delta.
+ * @param partName Buffer that receives the file name.
+ * @param size The size of `partName`.
+ */
+void databasePartName(const char* database, int part, char* partName, size_t size) {
+    if (part == 0) {
+        snprintf(partName, size, "%s", database);
+    } else {
+        snprintf(partName, size, "%s.d%d", database, part);
+    }
+}
+
+
+
+
+/**
+ * @brief Computes the version of a database and of all its deltas from their stamps.
+ * 
+ * @param database The database file name.
+ * 
+ * @return A value that changes whenever the database or one of its deltas is written again.
+ */
+uint64_t databaseVersion(const char* database) {
+    char partName[FILENAME_MAX];
+    int parts = 1 + readDeltaCount(database);
+    uint64_t version = 0xCBF29CE484222325ULL;
+    for (int part = 0; part < parts; part++) {
+        databasePartName(database, part, partName, sizeof(partName));
+        version = (version ^ readDatabaseStamp(partName)) * 0x100000001B3ULL;
+    }
+    return version;
+}
+
+
+
+
+/**
+ * @brief Builds the name of one of the files of a database.
+ * 
+ * @param database The database file name.
+ * @param file 0 for the database itself, 1 for its allele index, 2 for its segment index and 3 for
+ *             its ID index.
+ * @param fileName Buffer that receives the file name.
+ * @param size The size of `fileName`.
+ */
+void databaseFileName(const char* database, int file, char* fileName, size_t size) {
+    if (file == 0) {
+        snprintf(fileName, size, "%s", database);
+    } else if (file == 3) {
+        idIndexFileName(database, fileName, size);
+    } else {
+        indexFileName(database, file == 1 ? 0 : LOCUS_SEGMENTS, fileName, size);
+    }
+}
+
+
+
+
+/**
+ * @brief Removes a database file together with its indexes.
+ * 
+ * @param database The database file name.
+ */
+void removeDatabaseFiles(const char* database) {
+    char fileName[FILENAME_MAX];
+    for (int file = 0; file < 4; file++) {
+        databaseFileName(database, file, fileName, sizeof(fileName));
+        remove(fileName);
+    }
+}
+
+
+
+
+/**
+ * @brief Renames a database file together with its indexes, replacing any database of the new name.
+ * 
+ * @param from The current database file name.
+ * @param to The new database file name.
+ * 
+ * @note If the database cannot be renamed, the function prints an error message and exits the program.
+ */
+void renameDatabaseFiles(const char* from, const char* to) {
+    char fromName[FILENAME_MAX], toName[FILENAME_MAX];
+    for (int file = 0; file < 4; file++) {
+        databaseFileName(from, file, fromName, sizeof(fromName));
+        databaseFileName(to, file, toName, sizeof(toName));
+#ifdef _WIN32
+        remove(toName);
+#endif
+        if (rename(fromName, toName) != 0 && file == 0) {
+            perror("Error renaming database file");
+            exit(1);
+        }
+    }
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Donor blocks
+//
+// The batch search and the server score donors in blocks of DONOR_BLOCK_SIZE. A block keeps the
+// allele keys of its donors one locus per column, so one patient allele is compared against
+// consecutive donors in the inner loops. IDs are kept as numbers and names in a separate arena,
+// so scoring only reads the locus columns, and a donor is only rebuilt as a `person` once it
+// qualifies (see `blockDonor`).
+
+
+/**
+ * @brief Opens a database for reading its donors in order.
+ * 
+ * @param source Pointer to the source to initialise.
+ * @param database The database file name (text or binary).
+ * 
+ * @note If the database cannot be opened, the function prints an error message and exits the program.
+ */
+void openDonorSource(donorSource* source, char* database) {
+    source->header = NULL;
+    source->dbFile = NULL;
+    source->ownsFile = 1;
+    source->unitNames = 0;
+    source->next = 0;
+    if (isBinaryDatabase(database)) {
+        if (!mapFile(database, &source->file) || !(source->header = binaryDatabaseHeaderOf(&source->file))) {
+            fprintf(stderr, "Error: %s is not a valid binary database\n", database);
+            exit(1);
+        }
+    } else if (!(source->dbFile = fopen(database, "r"))) {
+        perror("Error opening database file");
+        exit(1);
+    } else {
+        initRecordReader(&source->reader, source->dbFile, RECORD_BLOCK_SIZE);
+    }
+}
+
+
+
+
+/**
+ * @brief Reads the donors of a text stream that is already open, such as a unit of a collection.
+ * 
+ * @param source Pointer to the source to initialise.
+ * @param stream The text stream, read from its current position. `closeDonorSource` leaves it open.
+ */
+void openDonorStream(donorSource* source, FILE* stream) {
+    source->header = NULL;
+    source->dbFile = stream;
+    source->ownsFile = 0;
+    source->unitNames = 0;
+    source->next = 0;
+    initRecordReader(&source->reader, stream, RECORD_BLOCK_SIZE);
+}
+
+
+
+
+/**
+ * @brief Gives a name read from a text database the form it has in a unit.
+ * 
+ * A sequential read of a text database keeps the padding of the previous record's last gene and
+ * the separating newline in front of a name. They are replaced by the single newline a unit has
+ * there, so the records of a database can be merged again like the records of a unit (see `writeDatabase`).
+ * 
+ * @param name The name, modified in place.
+ * @param first 1 for the first record of the database, which has nothing in front of its name.
+ */
+void restoreUnitName(char* name, int first) {
+    cleanName(name);
+    size_t start = strspn(name, " \t\n");
+    size_t length = strlen(name + start);
+    if (!first && start > 0) {
+        name[0] = '\n';
+        memmove(name + 1, name + start, length + 1);
+    } else {
+        memmove(name, name + start, length + 1);
+    }
+}
+
+
+
+
+/**
+ * @brief Reads the next donor of a source.
+ * 
+ * @param source Pointer to the source.
+ * @param p Pointer to the person that receives the donor.
+ * 
+ * @return 1 if a donor was read, 0 at the end of the database.
+ */
+int readSourceDonor(donorSource* source, person* p) {
+    if (!source->header) {
+        if (!readRecord(&source->reader, p)) {
+            return 0;
+        }
+        if (source->unitNames) {
+            restoreUnitName(p->name, source->next == 0);
+        }
+        source->next++;
+        return 1;
+    }
+    if (source->next >= source->header->recordCount) {
+        return 0;
+    }
+    binaryRecordToPerson(source->header, source->next++, p);
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Closes the database of a source.
+ * 
+ * @param source Pointer to the source.
+ */
+void closeDonorSource(donorSource* source) {
+    if (source->header) {
+        unmapFile(&source->file);
+    } else {
+        freeRecordReader(&source->reader);
+        if (source->ownsFile) {
+            fclose(source->dbFile);
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief Appends a string to a name arena.
+ * 
+ * @param arena Pointer to the arena.
+ * @param text The null-terminated string to append (its terminator is appended too).
+ * 
+ * @return The offset of the string in the arena.
+ * 
+ * @note If the arena cannot grow, the function prints an error message and exits the program.
+ */
+uint32_t appendArenaString(nameArena* arena, const char* text) {
+    size_t length = strlen(text) + 1;
+    if (arena->size + length > arena->capacity) {
+        size_t capacity = arena->capacity ? arena->capacity * 2 : 4096;
+        while (capacity < arena->size + length) {
+            capacity *= 2;
+        }
+        char* data = capacity <= UINT32_MAX ? realloc(arena->data, capacity) : NULL;
+        if (!data) {
+            perror("Error allocating donor names");
+            exit(1);
+        }
+        arena->data = data;
+        arena->capacity = capacity;
+    }
+    uint32_t offset = (uint32_t)arena->size;
+    memcpy(arena->data + arena->size, text, length);
+    arena->size += length;
+    return offset;
+}
+
+
+
+
+/**
+ * @brief Computes the two bits of an allele key in the allele filter of a block.
+ * 
+ * @param key The allele key (see `alleleKey`).
+ * @param bits Receives the two bit positions, below BLOCK_FILTER_BITS.
+ */
+void blockFilterBits(uint64_t key, unsigned bits[2]) {
+    uint64_t hash = key * 0x9E3779B97F4A7C15ULL;
+    bits[0] = (unsigned)(hash >> 32) % BLOCK_FILTER_BITS;
+    bits[1] = (unsigned)(hash >> 48) % BLOCK_FILTER_BITS;
+}
+
+
+
+
+/**
+ * @brief Checks whether some donor of a block may have an allele at a locus.
+ * 
+ * @param block Pointer to the block.
+ * @param locus The locus.
+ * @param key The allele key (see `alleleKey`).
+ * 
+ * @return 0 if no donor of the block has the allele, 1 if one may have it.
+ */
+int blockMayHaveAllele(const donorBlock* block, int locus, uint64_t key) {
+    unsigned bits[2];
+    blockFilterBits(key, bits);
+    return (block->present[locus][bits[0] / 64] >> (bits[0] % 64) & 1) &&
+           (block->present[locus][bits[1] / 64] >> (bits[1] % 64) & 1);
+}
+
+
+
+
+/**
+ * @brief Reads the next donors of a source into a block and computes their allele keys.
+ * 
+ * The allele keys of every locus are also added to the filter of the block (see
+ * `blockMayHaveAllele`), which lets an exact search skip the blocks that cannot qualify. Only the allele keys, the numeric ID and the offset of the name are kept in the block; the name
+ * goes to the arena. A donor whose ID is not 9 digits or whose genes cannot all be packed is stored
+ * with `ids[d] == BINARY_RAW_ID`, and its ID and genes follow its name in the arena as strings.
+ * 
+ * @param source Pointer to the source.
+ * @param block Pointer to the block to fill.
+ * @param names The arena that receives the names of the donors.
+ * 
+ * @return The number of donors in the block; 0 at the end of the database.
+ */
+int fillDonorBlock(donorSource* source, donorBlock* block, nameArena* names) {
+    person donor;
+    block->size = 0;
+    memset(block->present, 0, sizeof(block->present));
+    while (block->size < DONOR_BLOCK_SIZE && readSourceDonor(source, &donor)) {
+        int d = block->size++;
+        block->hashed[d] = 0;
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            unsigned bits[2];
+            block->loci[locus][d] = alleleKey(donor.genes[locus]);
+            block->masks[locus][d] = packedBaseMask(block->loci[locus][d]);
+            block->hashed[d] |= (block->loci[locus][d] & ALLELE_HASHED_KEY) != 0;
+            blockFilterBits(block->loci[locus][d], bits);
+            block->present[locus][bits[0] / 64] |= 1ULL << (bits[0] % 64);
+            block->present[locus][bits[1] / 64] |= 1ULL << (bits[1] % 64);
+        }
+        block->names[d] = appendArenaString(names, donor.name);
+        if (block->hashed[d] || !parseDonorId(donor.id, &block->ids[d])) {
+            // Keep the original strings of donors that do not fit the packed columns
+            block->ids[d] = BINARY_RAW_ID;
+            appendArenaString(names, donor.id);
+            for (int locus = 0; locus < NUM_LOCI; locus++) {
+                appendArenaString(names, donor.genes[locus]);
+            }
+        }
+    }
+    return block->size;
+}
+
+
+
+
+/**
+ * @brief Returns one gene of a donor of a block as a string.
+ * 
+ * @param block Pointer to the block.
+ * @param names The arena of the block.
+ * @param d The donor in the block.
+ * @param locus The locus.
+ * @param gene Buffer of LOCUS_LENGTH + 1 bytes, used for genes that are stored packed.
+ * 
+ * @return The null-terminated gene, in `gene` or in the arena.
+ */
+const char* blockDonorGene(const donorBlock* block, const nameArena* names, int d, int locus, char* gene) {
+    if (block->ids[d] != BINARY_RAW_ID) {
+        unpackLocus(block->loci[locus][d], gene);
+        return gene;
+    }
+    // The ID and the genes follow the name
+    const char* text = names->data + block->names[d];
+    for (int i = 0; i <= locus + 1; i++) {
+        text += strlen(text) + 1;
+    }
+    return text;
+}
+
+
+
+
+/**
+ * @brief Rebuilds a full `person` from a donor of a block.
+ * 
+ * @param block Pointer to the block.
+ * @param names The arena of the block.
+ * @param d The donor in the block.
+ * @param p Pointer to the person that receives the donor's fields.
+ */
+void blockDonor(const donorBlock* block, const nameArena* names, int d, person* p) {
+    const char* text = names->data + block->names[d];
+    snprintf(p->name, sizeof(p->name), "%s", text);
+    if (block->ids[d] == BINARY_RAW_ID) {
+        text += strlen(text) + 1;
+        snprintf(p->id, sizeof(p->id), "%s", text);
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            text += strlen(text) + 1;
+            snprintf(p->genes[locus], sizeof(p->genes[locus]), "%s", text);
+        }
+    } else {
+        snprintf(p->id, sizeof(p->id), "%09u", (unsigned)(block->ids[d] % 1000000000u)); // IDs have 9 digits
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            unpackLocus(block->loci[locus][d], p->genes[locus]);
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief Scores one block of donors against every patient of a batch.
+ * 
+ * The block's packed genes are stored one locus per column, so the inner loop compares one patient
+ * allele against consecutive donors and can be vectorised by the compiler. In a near-match search
+ * the columns are compared base by base with `countBlockMismatches` instead.
+ * 
+ * An exact search first looks the patient's alleles up in the filter of the block: a patient with
+ * fewer than `min_match` alleles that may occur in the block skips it, and otherwise only the loci
+ * whose allele may occur are compared.
+ * 
+ * @param block Pointer to the block (see `fillDonorBlock`).
+ * @param names The arena of the block.
+ * @param patients The patients of the batch.
+ * @param patientLoci Allele keys of the patients, one column of `numPatients` entries per locus.
+ * @param numPatients The number of patients.
+ * @param min_match The minimum number of matching genes.
+ * @param results One list per patient that receives its qualifying donors.
+ */
+void scoreDonorBlock(const donorBlock* block, const nameArena* names, const person* patients,
+                     const uint64_t* patientLoci, int numPatients, int min_match, donorList* results) {
+    int blockSize = block->size;
+    unsigned char matches[DONOR_BLOCK_SIZE];
+    unsigned char mismatches[DONOR_BLOCK_SIZE];
+    int maxMismatches = searchConfig.maxMismatches;
+
+    uint64_t compared = 0;
+    uint64_t matchingLoci = 0;
+
+    for (int p = 0; p < numPatients; p++) {
+        int presentLoci = (1 << NUM_LOCI) - 1;
+        if (maxMismatches < 0) {
+            int present = 0;
+            for (int locus = 0; locus < NUM_LOCI; locus++) {
+                if (!blockMayHaveAllele(block, locus, patientLoci[(size_t)locus * numPatients + p])) {
+                    presentLoci &= ~(1 << locus);
+                } else {
+                    present++;
+                }
+            }
+            if (present < min_match) {
+                continue; // No donor of the block can qualify
+            }
+        }
+        memset(matches, 0, sizeof(matches));
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            uint64_t allele = patientLoci[(size_t)locus * numPatients + p];
+            const uint64_t* column = block->loci[locus];
+            if (!(presentLoci & (1 << locus))) {
+                continue; // No donor of the block has the allele
+            }
+            if (maxMismatches < 0) {
+                for (int d = 0; d < blockSize; d++) {
+                    matches[d] += column[d] == allele;
+                }
+            } else if (allele & ALLELE_HASHED_KEY) {
+                // The patient's gene cannot be packed
+                for (int d = 0; d < blockSize; d++) {
+                    char gene[LOCUS_LENGTH + 1];
+                    const char* donorGene = blockDonorGene(block, names, d, locus, gene);
+                    matches[d] += countMismatches(donorGene, patients[p].genes[locus]) <= maxMismatches;
+                }
+            } else {
+                countBlockMismatches(column, block->masks[locus], blockSize, allele, packedBaseMask(allele), mismatches);
+                for (int d = 0; d < blockSize; d++) {
+                    matches[d] += mismatches[d] <= maxMismatches;
+                }
+            }
+        }
+        for (int d = 0; d < blockSize; d++) {
+            person donor;
+            int count = matches[d];
+            if (block->hashed[d]) {
+                // Hashed alleles can collide, so those donors are compared as strings
+                blockDonor(block, names, d, &donor);
+                count = maxMismatches < 0 ? countGeneMatches(&donor, &patients[p])
+                                          : countNearMatches(&donor, &patients[p], maxMismatches);
+            } else {
+                // The string comparisons count themselves
+                compared++;
+                matchingLoci += (uint64_t)count;
+            }
+            if (count >= min_match) {
+                if (!block->hashed[d]) {
+                    blockDonor(block, names, d, &donor);
+                }
+                appendDonor(&results[p], &donor, count);
+            }
+        }
+    }
+    statsRecord(STATS_MATCH, compared, matchingLoci, 0);
+}
+
+
+
+
+/**
+ * @brief Scores all the donors of one database file against every patient of a batch.
+ * 
+ * @param database The database file name (text or binary).
+ * @param patients The patients of the batch.
+ * @param patientLoci Allele keys of the patients, one column of `numPatients` entries per locus.
+ * @param numPatients The number of patients.
+ * @param min_match The minimum number of matching genes.
+ * @param results One list per patient; the qualifying donors are appended in database order.
+ * 
+ * @return The number of donors read from the file; 0 when the allele index of an exact search
+ *         shows that no patient can reach `min_match` in it, so the file is not read.
+ * 
+ * @note If the database file cannot be opened or the donor block cannot be allocated, the function
+ *       prints an error message and exits the program.
+ */
+long scoreDatabaseFile(char* database, const person* patients, const uint64_t* patientLoci,
+                       int numPatients, int min_match, donorList* results) {
+    nameArena names = { 0 };
+    long donorsRead = 0;
+
+    mappedFile indexFile;
+    const alleleIndexHeader* index;
+    if (searchConfig.maxMismatches < 0 && min_match > 0 && (index = openAlleleIndex(database, 0, &indexFile))) {
+        int reachable = 0;
+        for (int p = 0; p < numPatients && !reachable; p++) {
+            reachable = countIndexedAlleles(index, &patients[p]) >= min_match;
+        }
+        unmapFile(&indexFile);
+        if (!reachable) {
+            return 0;
+        }
+    }
+
+    // Score every block against all the patients before reading the next one
+    donorBlock* block = malloc(sizeof(donorBlock));
+    if (!block) {
+        perror("Error allocating donor block");
+        exit(1);
+    }
+    donorSource source;
+    openDonorSource(&source, database);
+    while (fillDonorBlock(&source, block, &names) > 0) {
+        scoreDonorBlock(block, &names, patients, patientLoci, numPatients, min_match, results);
+        donorsRead += block->size;
+        names.size = 0; // Only the strings of the current block are kept
+    }
+    closeDonorSource(&source);
+    free(block);
+    free(names.data);
+    return donorsRead;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Database shards
+//
+// `shard` splits a database and its deltas into <database>.s1, <database>.s2, ... in the format of
+// the database, each with its own indexes, so every shard can be served by its own `serve`. A
+// donor goes to the shard chosen by a hash of its ID, or by its position in the name order, which
+// gives every shard one contiguous range of names of about the same size. Every shard is merged
+// from all the parts, so duplicates are dropped exactly as in the unsharded database.
+
+
+/**
+ * @brief Builds the file name of one shard of a database.
+ * 
+ * @param database The database file name.
+ * @param shard The shard, from 0.
+ * @param shardName Buffer that receives the file name.
+ * @param size The size of `shardName`.
+ */
+void shardFileName(const char* database, int shard, char* shardName, size_t size) {
+    snprintf(shardName, size, "%s.s%d", database, shard + 1);
+}
+
+
+
+
+/**
+ * @brief Decides whether the next distinct donor of a merge belongs to a shard.
+ * 
+ * @param shard Pointer to the shard; its count of merged donors is advanced.
+ * @param donor Pointer to the donor.
+ * 
+ * @return 1 if the donor is written to the shard, 0 otherwise.
+ */
+int donorInShard(databaseShard* shard, const person* donor) {
+    uint64_t position = shard->seen++;
+    if (shard->byName) {
+        // The donors past an outdated total stay in the last shard
+        uint64_t range = shard->total > 0 && position < shard->total ? position * (uint64_t)shard->count / shard->total
+                       : (uint64_t)shard->count - 1;
+        return range == (uint64_t)shard->index;
+    }
+    uint64_t hash = 0xCBF29CE484222325ULL;
+    for (const char* c = donor->id; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char)*c) * 0x100000001B3ULL;
+    }
+    return hash % (uint64_t)shard->count == (uint64_t)shard->index;
+}
+
+
+
+
+/**
+ * @brief Counts the donors of a database and of its deltas.
+ * 
+ * @param database The database file name.
+ * 
+ * @return The number of donors. A part with a usable ID index is counted from the index header,
+ *         any other part is read.
+ * 
+ * @note If a part of the database cannot be opened, the function prints an error message and exits the program.
+ */
+uint64_t countDatabaseDonors(char* database) {
+    char partName[FILENAME_MAX];
+    int parts = 1 + readDeltaCount(database);
+    uint64_t total = 0;
+    for (int part = 0; part < parts; part++) {
+        mappedFile indexFile;
+        databasePartName(database, part, partName, sizeof(partName));
+        const idIndexHeader* index = openIdIndex(partName, &indexFile);
+        if (index) {
+            total += index->recordCount;
+            unmapFile(&indexFile);
+            continue;
+        }
+        donorSource source;
+        person donor;
+        openDonorSource(&source, partName);
+        while (readSourceDonor(&source, &donor)) {
+            total++;
+        }
+        closeDonorSource(&source);
+    }
+    return total;
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Unit sorting
+//
+// The merge of `writeDatabase` expects every unit to be sorted by name. With `--sort-memory`,
+// the units are first parsed and sorted by `searchConfig.threads` threads into runs of records
+// that fit the memory budget. Every run is written to a temporary file in the unit format, and the
+// runs are then merged like sorted units.
+
+
+/**
+ * @brief Compares two unit records by name, then by their order in the unit; used with `qsort`.
+ * 
+ * @param a Pointer to the first `unitRecord`.
+ * @param b Pointer to the second `unitRecord`.
+ * 
+ * @return A negative value, zero or a positive value as `a` sorts before, with or after `b`.
+ */
+int compareUnitRecords(const void* a, const void* b) {
+    const unitRecord* first = a;
+    const unitRecord* second = b;
+    int order = strcmp(first->donor.name, second->donor.name);
+    if (order != 0) {
+        return order;
+    }
+    return first->order < second->order ? -1 : first->order > second->order;
+}
+
+
+
+
+/**
+ * @brief Sorts records of a unit and writes them as a new run.
+ * 
+ * @param records The records, with clean names; sorted in place.
+ * @param count The number of records.
+ * @param runs The runs of the unit, which receive the new run rewound to its start.
+ * 
+ * @note If the run cannot be written, the function prints an error message and exits the program.
+ */
+void spillUnitRun(unitRecord* records, size_t count, unitRuns* runs) {
+    qsort(records, count, sizeof(unitRecord), compareUnitRecords);
+
+    FILE* run = tmpfile();
+    FILE** files = realloc(runs->files, (size_t)(runs->count + 1) * sizeof(FILE*));
+    if (!run || !files) {
+        perror("Error creating sort run");
+        exit(1);
+    }
+    runs->files = files;
+    runs->files[runs->count++] = run;
+
+    // Records are separated by newlines, as in a unit
+    for (size_t i = 0; i < count; i++) {
+        const person* donor = &records[i].donor;
+        fprintf(run, "%s%s %s", i > 0 ? "\n" : "", donor->name, donor->id);
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            fprintf(run, " %s", donor->genes[locus]);
+        }
+    }
+    if (fflush(run) != 0) {
+        perror("Error writing sort run");
+        exit(1);
+    }
+    rewind(run);
+}
+
+
+
+
+/**
+ * @brief Thread entry point: splits the units of a job into sorted runs.
+ * 
+ * @param argument Pointer to the `unitSortJob`.
+ * 
+ * @return NULL.
+ */
+void* sortUnitsWorker(void* argument) {
+    unitSortJob* job = argument;
+    unitRecord* records = malloc(job->capacity * sizeof(unitRecord));
+    if (!records) {
+        perror("Error allocating sort buffer");
+        exit(1);
+    }
+
+    for (int unit = job->first; unit < job->numberOfUnits; unit += job->step) {
+        donorSource source;
+        size_t count = 0, order = 0;
+        openDonorStream(&source, job->units[unit]);
+        while (readSourceDonor(&source, &records[count].donor)) {
+            restoreUnitName(records[count].donor.name, 1); // Compare the names without separators
+            records[count].order = order++;
+            if (++count == job->capacity) {
+                spillUnitRun(records, count, &job->runs[unit]);
+                count = 0;
+            }
+        }
+        if (count > 0) {
+            spillUnitRun(records, count, &job->runs[unit]);
+        }
+        closeDonorSource(&source);
+    }
+    free(records);
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief Sorts unsorted units into runs that can be merged by `writeDatabase`.
+ * 
+ * The units are shared among `searchConfig.threads` threads. Each thread holds at most its share of
+ * `searchConfig.sortMemory` bytes of records at a time and writes every sorted run to a temporary
+ * file. The runs of a unit come after the runs of the units before it.
+ * 
+ * @param units Array of file pointers to the units, read from their current position.
+ * @param numberOfUnits The number of units.
+ * @param numberOfRuns Pointer that receives the number of runs.
+ * 
+ * @return A dynamically allocated array of the runs, to be released with `closeUnitRuns`.
+ */
+FILE** sortUnitRuns(FILE** units, int numberOfUnits, int* numberOfRuns) {
+    int threads = searchConfig.threads < numberOfUnits ? searchConfig.threads : numberOfUnits;
+    if (threads < 1) {
+        threads = 1;
+    }
+    size_t capacity = (size_t)searchConfig.sortMemory / (size_t)threads / sizeof(unitRecord);
+    unitRuns* runs = calloc((size_t)(numberOfUnits > 0 ? numberOfUnits : 1), sizeof(unitRuns));
+    unitSortJob* jobs = malloc((size_t)threads * sizeof(unitSortJob));
+    pthread_t* workers = malloc((size_t)threads * sizeof(pthread_t));
+    if (!runs || !jobs || !workers) {
+        perror("Error allocating sort threads");
+        exit(1);
+    }
+
+    for (int i = 0; i < threads; i++) {
+        jobs[i].units = units;
+        jobs[i].numberOfUnits = numberOfUnits;
+        jobs[i].first = i;
+        jobs[i].step = threads;
+        jobs[i].capacity = capacity > 0 ? capacity : 1;
+        jobs[i].runs = runs;
+        if (pthread_create(&workers[i], NULL, sortUnitsWorker, &jobs[i]) != 0) {
+            perror("Error starting sort thread");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+
+    // Collect the runs in unit order
+    int count = 0;
+    for (int unit = 0; unit < numberOfUnits; unit++) {
+        count += runs[unit].count;
+    }
+    FILE** files = malloc((size_t)(count > 0 ? count : 1) * sizeof(FILE*));
+    if (!files) {
+        perror("Error allocating sort runs");
+        exit(1);
+    }
+    count = 0;
+    for (int unit = 0; unit < numberOfUnits; unit++) {
+        for (int run = 0; run < runs[unit].count; run++) {
+            files[count++] = runs[unit].files[run];
+        }
+        free(runs[unit].files);
+    }
+
+    free(workers);
+    free(jobs);
+    free(runs);
+    *numberOfRuns = count;
+    return files;
+}
+
+
+
+
+/**
+ * @brief Closes and removes the runs made by `sortUnitRuns`.
+ * 
+ * @param runs The runs.
+ * @param numberOfRuns The number of runs.
+ */
+void closeUnitRuns(FILE** runs, int numberOfRuns) {
+    for (int i = 0; i < numberOfRuns; i++) {
+        fclose(runs[i]);
+    }
+    free(runs);
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Result cache
+//
+// The server keeps the results of recent queries, keyed by the patient's alleles. An entry holds
+// every donor with at least the minimal match of its first query (its floor) together with its
+// match count, so the same patient asked again with any minimal match from that floor up is
+// answered from memory. A first query is computed at its own minimal match, so a high-stringency
+// query never pays for the donors it does not want. Only when a lower minimal match arrives for the
+// patient is the entry widened: the query is computed down to RESULT_CACHE_MIN_MATCH, and the entry
+// keeps the lowest floor, no higher than that query's minimal match, whose donors fit in a quarter
+// of the cache. If even the query's own minimal match does not fit, the patient's entry is dropped,
+// so later queries are computed as asked instead of being widened again. At most
+// RESULT_CACHE_ENTRIES entries holding RESULT_CACHE_DONORS donors in all are kept; the least
+// recently used ones are evicted first.
+// The cache is emptied whenever the server reloads its database, which happens as soon as the
+// database is rebuilt (see `databaseVersion`).
+
+
+/**
+ * @brief Initialises an empty result cache.
+ * 
+ * @param cache Pointer to the cache.
+ * 
+ * @note If the cache cannot be allocated, the function prints an error message and exits the program.
+ */
+void initResultCache(resultCache* cache) {
+    cache->entries = calloc(RESULT_CACHE_ENTRIES, sizeof(resultCacheEntry));
+    if (!cache->entries) {
+        perror("Error allocating result cache");
+        exit(1);
+    }
+    cache->count = 0;
+    cache->donors = 0;
+    cache->clock = 0;
+    pthread_mutex_init(&cache->lock, NULL);
+}
+
+
+
+
+/**
+ * @brief Removes every entry of a result cache.
+ * 
+ * @param cache Pointer to the cache.
+ */
+void clearResultCache(resultCache* cache) {
+    pthread_mutex_lock(&cache->lock);
+    for (int i = 0; i < cache->count; i++) {
+        free(cache->entries[i].donors.items);
+    }
+    cache->count = 0;
+    cache->donors = 0;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+
+
+/**
+ * @brief Releases a result cache and its entries.
+ * 
+ * @param cache Pointer to the cache.
+ */
+void freeResultCache(resultCache* cache) {
+    clearResultCache(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->entries);
+    cache->entries = NULL;
+}
+
+
+
+
+/**
+ * @brief Finds the entry of a patient in a result cache.
+ * 
+ * @param cache Pointer to the cache; its lock must be held.
+ * @param patient Pointer to the patient.
+ * 
+ * @return The index of the entry, or -1 if the patient has none.
+ */
+int findResultCacheEntry(const resultCache* cache, const person* patient) {
+    for (int i = 0; i < cache->count; i++) {
+        int locus = 0;
+        while (locus < NUM_LOCI && strcmp(cache->entries[i].genes[locus], patient->genes[locus]) == 0) {
+            locus++;
+        }
+        if (locus == NUM_LOCI) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+
+
+
+/**
+ * @brief Removes one entry of a result cache.
+ * 
+ * @param cache Pointer to the cache; its lock must be held.
+ * @param entry The index of the entry.
+ */
+void removeResultCacheEntry(resultCache* cache, int entry) {
+    cache->donors -= cache->entries[entry].donors.size;
+    free(cache->entries[entry].donors.items);
+    cache->entries[entry] = cache->entries[--cache->count];
+}
+
+
+
+
+/**
+ * @brief Answers a query from a result cache.
+ * 
+ * @param cache Pointer to the cache.
+ * @param patient Pointer to the patient.
+ * @param min_match The minimum number of matching genes.
+ * @param results An empty list (see `initDonorList`); receives the qualifying donors in database
+ *                order if the query is answered.
+ * 
+ * @return 1 if the cache answered the query, 0 if the patient is not cached, -1 if the patient's
+ *         entry was computed for a higher minimal match.
+ */
+int lookupResultCache(resultCache* cache, const person* patient, int min_match, donorList* results) {
+    pthread_mutex_lock(&cache->lock);
+    int entry = findResultCacheEntry(cache, patient);
+    if (entry < 0 || cache->entries[entry].floor > min_match) {
+        pthread_mutex_unlock(&cache->lock);
+        return entry < 0 ? 0 : -1;
+    }
+    const donorList* donors = &cache->entries[entry].donors;
+    cache->entries[entry].lastUse = ++cache->clock;
+    for (int i = 0; i < donors->size; i++) {
+        if (donors->items[i].matches >= min_match) {
+            appendDonor(results, &donors->items[i].donor, donors->items[i].matches);
+        }
+    }
+    pthread_mutex_unlock(&cache->lock);
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Adds the results of a query to a result cache, replacing any entry of the same patient.
+ * 
+ * The entry gets the lowest floor from `floor` up to `min_match` whose donors fit in a quarter of
+ * the cache. If none does, nothing is stored and the patient's old entry is dropped.
+ * 
+ * @param cache Pointer to the cache.
+ * @param patient Pointer to the patient.
+ * @param floor The minimal match the results were computed with.
+ * @param min_match The minimal match of the query, the highest floor the entry may get.
+ * @param results Every donor with at least `floor` matches. The cache takes a copy of those it
+ *                keeps.
+ */
+void storeResultCache(resultCache* cache, const person* patient, int floor, int min_match, const donorList* results) {
+    int counts[NUM_LOCI + 1] = {0}; // Donors by match count
+    int size = results->size;
+
+    for (int i = 0; i < results->size; i++) {
+        counts[results->items[i].matches]++;
+    }
+    while (size > RESULT_CACHE_DONORS / 4 && floor < min_match) {
+        size -= floor >= 0 ? counts[floor] : 0; // No donor has fewer than 0 matches
+        floor++;
+    }
+    if (size > RESULT_CACHE_DONORS / 4) {
+        pthread_mutex_lock(&cache->lock);
+        int entry = findResultCacheEntry(cache, patient);
+        if (entry >= 0) {
+            removeResultCacheEntry(cache, entry);
+        }
+        pthread_mutex_unlock(&cache->lock);
+        return;
+    }
+    donorMatch* items = malloc((size_t)(size > 0 ? size : 1) * sizeof(donorMatch));
+    if (!items) {
+        perror("Error allocating result cache");
+        exit(1);
+    }
+    int kept = 0;
+    for (int i = 0; i < results->size; i++) {
+        if (results->items[i].matches >= floor) {
+            items[kept++] = results->items[i];
+        }
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    int entry = findResultCacheEntry(cache, patient);
+    if (entry >= 0) {
+        removeResultCacheEntry(cache, entry);
+    }
+    // Evict the least recently used entries until the new one fits
+    while (cache->count == RESULT_CACHE_ENTRIES || cache->donors + size > RESULT_CACHE_DONORS) {
+        int oldest = 0;
+        for (int i = 1; i < cache->count; i++) {
+            if (cache->entries[i].lastUse < cache->entries[oldest].lastUse) {
+                oldest = i;
+            }
+        }
+        removeResultCacheEntry(cache, oldest);
+    }
+    resultCacheEntry* added = &cache->entries[cache->count++];
+    memcpy(added->genes, patient->genes, sizeof(added->genes));
+    added->floor = floor;
+    added->lastUse = ++cache->clock;
+    added->donors.items = items;
+    added->donors.size = size;
+    added->donors.capacity = size;
+    added->donors.arena = NULL;
+    cache->donors += size;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Server
+//
+// `serve` keeps a unified database in memory, as donor blocks together with its mapped allele and
+// segment indexes, and answers match queries with a line protocol, either on standard input and
+// output or on a Unix domain socket with one thread per client:
+//
+//   MATCH <minimal match> <gene 1> ... <gene NUM_LOCI> [top]
+//   -> OK <count>, then one "<name>\t<id>\t<matches>" line per donor, best matches first
+//   QUIT
+//   -> closes the connection
+//
+// Before every query the database, its index files, its delta manifest and its version stamps are
+// checked, and the store is reloaded when any of them changed. Repeated patients are answered from
+// the result cache.
+
+
+/**
+ * @brief Reads the size and modification time of a database and of its two index files, and the
+ *        number of deltas of the database.
+ * 
+ * @param database The database file name.
+ * @param size Receives the sizes (0 for a missing file); the last entry is the number of deltas.
+ * @param mtime Receives the modification times (0 for a missing file); the last entry is the one
+ *              of the delta manifest.
+ */
+void databaseSignature(const char* database, uint64_t size[4], int64_t mtime[4]) {
+    char indexName[FILENAME_MAX];
+    deltaManifestName(database, indexName, sizeof(indexName));
+    if (!fileSignature(indexName, &size[3], &mtime[3])) {
+        mtime[3] = 0;
+    }
+    // A manifest can be rewritten within a second without changing its size
+    size[3] = (uint64_t)readDeltaCount(database);
+    for (int file = 0; file < 3; file++) {
+        if (file > 0) {
+            indexFileName(database, file == 1 ? 0 : LOCUS_SEGMENTS, indexName, sizeof(indexName));
+        }
+        if (!fileSignature(file == 0 ? database : indexName, &size[file], &mtime[file])) {
+            size[file] = 0;
+            mtime[file] = 0;
+        }
+    }
+}
+
+
+
+
+/**
+ * @brief Maps one index of a database for a store, if it describes the loaded base donors.
+ * 
+ * @param store Pointer to the store; its `baseCount` must be final.
+ * @param database The database file name.
+ * @param segments 0 for the allele index, LOCUS_SEGMENTS for the segment index.
+ * @param file Pointer to the mapping that receives the index.
+ * 
+ * @return Pointer to the index header, or NULL if the index cannot be used.
+ */
+const alleleIndexHeader* openStoreIndex(const donorStore* store, const char* database, int segments, mappedFile* file) {
+    const alleleIndexHeader* index = openAlleleIndex(database, segments, file);
+    if (index && index->recordCount != (uint64_t)store->baseCount) {
+        unmapFile(file); // Written for another version of the database
+        return NULL;
+    }
+    return index;
+}
+
+
+
+
+/**
+ * @brief Loads all the donors of a database and of its deltas into memory and maps the indexes
+ *        of the base database.
+ * 
+ * @param store Pointer to the store to fill.
+ * @param database The database file name (text or binary).
+ * 
+ * @return 1 on success, 0 if the database does not exist.
+ */
+int loadDonorStore(donorStore* store, char* database) {
+    memset(store, 0, sizeof(*store));
+    databaseSignature(database, store->size, store->mtime);
+    if (store->size[0] == 0 && store->mtime[0] == 0) {
+        return 0;
+    }
+    store->version = databaseVersion(database);
+
+    // Every part starts a new block, so the blocks of the base are the ones its indexes describe
+    int capacity = 0;
+    int parts = 1 + (int)store->size[3];
+    for (int part = 0; part < parts; part++) {
+        char partName[FILENAME_MAX];
+        donorSource source;
+        databasePartName(database, part, partName, sizeof(partName));
+        openDonorSource(&source, partName);
+        for (;;) {
+            if (store->blockCount == capacity) {
+                capacity = capacity ? capacity * 2 : 16;
+                donorBlock* blocks = realloc(store->blocks, (size_t)capacity * sizeof(donorBlock));
+                if (!blocks) {
+                    perror("Error allocating donor store");
+                    exit(1);
+                }
+                store->blocks = blocks;
+            }
+            int size = fillDonorBlock(&source, &store->blocks[store->blockCount], &store->names);
+            if (size == 0) {
+                break;
+            }
+            store->blockCount++;
+            store->donorCount += size;
+        }
+        closeDonorSource(&source);
+        if (part == 0) {
+            store->baseBlocks = store->blockCount;
+            store->baseCount = store->donorCount;
+        }
+    }
+
+    store->index = openStoreIndex(store, database, 0, &store->indexFile);
+    store->segmentIndex = openStoreIndex(store, database, LOCUS_SEGMENTS, &store->segmentFile);
+    fprintf(stderr, "Loaded %ld donors from %s\n", store->donorCount, database);
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Releases the donors and the index mappings of a store.
+ * 
+ * @param store Pointer to the store.
+ */
+void freeDonorStore(donorStore* store) {
+    if (store->index) {
+        unmapFile(&store->indexFile);
+    }
+    if (store->segmentIndex) {
+        unmapFile(&store->segmentFile);
+    }
+    free(store->blocks);
+    free(store->names.data);
+    memset(store, 0, sizeof(*store));
+}
+
+
+
+
+/**
+ * @brief Finds the potential donors of a patient among the donors of a store.
+ * 
+ * With a minimal match of at least 1 the candidates of the base database come from the allele
+ * index (or the segment index in a near-match search), otherwise every block is scored with
+ * `scoreDonorBlock`. The blocks of the deltas are always scored.
+ * 
+ * @param store Pointer to the store.
+ * @param patient Pointer to the patient.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param results An empty list (see `initDonorList`); receives the qualifying donors in database order.
+ */
+void queryDonorStore(const donorStore* store, const person* patient, int min_match, donorList* results) {
+    int maxMismatches = searchConfig.maxMismatches;
+    const alleleIndexHeader* index = maxMismatches < 0 ? store->index
+                                   : maxMismatches < LOCUS_SEGMENTS ? store->segmentIndex : NULL;
+    int firstBlock = 0;
+
+    if (min_match >= 1 && index) {
+        indexCursor cursor;
+        uint32_t ordinal;
+        matchPlan plan;
+        openIndexCursor(&cursor, index, patient, min_match, maxMismatches);
+        initMatchPlan(&plan, min_match, maxMismatches);
+        while (nextIndexCandidate(&cursor, &ordinal)) {
+            person donor;
+            blockDonor(&store->blocks[ordinal / DONOR_BLOCK_SIZE], &store->names, ordinal % DONOR_BLOCK_SIZE, &donor);
+            int matches = countPlannedMatches(&donor, patient, &plan);
+            if (matches >= min_match) {
+                appendDonor(results, &donor, matches);
+            }
+        }
+        finishMatchPlan(&plan);
+        firstBlock = store->baseBlocks;
+    }
+
+    uint64_t patientLoci[NUM_LOCI];
+    for (int locus = 0; locus < NUM_LOCI; locus++) {
+        patientLoci[locus] = alleleKey(patient->genes[locus]);
+    }
+    for (int b = firstBlock; b < store->blockCount; b++) {
+        scoreDonorBlock(&store->blocks[b], &store->names, patient, patientLoci, 1, min_match, results);
+    }
+}
+
+
+
+
+/**
+ * @brief Gives a query access to the server's store, reloading it first if the database changed.
+ * 
+ * @param server Pointer to the server.
+ * 
+ * @note Every call must be paired with `releaseDonorStore`.
+ */
+void acquireDonorStore(donorServer* server) {
+    uint64_t size[4];
+    int64_t mtime[4];
+
+    pthread_rwlock_rdlock(&server->lock);
+    databaseSignature(server->database, size, mtime);
+    if (memcmp(size, server->store.size, sizeof(size)) == 0 && memcmp(mtime, server->store.mtime, sizeof(mtime)) == 0 &&
+        databaseVersion(server->database) == server->store.version) {
+        return;
+    }
+    pthread_rwlock_unlock(&server->lock);
+
+    pthread_rwlock_wrlock(&server->lock);
+    // Another query may have reloaded the store in the meantime
+    databaseSignature(server->database, size, mtime);
+    if (memcmp(size, server->store.size, sizeof(size)) != 0 || memcmp(mtime, server->store.mtime, sizeof(mtime)) != 0 ||
+        databaseVersion(server->database) != server->store.version) {
+        donorStore store;
+        if (loadDonorStore(&store, server->database)) {
+            freeDonorStore(&server->store);
+            server->store = store;
+            clearResultCache(&server->cache);
+        }
+    }
+    pthread_rwlock_unlock(&server->lock);
+    pthread_rwlock_rdlock(&server->lock);
+}
+
+
+
+
+/**
+ * @brief Ends the access of a query to the server's store.
+ * 
+ * @param server Pointer to the server.
+ */
+void releaseDonorStore(donorServer* server) {
+    pthread_rwlock_unlock(&server->lock);
+}
+
+
+
+
+/**
+ * @brief Writes the result of a match query: "OK <count>" and one line per donor.
+ * 
+ * @param out The stream of the client.
+ * @param results The qualifying donors.
+ * @param topK The number of donors to send, or 0 for all of them.
+ * @param countLine 1 to start with the "OK <count>" line, 0 for the donor lines only.
+ * @param scratch The arena of the query, which receives the ranking (see `rankCleanedDonors`).
+ */
+void writeQueryResults(FILE* out, const donorList* results, int topK, int countLine, queryArena* scratch) {
+    const donorMatch** ranked;
+    int count = rankCleanedDonors(results->items, results->size, topK, scratch, &ranked);
+
+    if (countLine) {
+        fprintf(out, "OK %d\n", count);
+    }
+    for (int i = 0; i < count; i++) {
+        fprintf(out, "%s\t%s\t%d\n", ranked[i]->donor.name, ranked[i]->donor.id, ranked[i]->matches);
+    }
+}
+
+
+
+
+/**
+ * @brief Parses a match query: "MATCH <minimal match> <gene 1> ... <gene NUM_LOCI> [top]".
+ * 
+ * Every gene is read like the `fscanf` conversion of its locus in `locusScanFormats`.
+ * 
+ * @param line The request, without its newline.
+ * @param patient Receives the genes of the patient; the other fields are cleared.
+ * @param min_match Receives the minimal match.
+ * @param topK Receives the number of donors wanted, 0 if the request does not limit it.
+ * 
+ * @return 1 if the request is a valid match query, 0 otherwise.
+ */
+int parseMatchRequest(const char* line, person* patient, int* min_match, int* topK) {
+    int used = 0;
+    memset(patient, 0, sizeof(*patient));
+    *topK = 0;
+    if (strncmp(line, "MATCH ", 6) != 0 || sscanf(line + 6, "%d%n", min_match, &used) != 1) {
+        return 0;
+    }
+    line += 6 + used;
+    for (int locus = 0; locus < NUM_LOCI; locus++) {
+        if (sscanf(line, locusScanFormats[locus], patient->genes[locus], &used) != 1) {
+            return 0;
+        }
+        line += used;
+    }
+    sscanf(line, "%d", topK);
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Answers the requests of one client until it sends QUIT or closes its input.
+ * 
+ * @param server Pointer to the server.
+ * @param in The stream the requests are read from.
+ * @param out The stream the responses are written to.
+ */
+void serveConnection(donorServer* server, FILE* in, FILE* out) {
+    char line[512];
+    queryArena arena; // Results and ranking of the current query
+    initQueryArena(&arena);
+
+    while (fgets(line, sizeof(line), in)) {
+        person patient;
+        int min_match, topK;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (strcmp(line, "QUIT") == 0) {
+            break;
+        }
+        if (!parseMatchRequest(line, &patient, &min_match, &topK)) {
+            fprintf(out, "ERR usage: MATCH <minimal match> <gene 1> ... <gene %d> [top]\n", NUM_LOCI);
+            fflush(out);
+            continue;
+        }
+
+        donorList results;
+        resetQueryArena(&arena);
+        initArenaDonorList(&results, &arena);
+        acquireDonorStore(server);
+        int cached = lookupResultCache(&server->cache, &patient, min_match, &results);
+        if (cached != 1) {
+            // A first query is computed as asked; a lower one for the same patient widens the entry
+            int floor = min_match;
+            if (cached < 0 && RESULT_CACHE_MIN_MATCH < min_match) {
+                floor = RESULT_CACHE_MIN_MATCH;
+            }
+            queryDonorStore(&server->store, &patient, floor, &results);
+            storeResultCache(&server->cache, &patient, floor, min_match, &results);
+            if (floor < min_match) {
+                int kept = 0;
+                for (int i = 0; i < results.size; i++) {
+                    if (results.items[i].matches >= min_match) {
+                        results.items[kept++] = results.items[i];
+                    }
+                }
+                results.size = kept;
+            }
+        }
+        releaseDonorStore(server);
+
+        writeQueryResults(out, &results, topK > 0 ? topK : 0, 1, &arena);
+        fflush(out);
+    }
+    freeQueryArena(&arena);
+}
+
+
+
+
+#ifndef _WIN32
+/**
+ * @brief Thread entry point: serves one socket client and closes its connection.
+ * 
+ * @param argument Pointer to the `serverClient`, freed here.
+ * 
+ * @return NULL.
+ */
+void* serveClientThread(void* argument) {
+    serverClient* client = argument;
+    FILE* in = fdopen(client->socket, "r");
+    FILE* out = fdopen(dup(client->socket), "w");
+    if (in && out) {
+        serveConnection(client->server, in, out);
+    }
+    if (out) {
+        fclose(out);
+    }
+    if (in) {
+        fclose(in);
+    } else {
+        close(client->socket);
+    }
+    free(client);
+    return NULL;
+}
+
+
+
+
+/**
+ * @brief Accepts clients on a Unix domain socket forever, one thread per client.
+ * 
+ * @param server Pointer to the server.
+ * @param path The file name of the socket; an existing file of that name is replaced.
+ * 
+ * @return 1 if the socket could not be set up (the function does not return otherwise).
+ */
+int serveSocket(donorServer* server, const char* path) {
+    struct sockaddr_un address;
+    if (strlen(path) >= sizeof(address.sun_path)) {
+        fprintf(stderr, "Error: socket path %s is too long\n", path);
+        return 1;
+    }
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) {
+        perror("Error creating socket");
+        return 1;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, path);
+    unlink(path);
+    if (bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(listener, 16) != 0) {
+        perror("Error listening on socket");
+        close(listener);
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN); // A client that disconnects early must not stop the server
+
+    for (;;) {
+        int connection = accept(listener, NULL, NULL);
+        if (connection < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error accepting client");
+            close(listener);
+            return 1;
+        }
+        serverClient* client = malloc(sizeof(serverClient));
+        pthread_t thread;
+        if (!client) {
+            perror("Error allocating client");
+            exit(1);
+        }
+        client->server = server;
+        client->socket = connection;
+        if (pthread_create(&thread, NULL, serveClientThread, client) != 0) {
+            perror("Error starting client thread");
+            close(connection);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
+#endif
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Coordinator
+//
+// `coordinate` answers the match queries of the server protocol for a database split by `shard`,
+// on standard input and output, by asking the `serve` of every shard over its Unix domain socket.
+// A query is sent to all the shards before any answer is read, so they search in parallel. The
+// best `top` donors of the database are among the best `top` of their shards, so the limit is
+// passed on and no shard sends its full list. The answers are ranked again by `rankDonors`, into
+// the order of `sortDonors`. A shard that fails is reconnected on the next query.
+
+
+#ifndef _WIN32
+/**
+ * @brief Connects the coordinator to a shard server, unless it is connected already.
+ * 
+ * @param shard Pointer to the connection.
+ * 
+ * @return 1 if the shard is connected, 0 if its server could not be reached.
+ */
+int connectShard(shardConnection* shard) {
+    struct sockaddr_un address;
+    if (shard->in) {
+        return 1;
+    }
+    if (strlen(shard->path) >= sizeof(address.sun_path)) {
+        return 0;
+    }
+    int connection = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (connection < 0) {
+        return 0;
+    }
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, shard->path);
+    if (connect(connection, (struct sockaddr*)&address, sizeof(address)) != 0) {
+        close(connection);
+        return 0;
+    }
+    shard->out = fdopen(dup(connection), "w");
+    shard->in = fdopen(connection, "r");
+    if (!shard->in || !shard->out) {
+        perror("Error opening shard connection");
+        exit(1);
+    }
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Closes the connection of the coordinator to a shard server.
+ * 
+ * @param shard Pointer to the connection; it can be connected again.
+ */
+void closeShard(shardConnection* shard) {
+    if (shard->in) {
+        fclose(shard->out);
+        fclose(shard->in);
+    }
+    shard->in = NULL;
+    shard->out = NULL;
+}
+
+
+
+
+/**
+ * @brief Reads the answer of a shard server to a match query.
+ * 
+ * @param shard Pointer to the connection.
+ * @param results The list the donors of the answer are appended to.
+ * 
+ * @return 1 on success, 0 if the connection failed or the answer is not an "OK" answer.
+ */
+int readShardResults(shardConnection* shard, donorList* results) {
+    char line[256];
+    int count;
+    if (!fgets(line, sizeof(line), shard->in) || sscanf(line, "OK %d", &count) != 1) {
+        return 0;
+    }
+    for (int i = 0; i < count; i++) {
+        person donor;
+        if (!fgets(line, sizeof(line), shard->in)) {
+            return 0;
+        }
+        // "<name>\t<id>\t<matches>"; the name is the only field that can hold spaces
+        line[strcspn(line, "\r\n")] = '\0';
+        char* matches = strrchr(line, '\t');
+        if (!matches) {
+            return 0;
+        }
+        *matches++ = '\0';
+        char* id = strrchr(line, '\t');
+        if (!id) {
+            return 0;
+        }
+        *id++ = '\0';
+        if (strlen(line) >= sizeof(donor.name) || strlen(id) >= sizeof(donor.id)) {
+            return 0;
+        }
+        memset(&donor, 0, sizeof(donor));
+        memcpy(donor.name, line, strlen(line) + 1);
+        memcpy(donor.id, id, strlen(id) + 1);
+        appendDonor(results, &donor, atoi(matches));
+    }
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Answers the requests of one client from the shard servers until it sends QUIT or closes its input.
+ * 
+ * @param shards The connections to the shard servers.
+ * @param numShards The number of shards.
+ * @param in The stream the requests are read from.
+ * @param out The stream the responses are written to.
+ */
+void coordinateConnection(shardConnection* shards, int numShards, FILE* in, FILE* out) {
+    char line[512];
+    queryArena arena; // Merged results and ranking of the current query
+    initQueryArena(&arena);
+
+    while (fgets(line, sizeof(line), in)) {
+        person patient;
+        int min_match, topK;
+
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') {
+            continue;
+        }
+        if (strcmp(line, "QUIT") == 0) {
+            break;
+        }
+        if (!parseMatchRequest(line, &patient, &min_match, &topK)) {
+            fprintf(out, "ERR usage: MATCH <minimal match> <gene 1> ... <gene %d> [top]\n", NUM_LOCI);
+            fflush(out);
+            continue;
+        }
+        if (topK < 0) {
+            topK = 0;
+        }
+
+        // Scatter: every shard starts its search before the first answer is read
+        for (int i = 0; i < numShards; i++) {
+            if (connectShard(&shards[i])) {
+                fprintf(shards[i].out, "MATCH %d", min_match);
+                for (int locus = 0; locus < NUM_LOCI; locus++) {
+                    fprintf(shards[i].out, " %s", patient.genes[locus]);
+                }
+                fprintf(shards[i].out, " %d\n", topK);
+                if (fflush(shards[i].out) != 0) {
+                    closeShard(&shards[i]);
+                }
+            }
+        }
+
+        // Gather: every connected shard is read, so no answer is left behind for the next query
+        donorList results;
+        const char* failed = NULL;
+        resetQueryArena(&arena);
+        initArenaDonorList(&results, &arena);
+        for (int i = 0; i < numShards; i++) {
+            if (!shards[i].in || !readShardResults(&shards[i], &results)) {
+                closeShard(&shards[i]);
+                if (!failed) {
+                    failed = shards[i].path;
+                }
+            }
+        }
+
+        if (failed) {
+            fprintf(out, "ERR shard %s is unavailable\n", failed);
+        } else {
+            writeQueryResults(out, &results, topK, 1, &arena);
+        }
+        fflush(out);
+    }
+    freeQueryArena(&arena);
+}
+#endif
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Data generator and benchmark
+//
+// `gen` writes synthetic collections of any size: names follow a skewed distribution over common
+// first and last names, most alleles come from a small pool per locus (with some point mutations),
+// and a configurable share of the donors repeats a donor written before. `bench` unifies such a
+// collection and then times searches and ranking for patients drawn from the database. The sorted
+// positions of `gen` use `pow`, so the program is linked with -lm.
+
+
+const char* generatorFirstNames[] = {
+    "Avi", "Dani", "Noa", "Maya", "Yossi", "Tali", "Roy", "Shira", "Eli", "Dana", "Omer", "Yael",
+    "Ben", "Lior", "Gal", "Ori", "Michal", "Amit", "Neta", "Itay", "Ruth", "George", "Sara", "Adam",
+    "Lea", "Nir", "Hila", "Tom", "Anna", "Eyal", "Rina", "Uri"
+};
+
+const char* generatorLastNames[] = {
+    "Cohen", "Levi", "Mizrahi", "Peretz", "Biton", "Dahan", "Avraham", "Friedman", "Haim", "Katz",
+    "Azulay", "Malka", "Amar", "Ohana", "Gabay", "Ben David", "Shapiro", "Bar", "Segal", "Klein",
+    "Golan", "Baron", "Fresh", "Brooks", "Rosen", "Weiss", "Adler", "Stern", "Levin", "Gold",
+    "Harel", "Carmel"
+};
+
+#define GENERATOR_FIRST_NAMES ((int)(sizeof(generatorFirstNames) / sizeof(generatorFirstNames[0])))
+#define GENERATOR_LAST_NAMES ((int)(sizeof(generatorLastNames) / sizeof(generatorLastNames[0])))
+#define GENERATOR_NAMES (GENERATOR_FIRST_NAMES * GENERATOR_LAST_NAMES)
+#define GENERATOR_POOL_ALLELES 256 // Common alleles of every locus
+
+
+
+
+/**
+ * @brief Returns the next value of a xorshift64* pseudo-random generator.
+ * 
+ * @param state Pointer to the generator state; must not be 0.
+ * 
+ * @return A pseudo-random 64-bit value.
+ */
+uint64_t nextRandom(uint64_t* state) {
+    *state ^= *state >> 12;
+    *state ^= *state << 25;
+    *state ^= *state >> 27;
+    return *state * 0x2545F4914F6CDD1DULL;
+}
+
+
+
+
+/**
+ * @brief Returns a pseudo-random number uniformly distributed in (0, 1).
+ * 
+ * @param state Pointer to the generator state.
+ */
+double randomUnit(uint64_t* state) {
+    return ((double)(nextRandom(state) >> 11) + 0.5) / 9007199254740992.0;
+}
+
+
+
+
+/**
+ * @brief Fills a gene of a locus with random bases.
+ * 
+ * @param gene Buffer of at least LOCUS_LENGTH + 1 bytes.
+ * @param locus The locus, which sets the number of bases.
+ * @param state Pointer to the generator state.
+ */
+void randomGene(char* gene, int locus, uint64_t* state) {
+    for (int base = 0; base < locusLengths[locus]; base++) {
+        gene[base] = "ACGT"[nextRandom(state) & 3];
+    }
+    gene[locusLengths[locus]] = '\0';
+}
+
+
+
+
+char generatorNames[GENERATOR_NAMES][30]; // "<first> <last>" for every pair of names
+
+
+
+
+/**
+ * @brief Compares two generator names; used with `qsort` on arrays of name indices.
+ * 
+ * @param a Pointer to the first index into `generatorNames`.
+ * @param b Pointer to the second index.
+ * 
+ * @return The `strcmp` order of the two names.
+ */
+int compareGeneratorNames(const void* a, const void* b) {
+    return strcmp(generatorNames[*(const int*)a], generatorNames[*(const int*)b]);
+}
+
+
+
+
+/**
+ * @brief Writes a synthetic collection: the units <root>1.txt to <root><n>.txt.
+ * 
+ * Every name is a first and a last name whose popularity falls with its rank in the name lists.
+ * Every allele comes with probability `settings->sharingRate` percent from a pool of
+ * GENERATOR_POOL_ALLELES alleles of its locus (a tenth of them with one to three point mutations),
+ * and is random otherwise. A donor repeats the last donor of the same name written so far with
+ * probability `settings->duplicateRate` percent, and the other donors get distinct 9-digit IDs.
+ * The IDs start at a point of their walk chosen by the seed, so collections of different seeds
+ * can be added to each other with `update`.
+ * 
+ * @param rootName The root name of the units.
+ * @param numUnits The number of units.
+ * @param donorsPerUnit The number of records of every unit.
+ * @param settings The generator settings.
+ * 
+ * @return 1 on success, 0 if a unit could not be written.
+ */
+int generateUnits(const char* rootName, int numUnits, long donorsPerUnit, const generatorSettings* settings) {
+    uint64_t state = settings->seed * 0x9E3779B97F4A7C15ULL + 1;
+    static char pool[NUM_LOCI][GENERATOR_POOL_ALLELES][LOCUS_LENGTH + 1];
+    static double cumulative[GENERATOR_NAMES];
+    static person lastDonor[GENERATOR_NAMES];
+    int order[GENERATOR_NAMES];
+
+    for (int locus = 0; locus < NUM_LOCI; locus++) {
+        for (int allele = 0; allele < GENERATOR_POOL_ALLELES; allele++) {
+            randomGene(pool[locus][allele], locus, &state);
+        }
+    }
+
+    // Names in sorted order, with their cumulative popularity
+    double total = 0;
+    for (int first = 0; first < GENERATOR_FIRST_NAMES; first++) {
+        for (int last = 0; last < GENERATOR_LAST_NAMES; last++) {
+            int name = first * GENERATOR_LAST_NAMES + last;
+            snprintf(generatorNames[name], sizeof(generatorNames[name]), "%s %s",
+                     generatorFirstNames[first], generatorLastNames[last]);
+            order[name] = name;
+        }
+    }
+    qsort(order, GENERATOR_NAMES, sizeof(int), compareGeneratorNames);
+    for (int i = 0; i < GENERATOR_NAMES; i++) {
+        int first = order[i] / GENERATOR_LAST_NAMES, last = order[i] % GENERATOR_LAST_NAMES;
+        total += 1.0 / ((first + 1) * (double)(last + 1));
+        cumulative[i] = total;
+        lastDonor[i].id[0] = '\0';
+    }
+
+    // Seed 1 starts at 123456789; other seeds start elsewhere in the same walk
+    uint64_t nextID = (uint64_t)(settings->seed - 1) * 0x9E3779B97F4A7C15ULL % 1000000000ULL;
+    for (int unit = 0; unit < numUnits; unit++) {
+        char fileName[FILENAME_MAX];
+        snprintf(fileName, sizeof(fileName), "%s%d.txt", rootName, unit + 1);
+        FILE* out = fopen(fileName, "w");
+        if (!out) {
+            printf("Error: Could not create file %s\n", fileName);
+            return 0;
+        }
+        setvbuf(out, NULL, _IOFBF, RECORD_BLOCK_SIZE);
+
+        // Sorted units draw their positions in ascending order: the maximum of i uniforms is U^(1/i)
+        double remaining = 1;
+        for (long k = donorsPerUnit; k >= 1; k--) {
+            double position;
+            if (settings->sorted) {
+                remaining *= pow(randomUnit(&state), 1.0 / (double)k);
+                position = 1 - remaining;
+            } else {
+                position = randomUnit(&state);
+            }
+            int low = 0, high = GENERATOR_NAMES - 1;
+            while (low < high) {
+                int middle = (low + high) / 2;
+                if (cumulative[middle] < position * total) {
+                    low = middle + 1;
+                } else {
+                    high = middle;
+                }
+            }
+
+            person* donor = &lastDonor[low];
+            if (donor->id[0] == '\0' || nextRandom(&state) % 100 >= (uint64_t)settings->duplicateRate) {
+                // The IDs walk through all 9-digit numbers in a scrambled order, so they never repeat
+                uint64_t id = (nextID++ * 387420489ULL + 123456789ULL) % 1000000000ULL;
+                snprintf(donor->id, sizeof(donor->id), "%09u", (unsigned)id);
+                for (int locus = 0; locus < NUM_LOCI; locus++) {
+                    if (nextRandom(&state) % 100 < (uint64_t)settings->sharingRate) {
+                        // Low pool indices are the most common alleles
+                        double u = randomUnit(&state);
+                        memcpy(donor->genes[locus], pool[locus][(int)(u * u * u * GENERATOR_POOL_ALLELES)], LOCUS_LENGTH + 1);
+                        if (nextRandom(&state) % 10 == 0) {
+                            for (int m = 0, count = 1 + (int)(nextRandom(&state) % 3); m < count; m++) {
+                                donor->genes[locus][nextRandom(&state) % (uint64_t)locusLengths[locus]] = "ACGT"[nextRandom(&state) & 3];
+                            }
+                        }
+                    } else {
+                        randomGene(donor->genes[locus], locus, &state);
+                    }
+                }
+            }
+            fprintf(out, "%-30s %s", generatorNames[order[low]], donor->id);
+            for (int locus = 0; locus < NUM_LOCI; locus++) {
+                fprintf(out, " %s", donor->genes[locus]);
+            }
+            fputc('\n', out);
+        }
+        if (fclose(out) != 0) {
+            printf("Error: Could not write file %s\n", fileName);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Compares two doubles; used with `qsort` to sort latencies.
+ * 
+ * @param a Pointer to the first double.
+ * @param b Pointer to the second double.
+ * 
+ * @return A negative value, zero or a positive value as `a` is smaller than, equal to or larger than `b`.
+ */
+int compareDoubles(const void* a, const void* b) {
+    double first = *(const double*)a, second = *(const double*)b;
+    return (first > second) - (first < second);
+}
+
+
+
+
+/**
+ * @brief Prints the latency percentiles of a sorted set of measurements.
+ * 
+ * @param label The name of the measured step.
+ * @param latencies The durations in seconds, sorted in ascending order.
+ * @param count The number of durations.
+ */
+void printLatencies(const char* label, const double* latencies, int count) {
+    if (count == 0) {
+        return;
+    }
+    double sum = 0;
+    for (int i = 0; i < count; i++) {
+        sum += latencies[i];
+    }
+    // Nearest-rank percentiles
+    printf("%-7s %d runs, mean %.3f ms, p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n", label, count,
+           sum / count * 1e3, latencies[(count - 1) * 50 / 100] * 1e3, latencies[(count - 1) * 90 / 100] * 1e3,
+           latencies[(count - 1) * 99 / 100] * 1e3, latencies[count - 1] * 1e3);
+}
+
+
+
+
+/**
+ * @brief Measures the merge, the search and the ranking on a collection.
+ * 
+ * The units are unified into `database` with `createDatabase`. Then `numQueries` patients are drawn
+ * evenly from the database, and for each the search (`getPotentialDonors`) and the ranking of its
+ * results (cleaning the names and `rankDonors`, as `printTopPotentialDonors` does) are timed separately.
+ * 
+ * @param units Array of file pointers to the units; they are left open.
+ * @param numUnits The number of units.
+ * @param inputBytes The total size of the units.
+ * @param database The database to write; its name selects the format as in `createDatabase`.
+ * @param numQueries The number of searches.
+ * @param min_match The minimal match of the searches.
+ * 
+ * @note If the database cannot be written, the function prints an error message and exits the program.
+ */
+void benchmarkDatabase(FILE** units, int numUnits, uint64_t inputBytes, char* database, int numQueries, int min_match) {
+    double start = currentSeconds();
+    createDatabase(units, numUnits, database);
+    double mergeTime = currentSeconds() - start;
+
+    // Draw the patients evenly from the database
+    long records = 0;
+    donorSource source;
+    person donor;
+    openDonorSource(&source, database);
+    while (readSourceDonor(&source, &donor)) {
+        records++;
+    }
+    closeDonorSource(&source);
+    printf("merge   %ld records in %.3f s: %.0f records/s, %.1f MB/s\n", records, mergeTime,
+           records / mergeTime, inputBytes / mergeTime / 1e6);
+
+    if (numQueries > records) {
+        numQueries = (int)records;
+    }
+    person* patients = malloc((size_t)(numQueries > 0 ? numQueries : 1) * sizeof(person));
+    double* searchTimes = malloc((size_t)(numQueries > 0 ? numQueries : 1) * sizeof(double));
+    double* rankTimes = malloc((size_t)(numQueries > 0 ? numQueries : 1) * sizeof(double));
+    if (!patients || !searchTimes || !rankTimes) {
+        perror("Error allocating benchmark");
+        exit(1);
+    }
+    long next = 0;
+    int drawn = 0;
+    openDonorSource(&source, database);
+    for (long r = 0; drawn < numQueries && readSourceDonor(&source, &donor); r++) {
+        if (r == next) {
+            patients[drawn++] = donor;
+            next = (long)((double)records * drawn / numQueries);
+        }
+    }
+    closeDonorSource(&source);
+
+    // Per-donor reports would measure the terminal, not the search
+    int verbose = searchConfig.verbose;
+    searchConfig.verbose = 0;
+    long found = 0;
+    queryArena scratch; // Ranking of one query at a time
+    initQueryArena(&scratch);
+    for (int q = 0; q < drawn; q++) {
+        int count;
+        start = currentSeconds();
+        donorMatch* matches = getPotentialDonors(database, patients[q], min_match, &count);
+        searchTimes[q] = currentSeconds() - start;
+
+        const donorMatch** ranked;
+        start = currentSeconds();
+        resetQueryArena(&scratch);
+        rankCleanedDonors(matches, count, 0, &scratch, &ranked);
+        rankTimes[q] = currentSeconds() - start;
+        found += count;
+        free(matches);
+    }
+    freeQueryArena(&scratch);
+    searchConfig.verbose = verbose;
+
+    if (drawn > 0) {
+        double total = 0;
+        for (int q = 0; q < drawn; q++) {
+            total += searchTimes[q];
+        }
+        // Indexed searches read only their candidates, so the rate is given in queries, not in records
+        printf("search  %d queries, min match %d, %.1f donors found per query: %.0f queries/s\n",
+               drawn, min_match, (double)found / drawn, drawn / total);
+        qsort(searchTimes, (size_t)drawn, sizeof(double), compareDoubles);
+        qsort(rankTimes, (size_t)drawn, sizeof(double), compareDoubles);
+        printLatencies("search", searchTimes, drawn);
+        printLatencies("rank", rankTimes, drawn);
+    }
+    free(patients);
+    free(searchTimes);
+    free(rankTimes);
+}
+
+
+
+
+// ------------------------------------------------------------------------------------
+// Command line
+
+
+/**
+ * @brief Applies the search options given on the command line and removes them from `argv`.
+ * 
+ * Recognised options: `--threads N` (worker threads of a full database scan or of sorting units),
+ * `--mismatches N` (near-match search that tolerates N mismatched bases per locus), `--quiet` (no
+ * per-donor reports, tab-separated results, fully buffered output), `--sort-memory MB` (sort
+ * unsorted units before merging them, holding at most MB megabytes of records in memory),
+ * `--stats` or `--stats-json` (report the run statistics on standard error at exit) and
+ * `--no-prefetch` (read text blocks only when they are needed, see the Record reader section).
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments, compacted in place.
+ * 
+ * @return The number of arguments left in `argv`.
+ */
+int parseSearchOptions(int argc, char* argv[]) {
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc) {
+            searchConfig.threads = atoi(argv[++i]);
+            if (searchConfig.threads < 1) {
+                searchConfig.threads = 1;
+            }
+        } else if (strcmp(argv[i], "--mismatches") == 0 && i + 1 < argc) {
+            searchConfig.maxMismatches = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--quiet") == 0) {
+            searchConfig.verbose = 0;
+        } else if (strcmp(argv[i], "--sort-memory") == 0 && i + 1 < argc) {
+            searchConfig.sortMemory = atol(argv[++i]) * 1024 * 1024;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            searchConfig.stats = 1;
+        } else if (strcmp(argv[i], "--stats-json") == 0) {
+            searchConfig.stats = 2;
+        } else if (strcmp(argv[i], "--no-prefetch") == 0) {
+            searchConfig.prefetch = 0;
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argv[kept] = NULL;
+    return kept;
+}
+
+
+
+
+/**
+ * @brief Reads a file of patients: NUM_LOCI whitespace-separated gene sequences per patient.
+ * 
+ * @param filename The name of the patients file.
+ * @param numPatients Pointer that receives the number of patients read.
+ * 
+ * @return A dynamically allocated array of patients (only their genes are set), or NULL if the
+ *         file cannot be opened. The caller frees it.
+ */
+person* readPatientsFile(const char* filename, int* numPatients) {
+    FILE* in = fopen(filename, "r");
+    if (!in) {
+        return NULL;
+    }
+    int count = 0, capacity = 16;
+    person* patients = malloc((size_t)capacity * sizeof(person));
+    for (;;) {
+        if (count == capacity) {
+            capacity *= 2;
+            patients = realloc(patients, (size_t)capacity * sizeof(person));
+        }
+        if (!patients) {
+            perror("Error allocating patients");
+            exit(1);
+        }
+        memset(&patients[count], 0, sizeof(person));
+        int genes = 0;
+        int used;
+        while (genes < NUM_LOCI && fscanf(in, locusScanFormats[genes], patients[count].genes[genes], &used) == 1) {
+            genes++;
+        }
+        if (genes < NUM_LOCI) {
+            break; // End of file (an incomplete last patient is ignored)
+        }
+        count++;
+    }
+    fclose(in);
+    *numPatients = count;
+    return patients;
+}
+
+
+
+
+/**
+ * @brief Runs the `batch` command: finds and prints the potential donors of a file of patients.
+ * 
+ * Usage: batch <database> <patients file> <minimal match>
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "batch".
+ * 
+ * @return The process exit status.
+ */
+int runBatchCommand(int argc, char* argv[]) {
+    if (argc != 5) {
+        fprintf(stderr, "Usage: %s batch <database> <patients file> <minimal match>\n", argv[0]);
+        return 1;
+    }
+    int numPatients;
+    person* patients = readPatientsFile(argv[3], &numPatients);
+    if (!patients) {
+        printf("Error: Could not open file %s\n", argv[3]);
+        return 1;
+    }
+
+    donorList* results = malloc((size_t)(numPatients > 0 ? numPatients : 1) * sizeof(donorList));
+    if (!results) {
+        perror("Error allocating results");
+        exit(1);
+    }
+    getPotentialDonorsBatch(argv[2], patients, numPatients, atoi(argv[4]), results);
+
+    queryArena scratch; // Ranking of one patient at a time
+    initQueryArena(&scratch);
+    for (int p = 0; p < numPatients; p++) {
+        printf("\nPatient %d\n", p + 1);
+        resetQueryArena(&scratch);
+        printRankedDonors(results[p].items, results[p].size, 0, &scratch);
+        free(results[p].items);
+    }
+    freeQueryArena(&scratch);
+    free(results);
+    free(patients);
+    return 0;
+}
+
+
+
+
+/**
+ * @brief Runs the "serve" command: keeps a database loaded and answers match queries.
+ * 
+ * Usage: serve <database> [socket path]. Without a socket path the queries are read from standard
+ * input and answered on standard output (see the Server section for the protocol).
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "serve".
+ * 
+ * @return The process exit status.
+ */
+int runServeCommand(int argc, char* argv[]) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "Usage: %s serve <database> [socket path]\n", argv[0]);
+        return 1;
+    }
+    donorServer server;
+    server.database = argv[2];
+    if (!loadDonorStore(&server.store, server.database)) {
+        printf("Error: Could not open file %s\n", server.database);
+        return 1;
+    }
+    pthread_rwlock_init(&server.lock, NULL);
+    initResultCache(&server.cache);
+
+    int status = 0;
+    if (argc == 3) {
+        serveConnection(&server, stdin, stdout);
+    } else {
+#ifdef _WIN32
+        fprintf(stderr, "Error: socket mode is not supported on this platform\n");
+        status = 1;
+#else
+        status = serveSocket(&server, argv[3]);
+#endif
+    }
+
+    pthread_rwlock_destroy(&server.lock);
+    freeResultCache(&server.cache);
+    freeDonorStore(&server.store);
+    return status;
+}
+
+
+
+
+/**
+ * @brief Runs the "shard" command: splits a database into shards for separate servers.
+ * 
+ * Usage: shard <database> <number of shards> [id|name]. Donors are assigned by a hash of their ID
+ * by default, or by ranges of the name order (see the Database shards section).
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "shard".
+ * 
+ * @return The process exit status.
+ */
+int runShardCommand(int argc, char* argv[]) {
+    if ((argc != 4 && argc != 5) || atoi(argv[3]) < 1 ||
+        (argc == 5 && strcmp(argv[4], "id") != 0 && strcmp(argv[4], "name") != 0)) {
+        fprintf(stderr, "Usage: %s shard <database> <number of shards> [id|name]\n", argv[0]);
+        return 1;
+    }
+    uint64_t size;
+    int64_t mtime;
+    if (!fileSignature(argv[2], &size, &mtime)) {
+        printf("Error: Could not open file %s\n", argv[2]);
+        return 1;
+    }
+    shardDatabase(argv[2], atoi(argv[3]), argc == 5 && strcmp(argv[4], "name") == 0);
+    return 0;
+}
+
+
+
+
+/**
+ * @brief Runs the "coordinate" command: answers match queries from the servers of the shards of a database.
+ * 
+ * Usage: coordinate <shard socket path>... The queries are read from standard input and answered
+ * on standard output with the protocol of the Server section.
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "coordinate".
+ * 
+ * @return The process exit status.
+ */
+int runCoordinateCommand(int argc, char* argv[]) {
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s coordinate <shard socket path>...\n", argv[0]);
+        return 1;
+    }
+#ifdef _WIN32
+    fprintf(stderr, "Error: socket mode is not supported on this platform\n");
+    return 1;
+#else
+    int numShards = argc - 2;
+    shardConnection* shards = calloc((size_t)numShards, sizeof(shardConnection));
+    if (!shards) {
+        perror("Error allocating shards");
+        exit(1);
+    }
+    signal(SIGPIPE, SIG_IGN); // A shard server that stops must not stop the coordinator
+    for (int i = 0; i < numShards; i++) {
+        shards[i].path = argv[i + 2];
+        if (!connectShard(&shards[i])) {
+            printf("Error: Could not connect to shard %s\n", shards[i].path);
+            return 1;
+        }
+    }
+
+    coordinateConnection(shards, numShards, stdin, stdout);
+
+    for (int i = 0; i < numShards; i++) {
+        closeShard(&shards[i]);
+    }
+    free(shards);
+    return 0;
+#endif
+}
+
+
+
+
+/**
+ * @brief Opens the unit files <root>1.txt to <root><n>.txt of a collection.
+ * 
+ * @param rootName The root name of the units.
+ * @param numUnits The number of units.
+ * @param unitFiles Array of `numUnits` file pointers that receives the open files.
+ * 
+ * @return 1 on success; 0 if a unit could not be opened, after printing an error and closing the
+ *         units opened before it.
+ */
+int openUnitFiles(const char* rootName, int numUnits, FILE** unitFiles) {
+    for (int i = 0; i < numUnits; i++) {
+        char fileName[FILENAME_MAX];
+        snprintf(fileName, sizeof(fileName), "%s%d.txt", rootName, i + 1);
+        unitFiles[i] = fopen(fileName, "r");
+        if (unitFiles[i] == NULL) {
+            printf("Error: Could not open file %s\n", fileName);
+            while (i-- > 0) {
+                fclose(unitFiles[i]);
+            }
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+
+
+/**
+ * @brief Runs the "unify" command: merges the units of a collection into a database.
+ * 
+ * Usage: unify <units root name> <number of units> <database>.
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "unify".
+ * 
+ * @return The process exit status.
+ */
+int runUnifyCommand(int argc, char* argv[]) {
+    if (argc != 5 || atoi(argv[3]) < 1) {
+        fprintf(stderr, "Usage: %s unify <units root name> <number of units> <database>\n", argv[0]);
+        return 1;
+    }
+    int numUnits = atoi(argv[3]);
+    FILE** unitFiles = malloc((size_t)numUnits * sizeof(FILE*));
+    if (!unitFiles) {
+        perror("Error allocating units");
+        exit(1);
+    }
+    if (!openUnitFiles(argv[2], numUnits, unitFiles)) {
+        free(unitFiles);
+        return 1;
+    }
+
+    createDatabase(unitFiles, numUnits, argv[4]);
+
+    for (int i = 0; i < numUnits; i++) {
+        fclose(unitFiles[i]);
+    }
+    free(unitFiles);
+    return 0;
+}
+
+
+
+
+/**
+ * @brief Runs the "search" command: finds and prints the potential donors of one patient.
+ * 
+ * Usage: search <database> <minimal match> <gene 1> ... <gene NUM_LOCI> [top]. The donors are
+ * printed as the menu prints them, or with --quiet as "<name>\t<id>\t<matches>" lines, best
+ * matches first.
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "search".
+ * 
+ * @return The process exit status.
+ */
+int runSearchCommand(int argc, char* argv[]) {
+    if (argc != 4 + NUM_LOCI && argc != 5 + NUM_LOCI) {
+        fprintf(stderr, "Usage: %s search <database> <minimal match> <gene 1> ... <gene %d> [top]\n", argv[0], NUM_LOCI);
+        return 1;
+    }
+    person patient;
+    memset(&patient, 0, sizeof(patient));
+    for (int i = 0; i < NUM_LOCI; i++) {
+        snprintf(patient.genes[i], sizeof(patient.genes[i]), "%s", argv[4 + i]);
+    }
+    int topK = argc == 5 + NUM_LOCI ? atoi(argv[4 + NUM_LOCI]) : 0;
+
+    queryArena arena;
+    donorList donors;
+    initQueryArena(&arena);
+    initArenaDonorList(&donors, &arena);
+    visitPotentialDonors(argv[2], &patient, atoi(argv[3]), collectPotentialDonor, &donors);
+
+    if (searchConfig.verbose) {
+        printRankedDonors(donors.items, donors.size, topK > 0 ? topK : 0, &arena);
+    } else {
+        writeQueryResults(stdout, &donors, topK > 0 ? topK : 0, 0, &arena);
+    }
+    freeQueryArena(&arena);
+    return 0;
+}
+
+
+
+
+/**
+ * @brief Runs the "print" command: lists every donor of a database, one tab-separated line each.
+ * 
+ * Usage: print <database>. Every line holds the name, the ID and the genes of a donor. The donors of
+ * the deltas of the database follow the donors of the base.
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "print".
+ * 
+ * @return The process exit status.
+ */
+int runPrintCommand(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s print <database>\n", argv[0]);
+        return 1;
+    }
+    uint64_t size;
+    int64_t mtime;
+    if (!fileSignature(argv[2], &size, &mtime)) {
+        printf("Error: Could not open file %s\n", argv[2]);
+        return 1;
+    }
+
+    int parts = 1 + readDeltaCount(argv[2]);
+    for (int part = 0; part < parts; part++) {
+        char partName[FILENAME_MAX];
+        donorSource source;
+        person donor;
+        databasePartName(argv[2], part, partName, sizeof(partName));
+        openDonorSource(&source, partName);
+        while (readSourceDonor(&source, &donor)) {
+            restoreUnitName(donor.name, 1); // Drop the padding and newline in front of the name
+            printf("%s\t%s", donor.name, donor.id);
+            for (int locus = 0; locus < NUM_LOCI; locus++) {
+                printf("\t%s", donor.genes[locus]);
+            }
+            printf("\n");
+        }
+        closeDonorSource(&source);
+    }
+    return 0;
+}
+
+
+
+
+/**
+ * @brief Runs the "lookup" command: prints the donors of a list of IDs.
+ * 
+ * Usage: lookup <database> <id>... Every ID found prints a line in the format of the "print"
+ * command; every other ID prints "<id>\tnot found".
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "lookup".
+ * 
+ * @return The process exit status: 0 if every ID was found, 2 if some were not, 1 on errors.
+ */
+int runLookupCommand(int argc, char* argv[]) {
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s lookup <database> <id>...\n", argv[0]);
+        return 1;
+    }
+    uint64_t size;
+    int64_t mtime;
+    if (!fileSignature(argv[2], &size, &mtime)) {
+        printf("Error: Could not open file %s\n", argv[2]);
+        return 1;
+    }
+
+    int count = argc - 3;
+    person* donors = malloc((size_t)count * sizeof(person));
+    int* found = malloc((size_t)count * sizeof(int));
+    if (!donors || !found) {
+        perror("Error allocating donors");
+        exit(1);
+    }
+    int foundCount = lookupDonors(argv[2], (const char* const*)(argv + 3), count, donors, found);
+    for (int i = 0; i < count; i++) {
+        if (!found[i]) {
+            printf("%s\tnot found\n", argv[3 + i]);
+            continue;
+        }
+        printf("%s\t%s", donors[i].name, donors[i].id);
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            printf("\t%s", donors[i].genes[locus]);
+        }
+        printf("\n");
+    }
+    free(found);
+    free(donors);
+    return foundCount == count ? 0 : 2;
+}
+
+
+
+
+/**
+ * @brief Runs the "update" command: adds the new donors of a collection to an existing database.
+ * 
+ * Usage: update <database> <units root name> <number of units>. The donors whose IDs are not in the
+ * database yet are written as a new delta (see the Database deltas section). Once the database has
+ * DELTA_COMPACT_LIMIT deltas it is compacted, in a background process where one can be started,
+ * unless a compaction of it is running already.
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "update".
+ * 
+ * @return The process exit status.
+ */
+int runUpdateCommand(int argc, char* argv[]) {
+    if (argc != 5 || atoi(argv[4]) < 1) {
+        fprintf(stderr, "Usage: %s update <database> <units root name> <number of units>\n", argv[0]);
+        return 1;
+    }
+    uint64_t size;
+    int64_t mtime;
+    if (!fileSignature(argv[2], &size, &mtime)) {
+        printf("Error: Could not open file %s\n", argv[2]);
+        return 1;
+    }
+    int numUnits = atoi(argv[4]);
+    FILE** unitFiles = malloc((size_t)numUnits * sizeof(FILE*));
+    if (!unitFiles) {
+        perror("Error allocating units");
+        exit(1);
+    }
+    if (!openUnitFiles(argv[3], numUnits, unitFiles)) {
+        free(unitFiles);
+        return 1;
+    }
+
+    updateDatabase(argv[2], unitFiles, numUnits);
+
+    for (int i = 0; i < numUnits; i++) {
+        fclose(unitFiles[i]);
+    }
+    free(unitFiles);
+
+    if (readDeltaCount(argv[2]) >= DELTA_COMPACT_LIMIT) {
+        int lock = lockDatabase(argv[2], COMPACT_LOCK_EXTENSION, 0);
+        if (lock < 0) {
+            return 0; // The running compaction keeps the new delta
+        }
+#ifndef _WIN32
+        fflush(stdout); // The child must not write the parent's buffered output again
+        pid_t child = fork();
+        if (child == 0) {
+            // The child inherits the compaction lock and holds it until it exits
+            mergeDatabaseDeltas(argv[2]);
+            _exit(0);
+        }
+        if (child > 0) {
+            unlockDatabase(lock);
+            return 0;
+        }
+#endif
+        mergeDatabaseDeltas(argv[2]);
+        unlockDatabase(lock);
+    }
+    return 0;
+}
+
+
+
+
+/**
+ * @brief Runs the "compact" command: merges the deltas of a database back into it.
+ * 
+ * Usage: compact <database>.
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "compact".
+ * 
+ * @return The process exit status.
+ */
+int runCompactCommand(int argc, char* argv[]) {
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s compact <database>\n", argv[0]);
+        return 1;
+    }
+    uint64_t size;
+    int64_t mtime;
+    if (!fileSignature(argv[2], &size, &mtime)) {
+        printf("Error: Could not open file %s\n", argv[2]);
+        return 1;
+    }
+    if (compactDatabase(argv[2]) < 0) {
+        printf("Error: %s is being compacted by another process\n", argv[2]);
+        return 1;
+    }
+    return 0;
+}
+
+
+
+/**
+ * @brief Runs the "gen" command: writes a synthetic collection of units.
+ * 
+ * Usage: gen <units root name> <number of units> <donors per unit> [--seed N] [--duplicates P]
+ * [--sharing P] [--unsorted]. By default 5% of the records repeat an earlier donor, 80% of the
+ * alleles come from the common pools and the units are sorted (see `generateUnits`).
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "gen".
+ * 
+ * @return The process exit status.
+ */
+int runGenCommand(int argc, char* argv[]) {
+    generatorSettings settings = { 1, 5, 80, 1 };
+    int valid = argc >= 5 && atoi(argv[3]) >= 1 && atol(argv[4]) >= 0;
+    for (int i = 5; valid && i < argc; i++) {
+        if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            settings.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--duplicates") == 0 && i + 1 < argc) {
+            settings.duplicateRate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--sharing") == 0 && i + 1 < argc) {
+            settings.sharingRate = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--unsorted") == 0) {
+            settings.sorted = 0;
+        } else {
+            valid = 0;
+        }
+    }
+    if (!valid) {
+        fprintf(stderr, "Usage: %s gen <units root name> <number of units> <donors per unit> "
+                        "[--seed N] [--duplicates P] [--sharing P] [--unsorted]\n", argv[0]);
+        return 1;
+    }
+    return generateUnits(argv[2], atoi(argv[3]), atol(argv[4]), &settings) ? 0 : 1;
+}
+
+
+
+
+/**
+ * @brief Runs the "bench" command: times the merge, the search and the ranking on a collection.
+ * 
+ * Usage: bench <units root name> <number of units> <database> [queries] [minimal match]. By default
+ * 100 searches with a minimal match of 3 are timed (see `benchmarkDatabase`). The search options
+ * (--threads, --mismatches, --sort-memory) apply as usual.
+ * 
+ * @param argc The number of command line arguments.
+ * @param argv The command line arguments; argv[1] is "bench".
+ * 
+ * @return The process exit status.
+ */
+int runBenchCommand(int argc, char* argv[]) {
+    if (argc < 5 || argc > 7 || atoi(argv[3]) < 1) {
+        fprintf(stderr, "Usage: %s bench <units root name> <number of units> <database> [queries] [minimal match]\n", argv[0]);
+        return 1;
+    }
+    int numUnits = atoi(argv[3]);
+    int numQueries = argc > 5 ? atoi(argv[5]) : 100;
+    int minMatch = argc > 6 ? atoi(argv[6]) : 3;
+    FILE** unitFiles = malloc((size_t)numUnits * sizeof(FILE*));
+    if (!unitFiles) {
+        perror("Error allocating units");
+        exit(1);
+    }
+    if (!openUnitFiles(argv[2], numUnits, unitFiles)) {
+        free(unitFiles);
+        return 1;
+    }
+    uint64_t inputBytes = 0, size;
+    int64_t mtime;
+    for (int i = 0; i < numUnits; i++) {
+        char fileName[FILENAME_MAX];
+        snprintf(fileName, sizeof(fileName), "%s%d.txt", argv[2], i + 1);
+        if (fileSignature(fileName, &size, &mtime)) {
+            inputBytes += size;
+        }
+    }
+
+    benchmarkDatabase(unitFiles, numUnits, inputBytes, argv[4], numQueries, minMatch);
+
+    for (int i = 0; i < numUnits; i++) {
+        fclose(unitFiles[i]);
+    }
+    free(unitFiles);
+    return 0;
+}
+
+
+
+// ------------------------------------------------------------------------------------
 
 
     
-int main() {
+int main(int argc, char* argv[]) {
     int choice;
     char rootName[50];              // For the root name of the units
     int numUnits;                   // Number of collection units
     char dbName[50];                // For the database name
-    person* potentialDonors = NULL; // Pointer to potential donors array
-    int potentialDonorSize = 0;     // Size of potential donors array
+    queryArena session;             // Memory of the potential donors of the last search
+    queryArena scratch;             // Memory of the ranking of the last printing
+    donorList potentialDonors;      // Potential donors of the last search
     int minMatch;                   // Minimum number of matching genes
 
-    do {
-        printf("\n******* Main Menu *******\n");
-        printf("1. Unify Database\n");
-        printf("2. Find Potential Donors\n");
-        printf("3. Print The List of Potential Donors\n");
-        printf("4. Exit\n");
-        printf("Enter Your Selection: ");
-        scanf("%d", &choice);
+    argc = parseSearchOptions(argc, argv);
+    if (!searchConfig.verbose) {
+        // Scripted output is written in large blocks rather than line by line
+        setvbuf(stdout, NULL, _IOFBF, RECORD_BLOCK_SIZE);
+    }
+    initQueryArena(&session);
+    initQueryArena(&scratch);
+    initArenaDonorList(&potentialDonors, &session);
+    if (searchConfig.stats) {
+        statsStartTime = currentSeconds();
+        atexit(reportStats);
+    }
+
+    // Command line mode
+    if (argc > 1 && strcmp(argv[1], "unify") == 0) {
+        return runUnifyCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "search") == 0) {
+        return runSearchCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "print") == 0) {
+        return runPrintCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "lookup") == 0) {
+        return runLookupCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "update") == 0) {
+        return runUpdateCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "compact") == 0) {
+        return runCompactCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "gen") == 0) {
+        return runGenCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "bench") == 0) {
+        return runBenchCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "serve") == 0) {
+        return runServeCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "shard") == 0) {
+        return runShardCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "coordinate") == 0) {
+        return runCoordinateCommand(argc, argv);
+    }
+    if (argc > 1 && strcmp(argv[1], "batch") == 0) {
+        return runBatchCommand(argc, argv);
+    }
+
+    do {
+        printf("\n******* Main Menu *******\n");
+        printf("1. Unify Database\n");
+        printf("2. Find Potential Donors\n");
+        printf("3. Print The List of Potential Donors\n");
+        printf("4. Exit\n");
+        printf("Enter Your Selection: ");
+        scanf("%d", &choice);
+
+        switch (choice) {
+            case 1: {
+                printf("Enter units root name: ");
+                scanf("%s", rootName);
+                printf("Enter the number of units: ");
+                scanf("%d", &numUnits);
+
+                FILE* unitFiles[numUnits];
+                if (!openUnitFiles(rootName, numUnits, unitFiles)) {
+                    return 1;
+                }
+
+                printf("Enter the new database name: ");
+                scanf("%s", dbName);
+
+                createDatabase(unitFiles, numUnits, dbName);
+
+                // Close all files after processing
+                for (int i = 0; i < numUnits; i++) {
+                    fclose(unitFiles[i]);
+                }
+                break;
+            }
+            case 2: {
+                person patient;
+                printf("Enter Genes DNA Sequences:\n");
+                for (int i = 0; i < NUM_LOCI; i++) {
+                    printf("Gene %d: ", i + 1);
+                    scanf("%s", patient.genes[i]);
+                }
+                printf("Enter Minimal Match: ");
+                scanf("%d", &minMatch);
+                printf("Enter The Database Filename: ");
+                scanf("%s", dbName);
+
+
+                // A new search replaces the donors of the previous one
+                resetQueryArena(&session);
+                initArenaDonorList(&potentialDonors, &session);
+                visitPotentialDonors(dbName, &patient, minMatch, collectPotentialDonor, &potentialDonors);
+                break;
+            }
+            case 3: {
+                if (potentialDonors.size > 0) {
+                    resetQueryArena(&scratch);
+                    printRankedDonors(potentialDonors.items, potentialDonors.size, 0, &scratch);
+                } else {
+                    printf("No potential donors found or the list is empty.\n");
+                }
+                break;
+            }
+            case 4: {
+                printf("Exiting program.\n");
+                break;
+            }
+            default: {
+                printf("Invalid selection. Try again.\n");
+                break;
+            }
+        }
+    } while (choice != 4);
+
+    // Free the memory of the potential donors and their ranking
+    freeQueryArena(&session);
+    freeQueryArena(&scratch);
+
+    return 0;
+}
+
+
+
+
+/**
+ * @brief Merges records from multiple input files into a single output file, eliminating duplicates.
+ * 
+ * This function reads records from multiple input files, merges them into a single output file, and ensures
+ * that no duplicate records are written. It performs the merging in lexicographical order based on the names,
+ * and skips any records that have already been processed (checked by unique ID).
+ * 
+ * The function handles the records by keeping track of processed IDs and adding a newline between records from
+ * different files. The smallest lexicographically ordered record is selected and written to the output file at
+ * each iteration. The current records of the units are kept in a min-heap, so each selection costs
+ * O(log k) comparisons for k units.
+ * 
+ * @param units Array of sources to read records from: units of a collection or existing databases.
+ * @param numberOfUnits The number of sources to process.
+ * @param filename The name of the output file to write the merged records to. The allele, segment
+ *                 and ID indexes of the database are written next to it (see `writeAlleleIndex`
+ *                 and `writeIdIndex`).
+ * @param format The format of the output file.
+ * @param processedIDs IDs that are not written. The IDs of the merged records are added to it.
+ * @param shard The shard to write, or NULL to write every merged record. A record of another shard
+ *              is merged but not written.
+ * 
+ * @return The number of records written.
+ * 
+ * @note This function assumes that each input file contains records in a specific format, with each record
+ * consisting of a name, ID, and multiple gene sequences.
+ */
+long writeDatabase(donorSource* units, int numberOfUnits, char* filename, databaseFormat format, idSet* processedIDs,
+                   databaseShard* shard) {
+    binaryDatabaseWriter binaryWriter;
+    textWriter textOut;
+    long written = 0;
+
+    // Open the output file for writing; exit if unable to open
+    FILE* outFile = fopen(filename, format != DB_FORMAT_TEXT ? "wb" : "w");
+    if (!outFile) {
+        perror("Error creating database file");
+        exit(1);
+    }
+    if (format != DB_FORMAT_TEXT) {
+        beginBinaryDatabase(&binaryWriter, outFile, format);
+    } else {
+        initTextWriter(&textOut, outFile, 16 * RECORD_BLOCK_SIZE);
+    }
+    alleleIndexBuilder index, segmentIndex;
+    initIndexBuilder(&index, format == DB_FORMAT_TEXT, 0);
+    initIndexBuilder(&segmentIndex, format == DB_FORMAT_TEXT, LOCUS_SEGMENTS);
+    idIndexBuilder idIndex = { 0 };
+
+    // Array to store the current records being read from each input file
+    person currentPersons[numberOfUnits];
+    nameKey currentKeys[numberOfUnits]; // Sort key of the name of every current record
+    int unitHeap[numberOfUnits]; // Min-heap of the units that still have a current record
+    int activeFiles = 0;
+
+    // Initialize the array with the first record from each input file
+    for (int i = 0; i < numberOfUnits; i++) {
+        // Read the name (first and last name), id, and genes
+        if (readSourceDonor(&units[i], &currentPersons[i])) {
+
+            cleanName(currentPersons[i].name);
+            
+            if (currentPersons[i].name[0] != '\0') {
+                makeNameKey(&currentPersons[i], &currentKeys[i]);
+                unitHeap[activeFiles++] = i;
+            }
+        }
+
+    }
+    for (int i = activeFiles / 2 - 1; i >= 0; i--) {
+        siftDownUnit(unitHeap, activeFiles, i, currentKeys);
+    }
+
+    // Process records until all active files are exhausted
+    // Process records until all active files are exhausted
+
+    int lastFileIndex = -1; // Keep track of the last file processed
+    uint64_t recordStart = 0; // Where a sequential scan starts reading the next record
+    uint64_t selections = 0;
+    double mergeStart = statsStart();
+    
+    while (activeFiles > 0) {
+    // The top of the heap holds the lexicographically smallest current record
+    int smallestIndex = unitHeap[0];
+    selections++;
+
+    int newLine = -1;
+    // Check if switching to a new file
+        if (smallestIndex != lastFileIndex) {
+            if (lastFileIndex != -1 && written > 0 && format == DB_FORMAT_TEXT) {
+                newLine = 1; // Add a new line before starting a new file
+            }
+            lastFileIndex = smallestIndex; // Update the last file index
+        }
+    
+    // Write the smallest record to the output file
+    if (!idSetContains(processedIDs, currentPersons[smallestIndex].id) &&
+        (!shard || donorInShard(shard, &currentPersons[smallestIndex]))) {
+        person* current = &currentPersons[smallestIndex];
+        addIndexRecord(&index, current, recordStart);
+        addIndexRecord(&segmentIndex, current, recordStart);
+        addIdIndexRecord(&idIndex, current, recordStart);
+        if (format != DB_FORMAT_TEXT)
+        {
+                writeBinaryRecord(&binaryWriter, current);
+        }
+        else if (searchConfig.sortMemory > 0)
+        {
+                // Sorted runs switch at almost every record, so each record is separated by exactly one newline
+                person record = *current;
+                removeLeadingNewline(record.name);
+                writeTextRecord(&textOut, written > 0 ? "\n" : "", &record, 1);
+        }
+        else
+        {
+                // After the new line of a new file the ID follows the padded name without a space
+                writeTextRecord(&textOut, newLine == 1 ? "\n" : "", current, newLine != 1);
+        }
+        if (format == DB_FORMAT_TEXT) {
+            // A sequential scan reads the padding of the last gene and the separating newline as part
+            // of the next name, so the next record starts right after the last base
+            size_t length = strlen(current->genes[NUM_LOCI - 1]);
+            size_t padded = (size_t)locusLengths[NUM_LOCI - 1];
+            recordStart = textOut.offset - (length < padded ? padded - length : 0);
+        }
+        written++;
+    }
+    // Add the current ID to the list of processed IDs
+    idSetInsert(processedIDs, currentPersons[smallestIndex].id);
+    
+
+    
+
+    // Read the next record from the file that contained the smallest record
+    if (!readSourceDonor(&units[smallestIndex], &currentPersons[smallestIndex])) {
+
+                cleanName(currentPersons[smallestIndex].name);
+
+        // Mark as invalid if the file has no more records
+        memset(&currentPersons[smallestIndex], 0, sizeof(person));
+        currentPersons[smallestIndex].name[0] = '\0';
+        activeFiles--;  // Decrement the count of active files
+        unitHeap[0] = unitHeap[activeFiles]; // Remove the unit from the heap
+        
+    } else {
+        makeNameKey(&currentPersons[smallestIndex], &currentKeys[smallestIndex]);
+    }
+    siftDownUnit(unitHeap, activeFiles, 0, currentKeys); // Restore the heap after the top changed
+}
+    statsRecord(STATS_MERGE, selections, (uint64_t)written, mergeStart);
+
+
+    if (format != DB_FORMAT_TEXT) {
+        finishBinaryDatabase(&binaryWriter);
+    } else {
+        finishTextWriter(&textOut);
+    }
+
+    // Close the output file to free resources
+    fclose(outFile);
+
+    // The indexes record the final size of the database, so they are written last
+    writeAlleleIndex(&index, filename);
+    writeAlleleIndex(&segmentIndex, filename);
+    writeIdIndex(&idIndex, filename);
+    freeIndexBuilder(&index);
+    freeIndexBuilder(&segmentIndex);
+    return written;
+}
+
+
+
+
+/**
+ * @brief Merges the units of a collection into a new database, eliminating duplicates (see `writeDatabase`).
+ * 
+ * @param units Array of file pointers to the input files to read records from; they are left open.
+ * @param numberOfUnits The number of input files to process.
+ * @param filename The name of the output file to write the merged records to. If the name ends with
+ *                 BINARY_DB_EXTENSION the database is written in the binary format, with
+ *                 DICTIONARY_DB_EXTENSION in its dictionary encoding, otherwise as text.
+ * 
+ * @note With `searchConfig.sortMemory` set, the units need not be sorted (see `sortUnitRuns`).
+ */
+void createDatabase(FILE** units, int numberOfUnits, char* filename) {
+    FILE** runs = NULL;
+    if (searchConfig.sortMemory > 0) {
+        runs = sortUnitRuns(units, numberOfUnits, &numberOfUnits);
+        units = runs;
+    }
+    donorSource sources[numberOfUnits > 0 ? numberOfUnits : 1];
+    idSet processedIDs; // To store processed IDs
+    initIdSet(&processedIDs);
+
+    for (int i = 0; i < numberOfUnits; i++) {
+        openDonorStream(&sources[i], units[i]);
+    }
+    writeDatabase(sources, numberOfUnits, filename, databaseFormatForName(filename), &processedIDs, NULL);
+    for (int i = 0; i < numberOfUnits; i++) {
+        closeDonorSource(&sources[i]);
+    }
+    freeIdSet(&processedIDs);
+    if (runs) {
+        closeUnitRuns(runs, numberOfUnits);
+    }
+}
+
+
+
+
+/**
+ * @brief Adds the donors of a collection that are not in a database yet as a new delta of it.
+ * 
+ * The delta is written in the format of the database, with its own indexes, and the manifest of
+ * the database is updated once it is complete (see the Database deltas section).
+ * 
+ * @param database The database file name.
+ * @param units Array of file pointers to the units of the collection; they are left open.
+ * @param numberOfUnits The number of units.
+ * 
+ * @return The number of donors added. No delta is written when it is 0.
+ * 
+ * @note The database lock is held throughout, so updates of a database run one after the other and
+ *       the end of a compaction waits for them.
+ * @note If the database or one of its deltas cannot be opened, the function prints an error message
+ *       and exits the program.
+ */
+long updateDatabase(char* database, FILE** units, int numberOfUnits) {
+    int lock = lockDatabase(database, DATABASE_LOCK_EXTENSION, 1);
+    databaseFormat format = databaseFormatOf(database);
+    int parts = 1 + readDeltaCount(database);
+    char partName[FILENAME_MAX];
+    idSet processedIDs; // IDs already in the database or in one of its deltas
+    initIdSet(&processedIDs);
+
+    for (int part = 0; part < parts; part++) {
+        donorSource source;
+        person donor;
+        mappedFile indexFile;
+        databasePartName(database, part, partName, sizeof(partName));
+        const idIndexHeader* index = openIdIndex(partName, &indexFile);
+        if (index && index->otherCount == 0) {
+            // Every ID of the part is in its index, so the part itself is not read
+            const idIndexEntry* entries = (const idIndexEntry*)(index + 1);
+            for (uint64_t e = 0; e < index->entryCount; e++) {
+                idSetInsertKey(&processedIDs, entries[e].id);
+            }
+            unmapFile(&indexFile);
+            continue;
+        }
+        if (index) {
+            unmapFile(&indexFile);
+        }
+        openDonorSource(&source, partName);
+        while (readSourceDonor(&source, &donor)) {
+            idSetInsert(&processedIDs, donor.id);
+        }
+        closeDonorSource(&source);
+    }
+
+    FILE** runs = NULL;
+    if (searchConfig.sortMemory > 0) {
+        runs = sortUnitRuns(units, numberOfUnits, &numberOfUnits);
+        units = runs;
+    }
+    donorSource sources[numberOfUnits > 0 ? numberOfUnits : 1];
+    for (int i = 0; i < numberOfUnits; i++) {
+        openDonorStream(&sources[i], units[i]);
+    }
+    databasePartName(database, parts, partName, sizeof(partName));
+    long written = writeDatabase(sources, numberOfUnits, partName, format, &processedIDs, NULL);
+    for (int i = 0; i < numberOfUnits; i++) {
+        closeDonorSource(&sources[i]);
+    }
+    freeIdSet(&processedIDs);
+    if (runs) {
+        closeUnitRuns(runs, numberOfUnits);
+    }
+
+    if (written == 0) {
+        removeDatabaseFiles(partName);
+    } else {
+        writeDeltaCount(database, parts);
+    }
+    unlockDatabase(lock);
+    return written;
+}
+
+
+
+
+/**
+ * @brief Merges the deltas of a database back into it, with the compaction lock already held.
+ * 
+ * The base and its deltas are merged into a temporary database that is then renamed over the base,
+ * together with its indexes. Deltas added while the merge ran are kept and renumbered from 1. The
+ * renaming holds the database lock, so it never meets an update halfway.
+ * 
+ * @param database The database file name.
+ * 
+ * @return The number of deltas merged.
+ * 
+ * @note If a part of the database cannot be opened, the function prints an error message and exits the program.
+ */
+int mergeDatabaseDeltas(char* database) {
+    int deltas = readDeltaCount(database);
+    if (deltas == 0) {
+        return 0;
+    }
+    databaseFormat format = databaseFormatOf(database);
+    char partName[FILENAME_MAX], compactName[FILENAME_MAX];
+    snprintf(compactName, sizeof(compactName), "%s.compact", database);
+    removeDatabaseFiles(compactName); // Left by a compaction that did not finish
+    donorSource* sources = malloc((size_t)(deltas + 1) * sizeof(donorSource));
+    if (!sources) {
+        perror("Error allocating database parts");
+        exit(1);
+    }
+    for (int part = 0; part <= deltas; part++) {
+        databasePartName(database, part, partName, sizeof(partName));
+        openDonorSource(&sources[part], partName);
+        sources[part].unitNames = 1;
+    }
+
+    idSet processedIDs;
+    initIdSet(&processedIDs);
+    writeDatabase(sources, deltas + 1, compactName, format, &processedIDs, NULL);
+    freeIdSet(&processedIDs);
+    for (int part = 0; part <= deltas; part++) {
+        closeDonorSource(&sources[part]);
+    }
+    free(sources);
+
+    // Until the manifest is rewritten, searches may see the merged donors twice but never miss a file
+    int lock = lockDatabase(database, DATABASE_LOCK_EXTENSION, 1);
+    int total = readDeltaCount(database);
+    renameDatabaseFiles(compactName, database);
+    for (int part = deltas + 1; part <= total; part++) {
+        char newName[FILENAME_MAX];
+        databasePartName(database, part, partName, sizeof(partName));
+        databasePartName(database, part - deltas, newName, sizeof(newName));
+        renameDatabaseFiles(partName, newName);
+    }
+    writeDeltaCount(database, total - deltas);
+    for (int part = total - deltas + 1; part <= total; part++) {
+        databasePartName(database, part, partName, sizeof(partName));
+        removeDatabaseFiles(partName);
+    }
+    unlockDatabase(lock);
+    return deltas;
+}
+
+
+
+
+/**
+ * @brief Merges the deltas of a database back into it (see `mergeDatabaseDeltas`), unless another
+ *        process is compacting it already.
+ * 
+ * @param database The database file name.
+ * 
+ * @return The number of deltas merged, or -1 if another compaction holds the compaction lock.
+ * 
+ * @note If a part of the database cannot be opened, the function prints an error message and exits the program.
+ */
+int compactDatabase(char* database) {
+    int lock = lockDatabase(database, COMPACT_LOCK_EXTENSION, 0);
+    if (lock < 0) {
+        return -1;
+    }
+    int deltas = mergeDatabaseDeltas(database);
+    unlockDatabase(lock);
+    return deltas;
+}
+
+
+
+
+/**
+ * @brief Splits a database and its deltas into shards (see the Database shards section).
+ * 
+ * Any deltas left from an earlier shard of the same name are removed.
+ * 
+ * @param database The database file name.
+ * @param shards The number of shards.
+ * @param byName 1 to give every shard a range of the name order, 0 to choose shards by a hash of the ID.
+ * 
+ * @return The number of donors written to all the shards.
+ * 
+ * @note If a part of the database cannot be opened, the function prints an error message and exits the program.
+ */
+long shardDatabase(char* database, int shards, int byName) {
+    int parts = 1 + readDeltaCount(database);
+    databaseFormat format = databaseFormatOf(database);
+    databaseShard shard = { shards, 0, byName, byName ? countDatabaseDonors(database) : 0, 0 };
+    char partName[FILENAME_MAX], shardName[FILENAME_MAX - 16]; // Leaves room for the names of its deltas
+    long written = 0;
+    donorSource* sources = malloc((size_t)parts * sizeof(donorSource));
+    if (!sources) {
+        perror("Error allocating database parts");
+        exit(1);
+    }
+
+    // Every shard merges all the parts again, so each one is written by a single writer
+    for (shard.index = 0; shard.index < shards; shard.index++) {
+        for (int part = 0; part < parts; part++) {
+            databasePartName(database, part, partName, sizeof(partName));
+            openDonorSource(&sources[part], partName);
+            sources[part].unitNames = 1;
+        }
+        idSet processedIDs;
+        initIdSet(&processedIDs);
+        shard.seen = 0;
+        shardFileName(database, shard.index, shardName, sizeof(shardName));
+        written += writeDatabase(sources, parts, shardName, format, &processedIDs, &shard);
+        freeIdSet(&processedIDs);
+        for (int part = 0; part < parts; part++) {
+            closeDonorSource(&sources[part]);
+        }
 
-        switch (choice) {
-            case 1: {
-                printf("Enter units root name: ");
-                scanf("%s", rootName);
-                printf("Enter the number of units: ");
-                scanf("%d", &numUnits);
+        int staleDeltas = readDeltaCount(shardName);
+        writeDeltaCount(shardName, 0);
+        for (int part = 1; part <= staleDeltas; part++) {
+            databasePartName(shardName, part, partName, sizeof(partName));
+            removeDatabaseFiles(partName);
+        }
+    }
+    free(sources);
+    return written;
+}
 
-                FILE* unitFiles[numUnits];
-                for (int i = 0; i < numUnits; i++) {
-                    char fileName[50];
-                    sprintf(fileName, "%s%d.txt", rootName, i + 1);
-                    unitFiles[i] = fopen(fileName, "r");
-                    if (unitFiles[i] == NULL) {
-                        printf("Error: Could not open file %s\n", fileName);
-                        return 1;
-                    }
-                }
 
-                printf("Enter the new database name: ");
-                scanf("%s", dbName);
 
-                createDatabase(unitFiles, numUnits, dbName);
 
-                // Close all files after processing
-                for (int i = 0; i < numUnits; i++) {
-                    fclose(unitFiles[i]);
-                }
-                break;
-            }
-            case 2: {
-                person patient;
-                printf("Enter Genes DNA Sequences:\n");
-                for (int i = 0; i < 5; i++) {
-                    printf("Gene %d: ", i + 1);
-                    scanf("%s", patient.genes[i]);
-                }
-                printf("Enter Minimal Match: ");
-                scanf("%d", &minMatch);
-                printf("Enter The Database Filename: ");
-                scanf("%s", dbName);
+/**
+ * @brief Finds the donors of a list of IDs in a database and its deltas.
+ * 
+ * Every part of the database is searched with its ID index: a binary search per ID, then one read
+ * of the record. A part without a usable index, or with donors whose IDs are not 9 digits while
+ * such an ID is still wanted, is scanned instead.
+ * 
+ * @param database The database file name (text or binary).
+ * @param ids The IDs to look up.
+ * @param count The number of IDs.
+ * @param donors Array of `count` persons; `donors[i]` receives the donor of `ids[i]` if it is found,
+ *               with its name cleaned.
+ * @param found Array of `count` flags; `found[i]` is set to 1 if `ids[i]` was found, 0 otherwise.
+ * 
+ * @return The number of IDs found.
+ * 
+ * @note If a part of the database cannot be opened, the function prints an error message and exits the program.
+ */
+int lookupDonors(char* database, const char* const* ids, int count, person* donors, int* found) {
+    int parts = 1 + readDeltaCount(database);
+    int remaining = count;
+    memset(found, 0, (size_t)count * sizeof(int));
 
+    for (int part = 0; part < parts && remaining > 0; part++) {
+        char partName[FILENAME_MAX];
+        mappedFile indexFile;
+        databasePartName(database, part, partName, sizeof(partName));
+        const idIndexHeader* index = openIdIndex(partName, &indexFile);
+        int scan = index == NULL;
 
-                potentialDonors = getPotentialDonors(dbName, patient, minMatch, &potentialDonorSize);
-                break;
-            }
-            case 3: {
-                if (potentialDonors != NULL && potentialDonorSize > 0) {
-                    printPotentialDonorsList(potentialDonors, potentialDonorSize);
-                } else {
-                    printf("No potential donors found or the list is empty.\n");
+        if (index) {
+            mappedFile dbMapping;
+            const binaryDatabaseHeader* binaryHeader = NULL;
+            FILE* dbFile = NULL;
+            recordReader reader;
+            if (isBinaryDatabase(partName)) {
+                if (!mapFile(partName, &dbMapping) || !(binaryHeader = binaryDatabaseHeaderOf(&dbMapping))) {
+                    printf("Error: Could not open file %s\n", partName);
+                    exit(1);
                 }
-                break;
+            } else if (!(dbFile = fopen(partName, "r"))) {
+                perror("Error opening database file");
+                exit(1);
+            } else {
+                initRecordReader(&reader, dbFile, BUFSIZ);
             }
-            case 4: {
-                printf("Exiting program.\n");
-                break;
+
+            for (int i = 0; i < count; i++) {
+                uint32_t id;
+                if (found[i]) {
+                    continue;
+                }
+                if (!parseDonorId(ids[i], &id)) {
+                    scan |= index->otherCount > 0; // Only a scan can find it
+                    continue;
+                }
+                const idIndexEntry* entry = findIdIndexEntry(index, id);
+                if (!entry) {
+                    continue;
+                }
+                if (binaryHeader) {
+                    binaryRecordToPerson(binaryHeader, entry->ordinal, &donors[i]);
+                } else if (!readTextRecordAt(&reader, entry->offset, &donors[i])) {
+                    continue;
+                }
+                if (strcmp(donors[i].id, ids[i]) == 0) {
+                    restoreUnitName(donors[i].name, 1); // Drop the padding and newline in front of the name
+                    found[i] = 1;
+                    remaining--;
+                }
             }
-            default: {
-                printf("Invalid selection. Try again.\n");
-                break;
+
+            if (binaryHeader) {
+                unmapFile(&dbMapping);
+            } else {
+                freeRecordReader(&reader);
+                fclose(dbFile);
             }
+            unmapFile(&indexFile);
         }
-    } while (choice != 4);
 
-    // Free dynamically allocated memory for potential donors
-    if (potentialDonors != NULL) {
-        free(potentialDonors);
+        if (scan && remaining > 0) {
+            donorSource source;
+            person donor;
+            openDonorSource(&source, partName);
+            while (remaining > 0 && readSourceDonor(&source, &donor)) {
+                for (int i = 0; i < count; i++) {
+                    if (!found[i] && strcmp(donor.id, ids[i]) == 0) {
+                        donors[i] = donor;
+                        restoreUnitName(donors[i].name, 1);
+                        found[i] = 1;
+                        remaining--;
+                    }
+                }
+            }
+            closeDonorSource(&source);
+        }
     }
+    return count - remaining;
+}
 
-    return 0;
+
+
+
+/**
+ * @brief Finds the donor of one ID in a database and its deltas (see `lookupDonors`).
+ * 
+ * @param database The database file name (text or binary).
+ * @param id The ID to look up.
+ * @param donor Pointer to the person that receives the donor, with its name cleaned.
+ * 
+ * @return 1 if the ID was found, 0 otherwise.
+ */
+int lookupDonor(char* database, const char* id, person* donor) {
+    int found;
+    lookupDonors(database, &id, 1, donor, &found);
+    return found;
 }
 
 
 
 
 /**
- * @brief Merges records from multiple input files into a single output file, eliminating duplicates.
+ * @brief Streams the potential bone marrow donors of one database file to a visitor.
  * 
- * This function reads records from multiple input files, merges them into a single output file, and ensures
- * that no duplicate records are written. It performs the merging in lexicographical order based on the names,
- * and skips any records that have already been processed (checked by unique ID).
+ * This function reads a donor database file, compares each donor's genetic data with
+ * the patient's, and passes every donor meeting the minimum gene match criteria to `visitor`
+ * as soon as it is found, without storing it.
  * 
- * The function handles the records by keeping track of processed IDs and adding a newline between records from
- * different files. The smallest lexicographically ordered record is selected and written to the output file at
- * each iteration.
+ * @param database A string containing the file name of the donor database.
+ * @param patient Pointer to a person structure containing the patient's genetic data.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param visitor Function called for every qualifying donor, in database order. The donor it
+ *                receives is only valid during the call. Returning non-zero stops the search.
+ * @param context Passed unchanged to `visitor`.
  * 
- * @param units Array of file pointers to the input files to read records from.
- * @param numberOfUnits The number of input files to process.
- * @param filename The name of the output file to write the merged records to.
+ * @return The number of donors passed to `visitor`.
  * 
- * @note This function assumes that each input file contains records in a specific format, with each record
- * consisting of a name, ID, and multiple gene sequences.
+ * @note If the database file cannot be opened, the function prints an error message and exits the program.
+ * @note Databases written in the binary format are detected by their magic and mapped instead of parsed.
+ * @note When the database has an up-to-date allele index and `min_match` is at least 1, only the
+ *       donors that share enough alleles with the patient are read (see `visitIndexedDonors`).
+ *       Otherwise the database is scanned by `searchConfig.threads` threads (see `visitShardedScan`).
+ *       A near-match search uses the segment index the same way, or else reads the whole database
+ *       (see `visitNearMatchDonors`).
  */
-void createDatabase(FILE** units, int numberOfUnits, char* filename) {
-    // Open the output file for writing; exit if unable to open
-    FILE* outFile = fopen(filename, "w");
-    if (!outFile) {
-        perror("Error creating database file");
-        exit(1);
+int visitDatabaseFile(char* database, const person* patient, int min_match, donorVisitor visitor, void* context) {
+    // Only touch the donors that share alleles with the patient when an up-to-date index exists
+    int visited = visitIndexedDonors(database, patient, min_match, visitor, context);
+    if (visited >= 0) {
+        return visited;
     }
 
-    // Array to store the current records being read from each input file
-    person currentPersons[numberOfUnits];
-    int activeFiles = 0;
-
-    char processedIDs[MAX_UNITS][10]; // To store processed IDs
-    int numProcessed = 0; // Counter for processed IDs
+    if (searchConfig.maxMismatches >= 0) {
+        return visitNearMatchDonors(database, patient, min_match, visitor, context);
+    }
 
-    // Initialize the array with the first record from each input file
-    for (int i = 0; i < numberOfUnits; i++) {
-        // Read the name (first and last name), id, and genes
-        if (fscanf(units[i], "%30[^0-9]%9s %21s %21s %21s %21s %21s", 
-           currentPersons[i].name, currentPersons[i].id,
-           currentPersons[i].genes[0], currentPersons[i].genes[1],
-           currentPersons[i].genes[2], currentPersons[i].genes[3],
-           currentPersons[i].genes[4]) == 7) {
+    if (searchConfig.threads > 1) {
+        return visitShardedScan(database, patient, min_match, searchConfig.threads, visitor, context);
+    }
 
-            cleanName(currentPersons[i].name);
-            
-            activeFiles++;
-        }
+    if (isBinaryDatabase(database)) {
+        // Binary databases are scanned in place without parsing
+        return visitBinaryDatabase(database, patient, min_match, visitor, context);
+    }
 
+    FILE* dbFile = fopen(database, "r");
+    if (!dbFile) {
+        perror("Error opening database file");
+        exit(1); // Handle file opening failure
     }
 
-    // Process records until all active files are exhausted
-    // Process records until all active files are exhausted
+    visited = scanTextRecords(dbFile, UINT64_MAX, patient, min_match, visitor, context);
 
-    int lastFileIndex = -1; // Keep track of the last file processed
-    
-    while (activeFiles > 0) {
-    int smallestIndex = -1;  // Index of the lexicographically smallest record
+    fclose(dbFile); // Close the database file to free resources and avoid resource leaks.
+    return visited;
+}
 
-    // Find the smallest record among current records
-    for (int i = 0; i < numberOfUnits; i++) {
-        if (currentPersons[i].name[0] != '\0' && 
-            (smallestIndex == -1 || comparePersons(&currentPersons[i], &currentPersons[smallestIndex]) < 0)) {
-            smallestIndex = i;
-        }
-    }
 
-    if (smallestIndex == -1) break; // No valid records left
 
-    int newLine = -1;
-    // Check if switching to a new file
-        if (smallestIndex != lastFileIndex) {
-            if (lastFileIndex != -1) {
-                if (!isDuplicate(currentPersons[smallestIndex].id, processedIDs, numProcessed))
-                {
-                    fprintf(outFile, "\n"); // Add a new line before starting a new file
-                }
-                
-                newLine = 1;
-            }
-            lastFileIndex = smallestIndex; // Update the last file index
-        }
-    
-    // Write the smallest record to the output file
-    if (!isDuplicate(currentPersons[smallestIndex].id, processedIDs, numProcessed)) {
-        if(newLine == 1)
-        {
-                fprintf(outFile, "%-30s%-9s %-21s %-21s %-21s %-21s %-21s",
-                currentPersons[smallestIndex].name, currentPersons[smallestIndex].id,
-                currentPersons[smallestIndex].genes[0], currentPersons[smallestIndex].genes[1],
-                currentPersons[smallestIndex].genes[2], currentPersons[smallestIndex].genes[3],
-                currentPersons[smallestIndex].genes[4]);
-                newLine = -1;
-        }
-        else 
-        {
-            
-                fprintf(outFile, "%-30s %-9s %-21s %-21s %-21s %-21s %-21s",
-                currentPersons[smallestIndex].name, currentPersons[smallestIndex].id,
-                currentPersons[smallestIndex].genes[0], currentPersons[smallestIndex].genes[1],
-                currentPersons[smallestIndex].genes[2], currentPersons[smallestIndex].genes[3],
-                currentPersons[smallestIndex].genes[4]);
-                newLine = -1;
-        }
-        // Add the current ID to the list of processed IDs
-        strcpy(processedIDs[numProcessed], currentPersons[smallestIndex].id);
-        numProcessed++;
+
+/**
+ * @brief Visitor used by `visitPotentialDonors`: forwards a donor through a `chainedVisitor`.
+ * 
+ * @param donor Pointer to the qualifying donor.
+ * @param matches The donor's number of matching genes.
+ * @param context Pointer to the `chainedVisitor`.
+ * 
+ * @return The result of the forwarded visitor.
+ */
+int forwardDonor(const person* donor, int matches, void* context) {
+    chainedVisitor* chain = context;
+    chain->stopped = chain->visitor(donor, matches, chain->context);
+    return chain->stopped;
+}
+
+
+
+
+/**
+ * @brief Streams the potential bone marrow donors of a database and of its deltas to a visitor.
+ * 
+ * The base database is searched first, then every delta in order (see `visitDatabaseFile`).
+ * 
+ * @param database A string containing the file name of the donor database.
+ * @param patient Pointer to a person structure containing the patient's genetic data.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param visitor Function called for every qualifying donor. The donor it receives is only valid
+ *                during the call. Returning non-zero stops the search.
+ * @param context Passed unchanged to `visitor`.
+ * 
+ * @return The number of donors passed to `visitor`.
+ * 
+ * @note If a part of the database cannot be opened, the function prints an error message and exits the program.
+ */
+int visitPotentialDonors(char* database, const person* patient, int min_match, donorVisitor visitor, void* context) {
+    chainedVisitor chain = { visitor, context, 0 };
+    char partName[FILENAME_MAX];
+    int parts = 1 + readDeltaCount(database);
+    int visited = 0;
+
+    for (int part = 0; part < parts && !chain.stopped; part++) {
+        databasePartName(database, part, partName, sizeof(partName));
+        visited += visitDatabaseFile(partName, patient, min_match, forwardDonor, &chain);
     }
-    
+    return visited;
+}
 
-    
 
-    // Read the next record from the file that contained the smallest record
-    if (fscanf(units[smallestIndex], "%30[^0-9] %9s %21s %21s %21s %21s %21s",
-               currentPersons[smallestIndex].name, currentPersons[smallestIndex].id,
-               currentPersons[smallestIndex].genes[0], currentPersons[smallestIndex].genes[1],
-               currentPersons[smallestIndex].genes[2], currentPersons[smallestIndex].genes[3],
-               currentPersons[smallestIndex].genes[4]) != 7) {
 
-                cleanName(currentPersons[smallestIndex].name);
 
-        // Mark as invalid if the file has no more records
-        memset(&currentPersons[smallestIndex], 0, sizeof(person));
-        currentPersons[smallestIndex].name[0] = '\0';
-        activeFiles--;  // Decrement the count of active files
-        
+/**
+ * @brief Streams the potential donors of a near-match search to a visitor.
+ * 
+ * The search runs as a batch of one patient, so the donors are scored in blocks by
+ * `countBlockMismatches`. A locus matches when the genes differ in at most
+ * `searchConfig.maxMismatches` bases.
+ * 
+ * @param database The database file name (text or binary).
+ * @param patient Pointer to the patient.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param visitor Function called for every qualifying donor, in database order.
+ * @param context Passed unchanged to `visitor`.
+ * 
+ * @return The number of donors passed to `visitor`.
+ */
+int visitNearMatchDonors(char* database, const person* patient, int min_match, donorVisitor visitor, void* context) {
+    donorList results;
+    uint64_t patientLoci[NUM_LOCI];
+    for (int locus = 0; locus < NUM_LOCI; locus++) {
+        patientLoci[locus] = alleleKey(patient->genes[locus]);
+    }
+    initDonorList(&results);
+    scoreDatabaseFile(database, patient, patientLoci, 1, min_match, &results);
+
+    int visited = 0;
+    for (int d = 0; d < results.size; d++) {
+        visited++;
+        if (visitor(&results.items[d].donor, results.items[d].matches, context)) {
+            break;
+        }
     }
+    free(results.items);
+    return visited;
 }
 
 
-    // Close the output file to free resources
-    fclose(outFile);
+
+
+
+
+
+
+/**
+ * @brief Visitor used by `getPotentialDonors`: reports a donor (unless `searchConfig.verbose` is 0)
+ *        and appends it to a `donorList`.
+ * 
+ * @param donor Pointer to the qualifying donor.
+ * @param matches The donor's number of matching genes.
+ * @param context Pointer to the `donorList` being filled.
+ * 
+ * @return Always 0, to continue the search.
+ */
+int collectPotentialDonor(const person* donor, int matches, void* context) {
+    if (searchConfig.verbose) {
+        printf("Current Donor's Name: %s, Matches: %d\n", donor->name, matches);
+    }
+    appendDonor((donorList*)context, donor, matches);
+    return 0;
 }
 
 
@@ -468,99 +7862,158 @@ void createDatabase(FILE** units, int numberOfUnits, char* filename) {
  * @brief Identifies potential bone marrow donors based on genetic compatibility.
  * 
  * This function reads a donor database file, compares each donor's genetic data with
- * the patient's, and returns an array of donors meeting the minimum gene match criteria.
+ * the patient's, and returns an array of donors meeting the minimum gene match criteria,
+ * each stored next to its match count. The array grows with the number of donors found.
  * 
  * @param database A string containing the file name of the donor database.
  * @param patient A person structure containing the patient's genetic data.
  * @param min_match The minimum number of matching genes required for a donor to be considered.
  * @param size A pointer to an integer where the function will store the number of potential donors found.
  * 
- * @return A dynamically allocated array of person structures containing the potential donors.
- *         The caller is responsible for freeing the allocated memory.
+ * @return A dynamically allocated array of the potential donors and their match counts (NULL if
+ *         none were found). The caller is responsible for freeing the allocated memory.
  * 
  * @note If the database file cannot be opened, the function prints an error message and exits the program.
  * 
  * Example Usage:
- * person* donors = getPotentialDonors("database.txt", patient, 3, &size);
+ * donorMatch* donors = getPotentialDonors("database.txt", patient, 3, &size);
  * for (int i = 0; i < size; i++) {
- *     printf("Donor Name: %s, ID: %s\n", donors[i].name, donors[i].id);
+ *     printf("Donor Name: %s, ID: %s, Matches: %d\n", donors[i].donor.name, donors[i].donor.id, donors[i].matches);
  * }
  * free(donors); // Free the memory allocated for the donors array.
  */
 
-person* getPotentialDonors(char* database, person patient, int min_match, int* size) {
-    FILE* dbFile = fopen(database, "r");
-    if (!dbFile) {
-        perror("Error opening database file");
-        exit(1); // Handle file opening failure
-    }
+donorMatch* getPotentialDonors(char* database, person patient, int min_match, int* size) {
+    donorList donors;
+    initDonorList(&donors);
 
-    // Initialize an array to store potential donors
-    person* donors = malloc(MAX_PERSONS * sizeof(person));
-    
-    int donorCount = 0;
+    visitPotentialDonors(database, &patient, min_match, collectPotentialDonor, &donors);
 
-    person current;
+    *size = donors.size; // Update the size variable with the total number of potential donors found.
+    return donors.items; // Return the dynamically allocated array of potential donors to the caller.
+}
 
-    // Read each donor from the database
-    while (fscanf(dbFile, "%30[^0-9] %9s %21s %21s %21s %21s %21s",
-                  current.name, current.id,
-                  current.genes[0], current.genes[1],
-                  current.genes[2], current.genes[3],
-                  current.genes[4]) == 7) {
 
-        // Count the number of gene matches between donor and patient
-        int matches = countGeneMatches(&current, &patient);
 
-         // Include the donor only if the match count is above the threshold
-        if (matches >= min_match) {
-            printf("Current Donor's Name: %s, Matches: %d\n", current.name, matches);
-            matchesArray[donorCount] = matches;
-            donors[donorCount++] = current;
-        }
+
+
+/**
+ * @brief Prints the best potential bone marrow donors, ranked in the memory of a query arena.
+ * 
+ * This function ranks the donors by match count and cleaned name (see `rankCleanedDonors`) and
+ * displays the first `topK` of them. If no donors are found (size is 0), it notifies the user.
+ * The donors themselves are not changed.
+ * 
+ * @param potentialDonors Pointer to an array of potential donors with their match counts.
+ * @param size The number of potential donors in the array.
+ * @param topK The number of donors to print; 0 prints all of them.
+ * @param scratch The arena that receives the ranking.
+ * 
+ * Example Output:
+ * Potential Donors Details
+ * ------------------------
+ * 1. John Doe                     123456789 5
+ * 2. Jane Smith                   987654321 4
+ */
+void printRankedDonors(const donorMatch* potentialDonors, int size, int topK, queryArena* scratch) {
+    if (size == 0) {
+        printf("No potential donors found.\n");
+        return; // Exit if no donors are available
     }
-    
 
-    fclose(dbFile); // Close the database file to free resources and avoid resource leaks.
+    const donorMatch** ranked;
+    int count = rankCleanedDonors(potentialDonors, size, topK, scratch, &ranked);
 
-    *size = donorCount; // Update the size variable with the total number of potential donors found.
-    return donors; // Return the dynamically allocated array of potential donors to the caller.
+    printf("Potential Donors Details\n------------------------\n");
+    // Loop through each ranked donor and print their details
+    for (int i = 0; i < count; i++) {
+        printf("%d. %-30s %s %d\n", i + 1, ranked[i]->donor.name, ranked[i]->donor.id, ranked[i]->matches);
+    }
 }
 
 
 
 
+/**
+ * @brief Prints the best potential bone marrow donors (see `printRankedDonors`).
+ * 
+ * @param potentialDonors Pointer to an array of potential donors with their match counts.
+ * @param size The number of potential donors in the array.
+ * @param topK The number of donors to print; 0 prints all of them.
+ */
+void printTopPotentialDonors(const donorMatch* potentialDonors, int size, int topK) {
+    queryArena scratch;
+    initQueryArena(&scratch);
+    printRankedDonors(potentialDonors, size, topK, &scratch);
+    freeQueryArena(&scratch);
+}
+
+
+
 
 /**
  * @brief Prints the list of potential bone marrow donors.
  * 
- * This function displays the details of potential donors from a given array
- * of donor structures. If no donors are found (size is 0), it notifies the user.
+ * This function displays the details of all potential donors from a given array
+ * of donor structures, best matches first. If no donors are found (size is 0), it notifies the user.
  * 
- * @param potentialDonors Pointer to an array of person structures representing potential donors.
+ * @param potentialDonors Pointer to an array of potential donors with their match counts.
  * @param size The number of potential donors in the array.
  * 
  * Example Output:
  * Potential Donors Details
  * ------------------------
- * 1. John Doe                     123456789
- * 2. Jane Smith                   987654321
+ * 1. John Doe                     123456789 5
+ * 2. Jane Smith                   987654321 4
  */
 
-void printPotentialDonorsList(person* potentialDonors, int size) {
-    if (size == 0) {
-        printf("No potential donors found.\n");
-        return; // Exit if no donors are available
+void printPotentialDonorsList(const donorMatch* potentialDonors, int size) {
+    printTopPotentialDonors(potentialDonors, size, 0);
+}
+
+
+
+
+/**
+ * @brief Identifies the potential donors of many patients with a single pass over the database.
+ * 
+ * The database is read once, in blocks of DONOR_BLOCK_SIZE donors, and every block is scored
+ * against all the patients before the next one is read. This replaces one full scan per patient.
+ * The deltas of the database are read after it (see `scoreDatabaseFile`).
+ * 
+ * @param database A string containing the file name of the donor database (text or binary).
+ * @param patients Array of patients; only their genes are used.
+ * @param numPatients The number of patients.
+ * @param min_match The minimum number of matching genes required for a donor to be considered.
+ * @param results Array of `numPatients` lists. Each is initialised here and receives the donors of
+ *                its patient in database order; the caller frees them with `free(results[i].items)`.
+ * 
+ * @return The number of donors read from the database.
+ * 
+ * @note If the database file cannot be opened, the function prints an error message and exits the program.
+ */
+long getPotentialDonorsBatch(char* database, const person* patients, int numPatients, int min_match, donorList* results) {
+    long donorsRead = 0;
+
+    uint64_t* patientLoci = malloc((size_t)NUM_LOCI * (numPatients > 0 ? numPatients : 1) * sizeof(uint64_t));
+    if (!patientLoci) {
+        perror("Error allocating patients");
+        exit(1);
+    }
+    for (int p = 0; p < numPatients; p++) {
+        initDonorList(&results[p]);
+        for (int locus = 0; locus < NUM_LOCI; locus++) {
+            patientLoci[(size_t)locus * numPatients + p] = alleleKey(patients[p].genes[locus]);
+        }
     }
 
-    //sortDonors(potentialDonors,matchesArray,size);
-    printf("Potential Donors Details\n------------------------\n");
-    // Loop through each potential donor and print their details
-    for (int i = 0; i < size; i++) {
-        cleanName(potentialDonors[i].name);
-        removeLeadingNewline(potentialDonors[i].name);
-        sortDonors(potentialDonors,matchesArray,size);
-        removeLeadingNewline(potentialDonors[i].name);
-        printf("%d. %-30s %s %d\n", i + 1, potentialDonors[i].name, potentialDonors[i].id,matchesArray[i]);
+    int parts = 1 + readDeltaCount(database);
+    for (int part = 0; part < parts; part++) {
+        char partName[FILENAME_MAX];
+        databasePartName(database, part, partName, sizeof(partName));
+        donorsRead += scoreDatabaseFile(partName, patients, patientLoci, numPatients, min_match, results);
     }
+
+    free(patientLoci);
+    return donorsRead;
 }